@@ -0,0 +1,315 @@
+/*
+ * bench_e2e.cpp
+ *
+ *  End-to-end throughput benchmark: drives WebCtl against the loopback
+ *  RangeServer over a matrix of file size x speed profile x worker count.
+ *  Every case runs in a forked child so CPU time and peak RSS can be read
+ *  from wait4() per case. Results are printed as one JSON object per line.
+ *
+ *  Heap allocations made by the workers between a quarter and three
+ *  quarters of each download are counted; the steady state must make
+ *  none, and the exit status is 3 if a clean case did.
+ */
+
+#include <string>
+#include <vector>
+#include <list>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include "../webctl.h"
+#include "rangeserver.h"
+#include "benchutil.h"
+
+using namespace std;
+using namespace PwxGet;
+namespace fs = boost::filesystem;
+
+struct CaseResult {
+	double seconds;
+	bool complete, verified;
+	size_t steadySheets;
+	unsigned long long steadyAllocs;
+	unsigned long long partialWritebacks, writebackWrites, throttledFetches;
+};
+
+// Workers are told apart by the name Tracer::setThreadName gives their thread.
+static boost::atomic<bool> countingAllocs(false);
+static boost::atomic<unsigned long long> workerAllocs(0);
+static __thread int threadKind = 0; // 0 not looked at yet, 1 worker, 2 other
+
+static void countAlloc() {
+	if (!countingAllocs.load(boost::memory_order_relaxed)) return;
+	if (!threadKind) {
+		char name[16] = "";
+		pthread_getname_np(pthread_self(), name, sizeof(name));
+		threadKind = strncmp(name, "worker", 6) == 0? 1: 2;
+	}
+	if (threadKind == 1) workerAllocs.fetch_add(1, boost::memory_order_relaxed);
+}
+
+void *operator new(size_t size) {
+	countAlloc();
+	void *p = malloc(size? size: 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw() {
+	free(p);
+}
+
+static bool verifyOutput(const string &path, size_t fileSize) {
+	const size_t CHUNK = 1024 * 1024;
+	ifstream fin(path.c_str(), ios::binary);
+	if (!fin) return false;
+	vector<char> got(CHUNK), want(CHUNK);
+	size_t offset = 0;
+	while (offset < fileSize) {
+		size_t n = min(CHUNK, fileSize - offset);
+		if (!fin.read(&got[0], n)) return false;
+		fillPattern(&want[0], offset, n);
+		if (memcmp(&got[0], &want[0], n) != 0) return false;
+		offset += n;
+	}
+	return true;
+}
+
+// Body of the forked child; never returns.
+static void runChild(int resultFd, const string &url, const string &savePath,
+		size_t fileSize, const SpeedProfile &profile, size_t workers, double timeout, bool holes,
+		bool affinity, bool flowControl) {
+	CaseResult result;
+	result.seconds = 0.0; result.complete = false; result.verified = false;
+	result.steadySheets = 0; result.steadyAllocs = 0;
+	result.partialWritebacks = 0; result.writebackWrites = 0; result.throttledFetches = 0;
+	try {
+		JobFile job;
+		job.create(url, string(), savePath, false, fileSize, profile.sheetSize);
+		{
+			WebCtl ctl(job, profile, workers);
+			ctl.addProxies(list<string>(1, string()));
+			ctl.reportLevel() = 9999;
+			ctl.sheetCtl().setPageAffinity(affinity);
+			ctl.sheetCtl().setFlowControl(flowControl);
+			if (holes) {
+				// a resume: every other sheet is on disk already
+				FileBuffer &fb = ctl.fileBuffer();
+				vector<char> data(fb.sheetSize());
+				for (size_t i=1; i<fb.sheetCount(); i+=2) {
+					size_t offset = i * fb.sheetSize();
+					fillPattern(&data[0], offset, min(fb.sheetSize(), fileSize - offset));
+					fb.write((const PwxGet::byte*)&data[0], i, 1);
+				}
+				fb.flush();
+			}
+
+			Stopwatch watch;
+			// sheets to download, and those on disk before
+			size_t base = ctl.fileBuffer().doneSheet(),
+					sheetCount = ctl.sheetCtl().sheetCount() - base, windowStart = 0;
+			bool windowOpened = false;
+			ctl.perform();
+			while (watch.seconds() < timeout) {
+				// the steady state: every worker has warmed up its buffers
+				size_t done = ctl.sheetCtl().doneSheet();
+				done = done > base? done - base: 0;
+				// and not before every worker is set up, however few sheets there are
+				if (!windowOpened && ctl.activeWorker() >= workers && done >= sheetCount / 4
+						&& done < sheetCount * 3 / 4) {
+					windowOpened = true;
+					windowStart = done;
+					countingAllocs.store(true);
+				} else if (windowOpened && countingAllocs.load() && done >= sheetCount * 3 / 4) {
+					countingAllocs.store(false);
+					result.steadySheets = done - windowStart;
+				}
+				if (ctl.sheetCtl().allDone() && ctl.activeWorker() == 0) break;
+				// all workers gave up before the job was done
+				if (watch.seconds() > 1.0 && ctl.activeWorker() == 0) break;
+				boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+			}
+			if (countingAllocs.exchange(false))
+				result.steadySheets = ctl.sheetCtl().doneSheet() - base - windowStart;
+			result.steadyAllocs = workerAllocs.load();
+			ctl.flush();
+			result.seconds = watch.seconds();
+			MetricsRegistry &registry = MetricsRegistry::global();
+			result.partialWritebacks = registry.counter("pwxget_cache_writebacks_total",
+					"Pages written back, by completeness.", metricLabels("page", "partial")).value();
+			result.writebackWrites = registry.counter("pwxget_cache_writeback_writes_total",
+					"File writes of write-backs, one per run of contiguous sheets.").value();
+			result.throttledFetches = registry.counter("pwxget_sheetctl_throttled_fetches_total",
+					"Fetches held back while the cache had no room for another page.").value();
+			result.complete = ctl.sheetCtl().allDone() && ctl.activeWorker() == 0;
+			ctl.fileBuffer().close();
+		}
+		job.close();
+		result.verified = result.complete && verifyOutput(savePath, fileSize);
+	} catch (const Exception &ex) {
+		fprintf(stderr, "bench case failed: %s\n", ex.message().c_str());
+	}
+	fs::remove(savePath);
+	fs::remove(savePath + ".pg!");
+	if (write(resultFd, &result, sizeof(result)) != sizeof(result)) _exit(2);
+	_exit(0);
+}
+
+static void usage() {
+	printf(	"pwxget-bench - End-to-end throughput benchmark on a loopback range server.\n"
+			"Usage: pwxget-bench [options]\n"
+			"\n"
+			"  -S [sizes]       File sizes, comma separated (e.g. 8M,64M).\n"
+			"  -P [profiles]    Speed profiles, comma separated (auto,extreme,high,medium,low).\n"
+			"  -W [workers]     Worker counts, comma separated (e.g. 1,4,8).\n"
+			"  -b [rate]        Per-connection bandwidth of the server, 0 for unlimited.\n"
+			"  -l [ms]          Server latency before each response.\n"
+			"  -e [rate]        Fraction of responses that fail (503 or cut off).\n"
+			"  -2               Ignore Range and answer 200 with the whole file.\n"
+			"  -1               Answer a multi-range request with its first range only.\n"
+			"  -0               Answer a multi-range request with 200 and the whole file.\n"
+			"  -H               Resume with every other sheet already downloaded.\n"
+			"  -A               Hand sheets out from the shared scan, no page affinity.\n"
+			"  -F               No flow control: fetches open pages even when the cache is full.\n"
+			"  -T [seconds]     Timeout of a single case.\n"
+			"  -o [dir]         Directory for the downloaded files.\n"
+			"\n"
+			"Exits with 3 if the workers allocated in the steady state of a case\n"
+			"without errors.\n"
+			"  -h, -?           Show usage.\n");
+}
+
+int main(int argc, char **argv) {
+	vector<size_t> sizes, workers;
+	vector<SpeedProfile> profiles;
+	RangeServerConfig config;
+	double timeout = 120.0;
+	bool holes = false, affinity = true, flowControl = true;
+	string dir = fs::temp_directory_path().generic_string();
+
+	sizes.push_back(8 * MB); sizes.push_back(64 * MB);
+	profiles.push_back(SPD_LOW); profiles.push_back(SPD_MEDIUM);
+	profiles.push_back(SPD_HIGH); profiles.push_back(SPD_EXTREME);
+	profiles.push_back(parseProfileList("auto").front());
+	workers.push_back(1); workers.push_back(4); workers.push_back(8);
+
+	try {
+		int opt;
+		while ((opt = getopt(argc, argv, "S:P:W:b:l:e:210HAFT:o:h?")) != -1) {
+			switch (opt) {
+			case 'S': sizes = parseSizeList(optarg); break;
+			case 'W': workers = parseSizeList(optarg); break;
+			case 'P': profiles = parseProfileList(optarg); break;
+			case 'b': config.bandwidth = parseSize(optarg); break;
+			case 'l': config.latencyMs = boost::lexical_cast<size_t>(optarg); break;
+			case 'e': config.errorRate = boost::lexical_cast<double>(optarg); break;
+			case '2': config.ignoreRange = true; break;
+			case '1': config.multiRange = false; break;
+			case '0': config.wholeForMultiRange = true; break;
+			case 'H': holes = true; break;
+			case 'A': affinity = false; break;
+			case 'F': flowControl = false; break;
+			case 'T': timeout = boost::lexical_cast<double>(optarg); break;
+			case 'o': dir = optarg; break;
+			default: usage(); return 1;
+			}
+		}
+	} catch (const boost::bad_lexical_cast &) {
+		usage();
+		return 1;
+	} catch (const ArgumentError &ex) {
+		fprintf(stderr, "%s\n", ex.message().c_str());
+		return 1;
+	}
+
+	int caseNo = 0;
+	bool allocating = false;
+	for (size_t si=0; si<sizes.size(); si++) {
+		config.fileSize = sizes[si];
+		RangeServer server(config);
+		server.start();
+		for (size_t pi=0; pi<profiles.size(); pi++) {
+			for (size_t wi=0; wi<workers.size(); wi++) {
+				string savePath = dir + "/pwxget-bench-" + boost::lexical_cast<string>(getpid())
+						+ "-" + boost::lexical_cast<string>(caseNo++) + ".bin";
+				SpeedProfile profile = profiles[pi];
+				if (profile.name == "auto") {
+					// the server's own settings stand in for a probe
+					ProbeResult probe;
+					probe.rtt = config.latencyMs / 1000.0 + 0.0005;
+					probe.bandwidth = config.bandwidth;
+					profile = autoSpeedProfile(sizes[si], workers[wi], probe);
+				}
+				size_t requestsBefore = server.requestCount(), sentBefore = server.sentBytes();
+				int fds[2];
+				if (pipe(fds) != 0) { perror("pipe"); return 2; }
+				fflush(stdout);
+				pid_t pid = fork();
+				if (pid < 0) { perror("fork"); return 2; }
+				if (pid == 0) {
+					close(fds[0]);
+					runChild(fds[1], server.url(), savePath, sizes[si], profile,
+							workers[wi], timeout, holes, affinity, flowControl);
+				}
+				close(fds[1]);
+				CaseResult result;
+				memset(&result, 0, sizeof(result));
+				bool got = (read(fds[0], &result, sizeof(result)) == sizeof(result));
+				close(fds[0]);
+				int status = 0;
+				struct rusage usage;
+				memset(&usage, 0, sizeof(usage));
+				wait4(pid, &status, 0, &usage);
+
+				JsonLine line;
+				line.add("bench", "e2e");
+				line.add("size", sizes[si]);
+				line.add("profile", profiles[pi].name);
+				line.add("workers", workers[wi]);
+				line.add("bandwidth", config.bandwidth);
+				line.add("latency_ms", config.latencyMs);
+				line.add("error_rate", config.errorRate);
+				line.add("ignore_range", config.ignoreRange);
+				line.add("multi_range", config.multiRange);
+				line.add("whole_for_multi_range", config.wholeForMultiRange);
+				line.add("holes", holes);
+				line.add("page_affinity", affinity);
+				line.add("flow_control", flowControl);
+				line.add("seconds", result.seconds);
+				line.add("mb_per_s", result.seconds > 0? sizes[si] / (double)MB / result.seconds: 0.0);
+				line.add("cpu_user_s", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+				line.add("cpu_sys_s", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+				line.add("peak_rss_kb", (size_t)usage.ru_maxrss);
+				line.add("requests", server.requestCount() - requestsBefore);
+				line.add("served_bytes", server.sentBytes() - sentBefore);
+				line.add("steady_sheets", result.steadySheets);
+				line.add("steady_allocs", (size_t)result.steadyAllocs);
+				line.add("partial_writebacks", (size_t)result.partialWritebacks);
+				line.add("writeback_writes", (size_t)result.writebackWrites);
+				line.add("throttled_fetches", (size_t)result.throttledFetches);
+				line.add("complete", got && result.complete);
+				line.add("verified", got && result.verified);
+				printf("%s\n", line.str().c_str());
+				fflush(stdout);
+				// failures and whole-file answers take the slow path by design
+				if (got && result.complete && result.steadyAllocs > 0 &&
+						config.errorRate == 0 && !config.ignoreRange) allocating = true;
+			}
+		}
+		server.stop();
+	}
+	if (allocating) fprintf(stderr, "Workers allocated in the steady state.\n");
+	return allocating? 3: 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * bench_micro.cpp
+ *
+ *  Component micro-benchmarks for the hot paths below the network:
+ *  SheetCtl::fetch/commit under contention, PagedMemoryCache::commit in
+ *  sequential and random order, FileBuffer::write, and the cost of
+ *  FileBuffer::flush (index packing + JobFile::setData) by sheet count.
+ *
+ *  Every case is set up from scratch for each repetition with fixed seeds,
+ *  and the median of the repetitions is reported so numbers stay comparable
+ *  between runs. With -B the results are compared against an earlier output
+ *  file and the exit code is non-zero when a case got slower than allowed.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include "../webctl.h"
+#include "benchutil.h"
+
+using namespace std;
+using namespace PwxGet;
+namespace fs = boost::filesystem;
+
+static string workDir;
+
+// Deterministic generator, independent of the libc rand() implementation.
+class Lcg {
+public:
+	Lcg(unsigned long long seed) : _s(seed) {}
+	size_t next(size_t bound) {
+		_s = _s * 6364136223846793005ULL + 1442695040888963407ULL;
+		return (size_t)((_s >> 33) % bound);
+	}
+protected:
+	unsigned long long _s;
+};
+
+static string tempPath(const string &name) {
+	return workDir + "/pwxget-micro-" + boost::lexical_cast<string>(getpid()) + "-" + name;
+}
+
+static void removeJob(const string &path) {
+	fs::remove(path);
+	fs::remove(path + ".pg!");
+}
+
+class MicroCase {
+public:
+	MicroCase(const string &name, const string &param) : name(name), param(param) {}
+	virtual ~MicroCase() {}
+	virtual void setUp() {}
+	virtual size_t run() = 0;	// returns the number of operations done
+	virtual void tearDown() {}
+	string name, param;
+};
+
+// A job file plus its data file, recreated for each repetition.
+class JobCase : public MicroCase {
+public:
+	JobCase(const string &name, const string &param, size_t sheetSize, size_t sheetCount) :
+		MicroCase(name, param), _sheetSize(sheetSize), _sheetCount(sheetCount),
+		_path(tempPath(name + "-" + param)), _job(NULL), _fb(NULL) {}
+	virtual void setUp() {
+		removeJob(_path);
+		_job = new JobFile();
+		_job->create("http://127.0.0.1/", string(), _path, false, _sheetSize * _sheetCount, _sheetSize);
+		_fb = new FileBuffer(_path, _job->fileSize(), *_job, _sheetSize);
+	}
+	virtual void tearDown() {
+		delete _fb; _fb = NULL;
+		delete _job; _job = NULL;
+		removeJob(_path);
+	}
+protected:
+	size_t _sheetSize, _sheetCount;
+	string _path;
+	JobFile *_job;
+	FileBuffer *_fb;
+};
+
+class SheetCtlContention : public JobCase {
+public:
+	SheetCtlContention(size_t threads) : JobCase("sheetctl.fetch_commit",
+			"threads=" + boost::lexical_cast<string>(threads), 4 * KB, 16384),
+			_threads(threads), _ctl(NULL) {}
+	virtual void setUp() {
+		JobCase::setUp();
+		_ctl = new SheetCtl(*_fb, DEFAULT_PAGE_SIZE, DEFAULT_PAGE_COUNT);
+	}
+	virtual size_t run() {
+		boost::thread_group group;
+		for (size_t i=0; i<_threads; i++)
+			group.create_thread(boost::bind(&SheetCtlContention::loop, this));
+		group.join_all();
+		_ctl->flush();
+		return _sheetCount;
+	}
+	virtual void tearDown() {
+		delete _ctl; _ctl = NULL;
+		JobCase::tearDown();
+	}
+protected:
+	size_t _threads;
+	SheetCtl *_ctl;
+	void loop() {
+		vector<char> data(_sheetSize, 'x');
+		size_t sheet, token;
+		while (_ctl->fetch(sheet, token)) {
+			_ctl->commit(sheet, token, &data[0]);
+		}
+	}
+};
+
+class CacheCommit : public JobCase {
+public:
+	CacheCommit(bool random) : JobCase("cache.commit", random? "order=random": "order=sequential",
+			16 * KB, 8192), _random(random), _cache(NULL) {}
+	virtual void setUp() {
+		JobCase::setUp();
+		_cache = new PagedMemoryCache(*_fb, DEFAULT_PAGE_SIZE, DEFAULT_PAGE_COUNT);
+		_order.resize(_sheetCount);
+		for (size_t i=0; i<_sheetCount; i++) _order[i] = i;
+		if (_random) {
+			Lcg rng(42);
+			for (size_t i=_sheetCount-1; i>0; i--) swap(_order[i], _order[rng.next(i+1)]);
+		}
+		_data.assign(_sheetSize, 'x');
+	}
+	virtual size_t run() {
+		for (size_t i=0; i<_sheetCount; i++) _cache->commit(_order[i], &_data[0]);
+		_cache->flush();
+		return _sheetCount;
+	}
+	virtual void tearDown() {
+		delete _cache; _cache = NULL;
+		JobCase::tearDown();
+	}
+protected:
+	bool _random;
+	PagedMemoryCache *_cache;
+	vector<size_t> _order;
+	vector<char> _data;
+};
+
+class FileBufferWrite : public JobCase {
+public:
+	FileBufferWrite(size_t run) : JobCase("filebuffer.write",
+			"sheets_per_write=" + boost::lexical_cast<string>(run), 64 * KB, 1024), _run(run) {}
+	virtual void setUp() {
+		JobCase::setUp();
+		_data.assign(_sheetSize * _run, 'x');
+	}
+	virtual size_t run() {
+		for (size_t i=0; i<_sheetCount; i+=_run)
+			_fb->write((const PwxGet::byte*)&_data[0], i, min(_run, _sheetCount - i));
+		_fb->flush();
+		return _sheetCount;
+	}
+protected:
+	size_t _run;
+	vector<char> _data;
+};
+
+class IndexFlush : public JobCase {
+public:
+	IndexFlush(size_t sheetCount) : JobCase("filebuffer.flush",
+			"sheets=" + boost::lexical_cast<string>(sheetCount), 4 * KB, sheetCount) {}
+	virtual size_t run() {
+		const size_t ROUNDS = 64;
+		for (size_t i=0; i<ROUNDS; i++) _fb->flush();
+		return ROUNDS;
+	}
+};
+
+struct Baseline {
+	double nsPerOp;
+};
+
+static map<string, Baseline> readBaseline(const string &path) {
+	map<string, Baseline> ret;
+	ifstream fin(path.c_str());
+	string line;
+	while (getline(fin, line)) {
+		string name = JsonLine::field(line, "name"), param = JsonLine::field(line, "param"),
+				ns = JsonLine::field(line, "ns_per_op");
+		if (name.empty() || ns.empty()) continue;
+		try {
+			Baseline b;
+			b.nsPerOp = boost::lexical_cast<double>(ns);
+			ret[name + " " + param] = b;
+		} catch (const boost::bad_lexical_cast &) {}
+	}
+	return ret;
+}
+
+static void usage() {
+	printf(	"pwxget-micro - Component micro-benchmarks.\n"
+			"Usage: pwxget-micro [options]\n"
+			"\n"
+			"  -r [count]       Repetitions per case (median is reported).\n"
+			"  -f [filter]      Only run cases whose name contains filter.\n"
+			"  -B [file]        Compare against the output of an earlier run.\n"
+			"  -t [percent]     Allowed slowdown against the baseline.\n"
+			"  -o [dir]         Directory for temporary files.\n"
+			"  -h, -?           Show usage.\n");
+}
+
+int main(int argc, char **argv) {
+	size_t reps = 5;
+	string filter, baselinePath;
+	double tolerance = 10.0;
+	workDir = fs::temp_directory_path().generic_string();
+
+	try {
+		int opt;
+		while ((opt = getopt(argc, argv, "r:f:B:t:o:h?")) != -1) {
+			switch (opt) {
+			case 'r': reps = max((size_t)1, boost::lexical_cast<size_t>(optarg)); break;
+			case 'f': filter = optarg; break;
+			case 'B': baselinePath = optarg; break;
+			case 't': tolerance = boost::lexical_cast<double>(optarg); break;
+			case 'o': workDir = optarg; break;
+			default: usage(); return 1;
+			}
+		}
+	} catch (const boost::bad_lexical_cast &) {
+		usage();
+		return 1;
+	}
+
+	vector<MicroCase*> cases;
+	size_t threads[] = {1, 2, 4, 8};
+	for (size_t i=0; i<4; i++) cases.push_back(new SheetCtlContention(threads[i]));
+	cases.push_back(new CacheCommit(false));
+	cases.push_back(new CacheCommit(true));
+	size_t runs[] = {1, 8, 64};
+	for (size_t i=0; i<3; i++) cases.push_back(new FileBufferWrite(runs[i]));
+	size_t sheetCounts[] = {1024, 16384, 262144, 4194304};
+	for (size_t i=0; i<4; i++) cases.push_back(new IndexFlush(sheetCounts[i]));
+
+	map<string, Baseline> baseline;
+	if (!baselinePath.empty()) baseline = readBaseline(baselinePath);
+
+	int ret = 0;
+	for (size_t i=0; i<cases.size(); i++) {
+		MicroCase &c = *cases[i];
+		if (!filter.empty() && c.name.find(filter) == string::npos) continue;
+		vector<double> samples;
+		size_t ops = 0;
+		try {
+			// one warm-up round, then the measured ones
+			for (size_t r=0; r<=reps; r++) {
+				c.setUp();
+				Stopwatch watch;
+				ops = c.run();
+				double seconds = watch.seconds();
+				c.tearDown();
+				if (r > 0) samples.push_back(seconds);
+			}
+		} catch (const Exception &ex) {
+			fprintf(stderr, "%s %s failed: %s\n", c.name.c_str(), c.param.c_str(), ex.message().c_str());
+			c.tearDown();
+			ret = 2;
+			continue;
+		}
+		sort(samples.begin(), samples.end());
+		double median = samples[samples.size() / 2];
+		double nsPerOp = median * 1e9 / ops;
+
+		JsonLine line;
+		line.add("bench", "micro");
+		line.add("name", c.name);
+		line.add("param", c.param);
+		line.add("reps", reps);
+		line.add("ops", ops);
+		line.add("median_s", median);
+		line.add("min_s", samples.front());
+		line.add("max_s", samples.back());
+		line.add("ns_per_op", nsPerOp);
+		line.add("ops_per_s", ops / median);
+		map<string, Baseline>::const_iterator it = baseline.find(c.name + " " + c.param);
+		if (it != baseline.end()) {
+			double change = (nsPerOp / it->second.nsPerOp - 1.0) * 100.0;
+			line.add("baseline_ns_per_op", it->second.nsPerOp);
+			line.add("change_pct", change);
+			line.add("regression", change > tolerance);
+			if (change > tolerance) ret = 3;
+		}
+		printf("%s\n", line.str().c_str());
+		fflush(stdout);
+	}
+
+	for (size_t i=0; i<cases.size(); i++) delete cases[i];
+	return ret;
+}
@@ -0,0 +1,112 @@
+/*
+ * benchutil.h
+ *
+ *  Small helpers shared by the benchmarks: a monotonic stopwatch, argument
+ *  parsing and one-line JSON records.
+ */
+
+#ifndef BENCHUTIL_H_
+#define BENCHUTIL_H_
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <time.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include "../webctl.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	class Stopwatch {
+	public:
+		inline Stopwatch() { reset(); }
+		inline void reset() { clock_gettime(CLOCK_MONOTONIC, &_start); }
+		inline double seconds() const {
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			return (now.tv_sec - _start.tv_sec) + (now.tv_nsec - _start.tv_nsec) / 1e9;
+		}
+	protected:
+		timespec _start;
+	};
+
+	inline vector<size_t> parseSizeList(const string &text) {
+		vector<string> items;
+		vector<size_t> ret;
+		boost::split(items, text, boost::is_any_of(","));
+		for (size_t i=0; i<items.size(); i++) {
+			if (!items[i].empty()) ret.push_back(parseSize(items[i]));
+		}
+		return ret;
+	}
+
+	inline vector<SpeedProfile> parseProfileList(const string &text) {
+		vector<string> items;
+		vector<SpeedProfile> ret;
+		boost::split(items, text, boost::is_any_of(","));
+		for (size_t i=0; i<items.size(); i++) {
+			// placeholder, resolved per case by autoSpeedProfile()
+			if (items[i] == "auto") ret.push_back(SpeedProfile(0, 0, 0, 0, "auto"));
+			else if (items[i] == "extreme") ret.push_back(SPD_EXTREME);
+			else if (items[i] == "high") ret.push_back(SPD_HIGH);
+			else if (items[i] == "medium") ret.push_back(SPD_MEDIUM);
+			else if (items[i] == "low") ret.push_back(SPD_LOW);
+			else throw ArgumentError(items[i], items[i] + " is not a speed profile.");
+		}
+		return ret;
+	}
+
+	/**
+	 * One flat JSON object, fields kept in insertion order so that runs
+	 * can be diffed line by line.
+	 */
+	class JsonLine {
+	public:
+		inline void add(const string &key, const string &value) {
+			string escaped;
+			for (size_t i=0; i<value.size(); i++) {
+				if (value[i] == '"' || value[i] == '\\') escaped += '\\';
+				escaped += value[i];
+			}
+			raw(key, "\"" + escaped + "\"");
+		}
+		inline void add(const string &key, const char *value) { add(key, string(value)); }
+		inline void add(const string &key, size_t value) {
+			raw(key, boost::lexical_cast<string>(value));
+		}
+		inline void add(const string &key, double value) {
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), "%.6g", value);
+			raw(key, buffer);
+		}
+		inline void add(const string &key, bool value) { raw(key, value? "true": "false"); }
+		inline const string str() const { return "{" + _body + "}"; }
+
+		/**
+		 * Pick the raw value of a field out of a line written by str().
+		 * Strings are returned unquoted; missing fields give "".
+		 */
+		static inline string field(const string &line, const string &key) {
+			string tag = "\"" + key + "\": ";
+			size_t pos = line.find(tag);
+			if (pos == string::npos) return string();
+			pos += tag.size();
+			if (pos < line.size() && line[pos] == '"') {
+				size_t end = line.find('"', pos+1);
+				return end == string::npos? string(): line.substr(pos+1, end-pos-1);
+			}
+			size_t end = line.find_first_of(",}", pos);
+			return boost::trim_copy(line.substr(pos, end == string::npos? string::npos: end-pos));
+		}
+	protected:
+		string _body;
+		inline void raw(const string &key, const string &value) {
+			if (!_body.empty()) _body += ", ";
+			_body += "\"" + key + "\": " + value;
+		}
+	};
+}
+
+#endif /* BENCHUTIL_H_ */
@@ -0,0 +1,338 @@
+/*
+ * rangeserver.cpp
+ *
+ *  Loopback HTTP/1.1 range server for the benchmarks.
+ */
+
+#include "rangeserver.h"
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
+
+namespace PwxGet {
+	void fillPattern(char *dst, size_t offset, size_t n) throw() {
+		for (size_t i=0; i<n; i++) {
+			dst[i] = (char)patternByte(offset + i);
+		}
+	}
+
+	static bool sendAll(int fd, const char *data, size_t n) {
+		while (n > 0) {
+			ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+			if (sent < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			data += sent;
+			n -= sent;
+		}
+		return true;
+	}
+
+	typedef vector<pair<size_t, size_t> > ByteRanges;
+
+	// "a-b", "a-" or "-n"
+	static bool parseRangeSpec(const string &value, size_t fileSize, size_t &start, size_t &end) {
+		string spec = boost::trim_copy(value);
+		size_t dash = spec.find('-');
+		if (dash == string::npos) return false;
+		string a = boost::trim_copy(spec.substr(0, dash)),
+				b = boost::trim_copy(spec.substr(dash+1));
+		try {
+			if (a.empty()) {
+				size_t n = boost::lexical_cast<size_t>(b);
+				if (n == 0) return false;
+				start = n >= fileSize? 0: fileSize - n;
+				end = fileSize - 1;
+			} else {
+				start = boost::lexical_cast<size_t>(a);
+				end = b.empty()? fileSize - 1: boost::lexical_cast<size_t>(b);
+				if (end >= fileSize) end = fileSize - 1;
+			}
+		} catch (const boost::bad_lexical_cast &) {
+			return false;
+		}
+		return start <= end && start < fileSize;
+	}
+
+	// "bytes=spec,spec,..."; the ranges are served as asked, never coalesced
+	static bool parseRange(const string &value, size_t fileSize, ByteRanges &ranges) {
+		string spec = boost::trim_copy(value);
+		if (!boost::istarts_with(spec, "bytes=")) return false;
+		vector<string> specs;
+		boost::split(specs, spec.substr(6), boost::is_any_of(","));
+		ranges.clear();
+		for (size_t i=0; i<specs.size(); i++) {
+			size_t start, end;
+			if (!parseRangeSpec(specs[i], fileSize, start, end)) return false;
+			ranges.push_back(make_pair(start, end));
+		}
+		return !ranges.empty();
+	}
+
+	static const char *BOUNDARY = "PWXGET_BENCH_BOUNDARY";
+
+	RangeServer::RangeServer(const RangeServerConfig &config) : _config(config),
+			_listenFd(-1), _port(0), _running(false), _acceptThread(NULL), _mutex(),
+			_requests(0), _errors(0), _sent(0), _randState(config.seed) {
+	}
+
+	RangeServer::~RangeServer() {
+		stop();
+	}
+
+	const string RangeServer::url() const {
+		return "http://127.0.0.1:" + boost::lexical_cast<string>(_port) + "/file.bin";
+	}
+
+	void RangeServer::start() {
+		if (_running) throw OperationCannotEmit("Range server is running.");
+		_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+		if (_listenFd < 0) throw RuntimeError("Cannot create server socket.");
+		int on = 1;
+		setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		socklen_t len = sizeof(addr);
+		if (bind(_listenFd, (sockaddr*)&addr, sizeof(addr)) != 0
+				|| listen(_listenFd, 128) != 0
+				|| getsockname(_listenFd, (sockaddr*)&addr, &len) != 0) {
+			close(_listenFd);
+			_listenFd = -1;
+			throw RuntimeError("Cannot listen on loopback interface.");
+		}
+		_port = ntohs(addr.sin_port);
+		_running = true;
+		_acceptThread = new boost::thread(boost::bind(&RangeServer::acceptLoop, this));
+	}
+
+	void RangeServer::stop() {
+		{
+			Mutex::scoped_lock lock(_mutex);
+			if (!_running) return;
+			_running = false;
+		}
+		shutdown(_listenFd, SHUT_RDWR);
+		close(_listenFd);
+		_listenFd = -1;
+		if (_acceptThread) {
+			_acceptThread->join();
+			delete _acceptThread;
+			_acceptThread = NULL;
+		}
+	}
+
+	bool RangeServer::isRunning() {
+		Mutex::scoped_lock lock(_mutex);
+		return _running;
+	}
+
+	size_t RangeServer::requestCount() {
+		Mutex::scoped_lock lock(_mutex);
+		return _requests;
+	}
+
+	size_t RangeServer::errorCount() {
+		Mutex::scoped_lock lock(_mutex);
+		return _errors;
+	}
+
+	size_t RangeServer::sentBytes() {
+		Mutex::scoped_lock lock(_mutex);
+		return _sent;
+	}
+
+	int RangeServer::failureMode() {
+		Mutex::scoped_lock lock(_mutex);
+		++_requests;
+		if (_config.errorRate <= 0.0) return FAIL_NONE;
+		double r = double(rand_r(&_randState)) / (double(RAND_MAX) + 1.0);
+		if (r >= _config.errorRate) return FAIL_NONE;
+		++_errors;
+		return (rand_r(&_randState) & 1)? FAIL_UNAVAILABLE: FAIL_TRUNCATE;
+	}
+
+	void RangeServer::acceptLoop() {
+		boost::thread_group connections;
+		while (isRunning()) {
+			int fd = accept(_listenFd, NULL, NULL);
+			if (fd < 0) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			int on = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			timeval tv;
+			tv.tv_sec = 0; tv.tv_usec = 200 * 1000;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			connections.create_thread(boost::bind(&RangeServer::serve, this, fd));
+		}
+		// connections notice the stop flag on their next receive timeout
+		connections.join_all();
+	}
+
+	void RangeServer::serve(int fd) {
+		const size_t CHUNK = 64 * 1024;
+		string pending;
+		char chunk[CHUNK];
+		bool keepAlive = true;
+		size_t fileSize = _config.fileSize;
+
+		while (keepAlive && isRunning()) {
+			// read one request head
+			size_t headEnd;
+			bool closed = false;
+			while ((headEnd = pending.find("\r\n\r\n")) == string::npos) {
+				ssize_t n = recv(fd, chunk, CHUNK, 0);
+				if (n > 0) {
+					pending.append(chunk, n);
+				} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+					if (!isRunning()) { closed = true; break; }
+				} else {
+					closed = true;
+					break;
+				}
+			}
+			if (closed) break;
+			string head = pending.substr(0, headEnd);
+			pending.erase(0, headEnd + 4);
+
+			// parse request line & headers
+			vector<string> lines;
+			boost::split(lines, head, boost::is_any_of("\n"));
+			bool headOnly = boost::starts_with(lines[0], "HEAD ");
+			bool hasRange = false;
+			ByteRanges ranges;
+			bool badRange = false;
+			for (size_t i=1; i<lines.size(); i++) {
+				string line = boost::trim_copy(lines[i]);
+				size_t colon = line.find(':');
+				if (colon == string::npos) continue;
+				string name = boost::trim_copy(line.substr(0, colon)),
+						value = boost::trim_copy(line.substr(colon+1));
+				if (boost::iequals(name, "Range") && !_config.ignoreRange) {
+					hasRange = true;
+					badRange = !parseRange(value, fileSize, ranges);
+				} else if (boost::iequals(name, "Connection") && boost::iequals(value, "close")) {
+					keepAlive = false;
+				}
+			}
+
+			if (_config.latencyMs)
+				boost::this_thread::sleep(boost::posix_time::milliseconds(_config.latencyMs));
+
+			// injected failures: either a 503 or a body cut off halfway
+			int failure = failureMode();
+			if (failure == FAIL_UNAVAILABLE) {
+				const char *resp = "HTTP/1.1 503 Service Unavailable\r\n"
+						"Content-Length: 0\r\nConnection: close\r\n\r\n";
+				sendAll(fd, resp, strlen(resp));
+				break;
+			}
+			bool truncate = (failure == FAIL_TRUNCATE);
+
+			// a server without multi-range support answers the first range only, or the whole file
+			if (hasRange && !badRange && ranges.size() > 1 && _config.wholeForMultiRange) hasRange = false;
+			if (hasRange && !badRange && !_config.multiRange) ranges.resize(1);
+			bool multipart = hasRange && ranges.size() > 1;
+			string status, extra;
+			if (badRange) {
+				string resp = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */"
+						+ boost::lexical_cast<string>(fileSize)
+						+ "\r\nContent-Length: 0\r\n\r\n";
+				if (!sendAll(fd, resp.data(), resp.size())) break;
+				continue;
+			} else if (multipart) {
+				status = "206 Partial Content";
+			} else if (hasRange) {
+				status = "206 Partial Content";
+				extra = "Content-Range: bytes " + boost::lexical_cast<string>(ranges[0].first) + "-"
+						+ boost::lexical_cast<string>(ranges[0].second) + "/"
+						+ boost::lexical_cast<string>(fileSize) + "\r\n";
+			} else {
+				status = "200 OK";
+				ranges.assign(1, make_pair((size_t)0, fileSize - 1));
+			}
+			if (!_config.ignoreRange) extra += "Accept-Ranges: bytes\r\n";
+			// the part heads go in between the ranges
+			vector<string> heads(ranges.size());
+			string tail;
+			size_t length = 0;
+			for (size_t i=0; i<ranges.size(); i++) {
+				if (multipart) heads[i] = string(i? "\r\n": "") + "--" + BOUNDARY + "\r\n"
+						"Content-Type: application/octet-stream\r\nContent-Range: bytes "
+						+ boost::lexical_cast<string>(ranges[i].first) + "-"
+						+ boost::lexical_cast<string>(ranges[i].second) + "/"
+						+ boost::lexical_cast<string>(fileSize) + "\r\n\r\n";
+				length += heads[i].size() + ranges[i].second - ranges[i].first + 1;
+			}
+			if (multipart) tail = string("\r\n--") + BOUNDARY + "--\r\n";
+			length += tail.size();
+			string resp = "HTTP/1.1 " + status + "\r\n" + extra
+					+ "Content-Length: " + boost::lexical_cast<string>(length) + "\r\n"
+					+ (multipart? string("Content-Type: multipart/byteranges; boundary=") + BOUNDARY:
+							string("Content-Type: application/octet-stream")) + "\r\n"
+					+ (keepAlive? "": "Connection: close\r\n") + "\r\n";
+			if (!sendAll(fd, resp.data(), resp.size())) break;
+			if (headOnly) continue;
+
+			// body, paced to the configured per-connection bandwidth
+			size_t limit = truncate? length / 2: length;
+			size_t sent = 0, part = 0, partSent = 0;
+			boost::posix_time::ptime began = boost::posix_time::microsec_clock::universal_time();
+			bool failed = false;
+			while (sent < limit) {
+				// next piece: a part head, range bytes or the closing delimiter
+				const char *data = chunk;
+				size_t n;
+				if (part == ranges.size()) {
+					data = tail.data() + partSent;
+					n = tail.size() - partSent;
+				} else if (partSent < heads[part].size()) {
+					data = heads[part].data() + partSent;
+					n = heads[part].size() - partSent;
+				} else {
+					size_t offset = partSent - heads[part].size();
+					n = min(CHUNK, ranges[part].second - ranges[part].first + 1 - offset);
+					fillPattern(chunk, ranges[part].first + offset, n);
+				}
+				n = min(n, limit - sent);
+				if (!sendAll(fd, data, n)) { failed = true; break; }
+				sent += n;
+				partSent += n;
+				if (part < ranges.size() && partSent == heads[part].size()
+						+ ranges[part].second - ranges[part].first + 1) {
+					++part;
+					partSent = 0;
+				}
+				if (_config.bandwidth) {
+					long long due = (long long)(sent * 1000000.0 / _config.bandwidth);
+					long long elapsed = (boost::posix_time::microsec_clock::universal_time()
+							- began).total_microseconds();
+					if (due > elapsed)
+						boost::this_thread::sleep(boost::posix_time::microseconds(due - elapsed));
+				}
+			}
+			{
+				Mutex::scoped_lock lock(_mutex);
+				_sent += sent;
+			}
+			if (failed || truncate) break;
+		}
+		close(fd);
+	}
+}
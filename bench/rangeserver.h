@@ -0,0 +1,83 @@
+/*
+ * rangeserver.h
+ *
+ *  Loopback HTTP/1.1 server used by the benchmarks. It serves one
+ *  synthetic file whose content can be regenerated from the offset alone,
+ *  so downloads can be verified without keeping a copy around.
+ */
+
+#ifndef RANGESERVER_H_
+#define RANGESERVER_H_
+
+#include <string>
+#include <boost/thread.hpp>
+#include "../exceptions.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	/**
+	 * Content of the synthetic file at a given offset.
+	 */
+	inline unsigned char patternByte(size_t offset) throw() {
+		size_t x = offset / 4093;
+		return (unsigned char)((offset * 31) ^ (x * 131) ^ (x >> 8));
+	}
+	void fillPattern(char *dst, size_t offset, size_t n) throw();
+
+	struct RangeServerConfig {
+	public:
+		inline RangeServerConfig() : fileSize(0), bandwidth(0), latencyMs(0),
+				errorRate(0.0), ignoreRange(false), multiRange(true), wholeForMultiRange(false), seed(1) {}
+		size_t fileSize;
+		size_t bandwidth;	// bytes/s per connection, 0 for unlimited
+		size_t latencyMs;	// delay before each response
+		double errorRate;	// probability of a failed response
+		bool ignoreRange;	// answer 200 with the whole file
+		bool multiRange;	// answer several ranges as multipart/byteranges, else the first only
+		bool wholeForMultiRange;	// answer several ranges with 200 and the whole file
+		unsigned int seed;
+	};
+
+	class RangeServer {
+	public:
+		RangeServer(const RangeServerConfig &config);
+		virtual ~RangeServer();
+
+		// bind 127.0.0.1 on an ephemeral port and start accepting
+		void start();
+		void stop();
+
+		inline const RangeServerConfig &config() const throw() { return _config; }
+		inline int port() const throw() { return _port; }
+		const string url() const;
+
+		// statistics
+		size_t requestCount();
+		size_t errorCount();
+		size_t sentBytes(); // response bodies, as far as they went out
+
+	protected:
+		typedef boost::mutex Mutex;
+		static const int FAIL_NONE = 0, FAIL_UNAVAILABLE = 1, FAIL_TRUNCATE = 2;
+
+		RangeServerConfig _config;
+		int _listenFd, _port;
+		bool _running;
+		boost::thread *_acceptThread;
+		Mutex _mutex;
+		size_t _requests, _errors, _sent;
+		unsigned int _randState;
+
+		void acceptLoop();
+		void serve(int fd);
+		int failureMode();
+		bool isRunning();
+
+	private:
+		RangeServer(const RangeServer &);
+		RangeServer &operator=(const RangeServer &);
+	};
+}
+
+#endif /* RANGESERVER_H_ */
@@ -0,0 +1,235 @@
+/*
+ * chunkcache.cpp
+ */
+
+#include "chunkcache.h"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include "filebuffer.h"
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+namespace fs = boost::filesystem;
+
+namespace PwxGet {
+
+	namespace {
+		// FNV-1a, enough to spread names; the key file settles collisions
+		const string hashName(const string &key) {
+			unsigned long long h = 14695981039346656037ULL;
+			for (size_t i=0; i<key.size(); i++) {
+				h ^= (unsigned char)key[i];
+				h *= 1099511628211ULL;
+			}
+			char name[17];
+			snprintf(name, sizeof(name), "%016llx", h);
+			return name;
+		}
+
+		struct CachedChunk {
+			time_t used;
+			size_t size;
+			fs::path path;
+			bool operator<(const CachedChunk &other) const { return used < other.used; }
+		};
+	}
+
+	const int ChunkCache::STALE_TEMP_SECONDS;
+
+	ChunkCache::ChunkCache(const string &dir, size_t capacity) : _dir(dir),
+			_lockPath((fs::path(dir) / "lock").string()), _capacity(capacity), _mutex(),
+			_trimMutex(), _size(0), _nextTemp(0),
+			_hits(MetricsRegistry::global().counter("pwxget_chunk_cache_lookups_total",
+					"Chunk cache lookups, by result.", metricLabels("result", "hit"))),
+			_misses(MetricsRegistry::global().counter("pwxget_chunk_cache_lookups_total",
+					"Chunk cache lookups, by result.", metricLabels("result", "miss"))),
+			_stored(MetricsRegistry::global().counter("pwxget_chunk_cache_stored_bytes_total",
+					"Bytes written into the chunk cache.")),
+			_evicted(MetricsRegistry::global().counter("pwxget_chunk_cache_evicted_bytes_total",
+					"Bytes evicted from the chunk cache.")) {
+		boost::system::error_code ec;
+		fs::create_directories(_dir, ec);
+		ofstream lock(_lockPath.c_str(), ios::app);
+		if (ec || !lock)
+			throw IOException(_dir, "Cannot create chunk cache " + _dir + ".");
+		lock.close();
+		trim();
+	}
+
+	ChunkCache::~ChunkCache() throw() {
+	}
+
+	const string ChunkCache::chunkPath(const string &object, size_t offset, size_t length) const {
+		return (fs::path(_dir) / object / (boost::lexical_cast<string>(offset) + "-" +
+				boost::lexical_cast<string>(length))).string();
+	}
+
+	const string ChunkCache::object(const string &url, const string &validator, size_t fileSize) {
+		if (validator.empty()) return string();
+		string key = url + "\n" + validator + "\n" + boost::lexical_cast<string>(fileSize) + "\n";
+		string name = hashName(key);
+		fs::path keyPath = fs::path(_dir) / name / "key";
+		try {
+			fs::create_directories(keyPath.parent_path());
+			if (fs::exists(keyPath)) return readfile(keyPath.string()) == key? name: string();
+			// racing writers write the same key
+			fs::path temp = keyPath.parent_path() / (".tmp-key-" + boost::lexical_cast<string>(getpid()));
+			writefile(temp.string(), key);
+			fs::rename(temp, keyPath);
+		} catch (const fs::filesystem_error &) {
+			return string();
+		} catch (const IOException &) {
+			return string();
+		}
+		return name;
+	}
+
+	void ChunkCache::list(const string &object, ChunkMap &chunks) {
+		chunks.clear();
+		if (object.empty()) return;
+		boost::system::error_code ec;
+		for (fs::directory_iterator it(fs::path(_dir) / object, ec), end; !ec && it != end; it.increment(ec)) {
+			string name = it->path().filename().string();
+			size_t dash = name.find('-');
+			if (dash == 0 || dash == string::npos) continue; // key, temporaries
+			try {
+				size_t offset = boost::lexical_cast<size_t>(name.substr(0, dash)),
+						length = boost::lexical_cast<size_t>(name.substr(dash + 1));
+				// of chunks at one offset the longest
+				size_t &known = chunks[offset];
+				known = max(known, length);
+			} catch (const boost::bad_lexical_cast &) {
+			}
+		}
+	}
+
+	bool ChunkCache::find(const string &object, const ChunkMap &chunks, size_t offset, size_t length,
+			vector<FileBuffer::Source> &pieces) {
+		pieces.clear();
+		size_t pos = offset, end = offset + length;
+		while (pos < end) {
+			ChunkMap::const_iterator it = chunks.upper_bound(pos);
+			if (it == chunks.begin() || (--it)->first + it->second <= pos) {
+				pieces.clear();
+				_misses.inc();
+				return false;
+			}
+			FileBuffer::Source piece;
+			piece.path = chunkPath(object, it->first, it->second);
+			piece.offset = pos - it->first;
+			piece.length = min(it->first + it->second, end) - pos;
+			pieces.push_back(piece);
+			pos += piece.length;
+		}
+		boost::system::error_code ec;
+		for (size_t i=0; i<pieces.size(); i++) fs::last_write_time(pieces[i].path, time(NULL), ec);
+		_hits.inc();
+		return true;
+	}
+
+	bool ChunkCache::load(const vector<FileBuffer::Source> &pieces, char *buffer) {
+		for (size_t i=0; i<pieces.size(); i++) {
+			ifstream in(pieces[i].path.c_str(), ios::binary);
+			if (!in.seekg(pieces[i].offset) || !in.read(buffer, pieces[i].length)) return false;
+			buffer += pieces[i].length;
+		}
+		return true;
+	}
+
+	void ChunkCache::store(const string &object, size_t offset, size_t length, const char *data) {
+		if (object.empty()) return;
+		string path = chunkPath(object, offset, length);
+		size_t n;
+		{
+			Mutex::scoped_lock lock(_mutex);
+			n = _nextTemp++;
+		}
+		fs::path temp = fs::path(_dir) / object / (".tmp-" + boost::lexical_cast<string>(getpid()) +
+				"-" + boost::lexical_cast<string>(n));
+		boost::system::error_code ec;
+		{
+			ofstream out(temp.string().c_str(), ios::binary | ios::trunc);
+			if (!out) return; // the object was trimmed away
+			if (!out.write(data, length) || (out.close(), !out)) {
+				fs::remove(temp, ec);
+				return;
+			}
+		}
+		fs::rename(temp, path, ec);
+		if (ec) {
+			fs::remove(temp, ec);
+			return;
+		}
+		_stored.inc(length);
+		bool full;
+		{
+			Mutex::scoped_lock lock(_mutex);
+			_size += length;
+			full = _size > _capacity;
+		}
+		if (full) trim();
+	}
+
+	void ChunkCache::trim() {
+		Mutex::scoped_try_lock local(_trimMutex);
+		if (!local.owns_lock()) return;
+		boost::interprocess::file_lock lock;
+		try {
+			boost::interprocess::file_lock(_lockPath.c_str()).swap(lock);
+			if (!lock.try_lock()) return;
+		} catch (const boost::interprocess::interprocess_exception &) {
+			return;
+		}
+
+		vector<CachedChunk> chunks;
+		size_t total = 0;
+		time_t now = time(NULL);
+		try {
+			for (fs::directory_iterator obj(_dir), end; obj != end; ++obj) {
+				if (!fs::is_directory(obj->status())) continue;
+				for (fs::directory_iterator it(obj->path()); it != end; ++it) {
+					string name = it->path().filename().string();
+					if (name == "key" || !fs::is_regular_file(it->status())) continue;
+					CachedChunk chunk;
+					chunk.used = fs::last_write_time(it->path());
+					chunk.path = it->path();
+					if (boost::starts_with(name, ".tmp-")) {
+						if (now - chunk.used > STALE_TEMP_SECONDS) fs::remove(chunk.path);
+						continue;
+					}
+					chunk.size = fs::file_size(chunk.path);
+					chunks.push_back(chunk);
+					total += chunk.size;
+				}
+			}
+		} catch (const fs::filesystem_error &) {
+			// a writer or reader raced the scan; the next trim redoes it
+			lock.unlock();
+			return;
+		}
+
+		if (total > _capacity) {
+			sort(chunks.begin(), chunks.end());
+			size_t target = _capacity / 10 * 9;
+			boost::system::error_code ec;
+			for (size_t i=0; i<chunks.size() && total > target; i++) {
+				if (!fs::remove(chunks[i].path, ec)) continue;
+				total -= chunks[i].size;
+				_evicted.inc(chunks[i].size);
+			}
+		}
+		lock.unlock();
+		Mutex::scoped_lock mylock(_mutex);
+		_size = total;
+	}
+}
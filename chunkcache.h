@@ -0,0 +1,88 @@
+/*
+ * chunkcache.h
+ *
+ *  Sheets of earlier downloads kept on disk and shared by every job and
+ *  every pwxget process on the host, so a file fetched again (onto another
+ *  volume, or after its output was lost) is copied locally instead.
+ *
+ *  An object is one version of one file: effective URL, validator (strong
+ *  ETag, else Last-Modified) and size. Its chunks are byte ranges, one
+ *  file each:
+ *
+ *    <dir>/<hash>/key               the object key, to catch hash collisions
+ *    <dir>/<hash>/<offset>-<length> the bytes
+ *
+ *  Jobs may cut the file into sheets of other sizes, so a sheet is read
+ *  from whichever chunks cover its range.
+ *
+ *  Chunks are written under a temporary name and renamed into place, so a
+ *  reader sees a whole chunk or none. The modification time marks the last
+ *  use; the least recently used chunks go once the cache outgrows its cap.
+ *  One process at a time trims, holding <dir>/lock.
+ */
+
+#ifndef CHUNKCACHE_H_
+#define CHUNKCACHE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/thread.hpp>
+#include "filebuffer.h"
+#include "metrics.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	const size_t DEFAULT_CHUNK_CACHE_SIZE = (size_t)1 << 30;
+
+	class ChunkCache {
+	public:
+		/**
+		 * @param dir: Cache directory, created if missing. Throws IOException.
+		 * @param capacity: Bytes of chunks to keep; trimmed to 9/10 of it when exceeded.
+		 */
+		ChunkCache(const string &dir, size_t capacity=DEFAULT_CHUNK_CACHE_SIZE);
+		virtual ~ChunkCache() throw();
+
+		inline const string &dir() const throw() { return _dir; }
+		inline size_t capacity() const throw() { return _capacity; }
+
+		/**
+		 * Name the object for one version of a file.
+		 * @return Empty when it cannot be cached: no validator, or the
+		 * 		name is taken by another key.
+		 */
+		const string object(const string &url, const string &validator, size_t fileSize);
+		typedef map<size_t, size_t> ChunkMap; // offset -> length
+		// The chunks an object holds now.
+		void list(const string &object, ChunkMap &chunks);
+		/**
+		 * Cover a byte range with pieces of listed chunks, and mark them used.
+		 * @param pieces: In file order, on a hit.
+		 */
+		bool find(const string &object, const ChunkMap &chunks, size_t offset, size_t length,
+				vector<FileBuffer::Source> &pieces);
+		// Read the pieces into buffer; false if one was evicted in between.
+		bool load(const vector<FileBuffer::Source> &pieces, char *buffer);
+		// Best effort: a chunk that cannot be written is left out.
+		void store(const string &object, size_t offset, size_t length, const char *data);
+		// Evict down to the cap; skipped while another process trims.
+		void trim();
+
+		static const int STALE_TEMP_SECONDS = 3600; // leftovers of a crashed writer
+
+	protected:
+		typedef boost::mutex Mutex;
+		string _dir, _lockPath;
+		size_t _capacity;
+		Mutex _mutex, _trimMutex;
+		size_t _size;	// bytes held, as far as this process knows
+		size_t _nextTemp;
+		Counter &_hits, &_misses, &_stored, &_evicted;
+
+		const string chunkPath(const string &object, size_t offset, size_t length) const;
+	};
+}
+
+#endif /* CHUNKCACHE_H_ */
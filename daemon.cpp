@@ -0,0 +1,652 @@
+/*
+ * daemon.cpp
+ *
+ *  Long-running job server on a Unix domain socket, and its client.
+ */
+
+#include "daemon.h"
+
+#ifndef WIN32
+
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+namespace fs = boost::filesystem;
+
+namespace PwxGet {
+	static const int POLL_MS = 200;
+	static const size_t MAX_LINE = 64 * 1024;
+
+	/* socket helpers */
+	static sockaddr_un socketAddress(const string &path) {
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path))
+			throw ArgumentError(path, "Socket path " + path + " is too long.");
+		strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	// -1 if nothing listens there
+	static int connectSocket(const string &path) {
+		sockaddr_un addr = socketAddress(path);
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw IOException(path, "Cannot create socket.");
+		if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	static bool sendLine(int fd, const string &line) {
+		string data = line + "\n";
+		size_t sent = 0;
+		while (sent < data.size()) {
+			ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	/**
+	 * Read one line, keeping what follows it in buffer.
+	 * @param timeoutMs: -1 to wait for ever.
+	 * @return 1 for a line, 0 on timeout, -1 on hang-up or error.
+	 */
+	static int readLine(int fd, string &buffer, string &line, int timeoutMs) {
+		size_t eol;
+		while ((eol = buffer.find('\n')) == string::npos) {
+			if (buffer.size() > MAX_LINE) return -1;
+			pollfd p = {fd, POLLIN, 0};
+			int ready = poll(&p, 1, timeoutMs);
+			if (ready < 0 && errno == EINTR) continue;
+			if (ready < 0) return -1;
+			if (ready == 0) return 0;
+			char chunk[4096];
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return -1;
+			buffer.append(chunk, n);
+		}
+		line = buffer.substr(0, eol);
+		buffer.erase(0, eol + 1);
+		return 1;
+	}
+
+	/* protocol */
+	typedef map<string, string> FieldMap;
+
+	static bool plainField(const string &value) {
+		return value.find_first_of("\t\r\n") == string::npos;
+	}
+
+	static const string oneLine(const string &text) {
+		string ret = text;
+		for (size_t i=0; i<ret.size(); i++) {
+			if (ret[i] == '\t' || ret[i] == '\r' || ret[i] == '\n') ret[i] = ' ';
+		}
+		return ret;
+	}
+
+	static void parseFields(const vector<string> &fields, size_t first, FieldMap &values) {
+		for (size_t i=first; i<fields.size(); i++) {
+			size_t eq = fields[i].find('=');
+			if (eq == string::npos)
+				throw ArgumentError(fields[i], "Field " + fields[i] + " is not key=value.");
+			values[fields[i].substr(0, eq)] = fields[i].substr(eq + 1);
+		}
+	}
+
+	template <typename T>
+	static T fieldValue(const FieldMap &values, const string &key, const T &value) {
+		FieldMap::const_iterator it = values.find(key);
+		if (it == values.end() || it->second.empty()) return value;
+		try {
+			return boost::lexical_cast<T>(it->second);
+		} catch (const boost::bad_lexical_cast &) {
+			throw ArgumentError(key, it->second + " is not a valid " + key + ".");
+		}
+	}
+
+	static const string formatRequest(const JobRequest &request) {
+		if (!plainField(request.url) || !plainField(request.savePath) || !plainField(request.cookies))
+			throw ArgumentError("request", "Tabs and line breaks cannot be sent to the daemon.");
+		return "SUBMIT\turl=" + request.url + "\tpath=" + request.savePath +
+				"\tcookies=" + request.cookies +
+				"\tredirect=" + (request.useRedirectedUrl? "1": "0") +
+				"\tprofile=" + request.profile +
+				"\tlimit=" + boost::lexical_cast<string>(request.rateLimit) +
+				"\tproxyLimit=" + boost::lexical_cast<string>(request.proxyRateLimit) +
+				"\tprefix=" + (request.prefixFirst? "1": "0") +
+				"\trecover=" + (request.recover? "1": "0") +
+				"\tdurability=" + request.durability;
+	}
+
+	static void parseRequest(const FieldMap &values, JobRequest &request) {
+		request.url = fieldValue<string>(values, "url", "");
+		request.savePath = fieldValue<string>(values, "path", "");
+		request.cookies = fieldValue<string>(values, "cookies", "");
+		request.useRedirectedUrl = fieldValue<int>(values, "redirect", 0) != 0;
+		request.profile = fieldValue<string>(values, "profile", "auto");
+		request.rateLimit = fieldValue<size_t>(values, "limit", 0);
+		request.proxyRateLimit = fieldValue<size_t>(values, "proxyLimit", 0);
+		request.prefixFirst = fieldValue<int>(values, "prefix", 0) != 0;
+		request.recover = fieldValue<int>(values, "recover", 0) != 0;
+		request.durability = fieldValue<string>(values, "durability", "interval");
+	}
+
+	static const string formatStatus(const JobStatus &status) {
+		char speed[32];
+		snprintf(speed, sizeof(speed), "%.0f", status.speed);
+		return "id=" + boost::lexical_cast<string>(status.id) +
+				"\tstate=" + JobStatus::stateName(status.state) +
+				"\tpath=" + oneLine(status.savePath) +
+				"\tsize=" + boost::lexical_cast<string>(status.fileSize) +
+				"\tdone=" + boost::lexical_cast<string>(status.doneBytes) +
+				"\tcontiguous=" + boost::lexical_cast<string>(status.contiguousBytes) +
+				"\tcache=" + boost::lexical_cast<string>(status.cacheBytes) +
+				"\tcacheCapacity=" + boost::lexical_cast<string>(status.cacheCapacity) +
+				"\tspeed=" + speed +
+				"\tmessage=" + oneLine(status.message);
+	}
+
+	static void parseStatus(const string &text, JobStatus &status) {
+		vector<string> fields;
+		boost::split(fields, text, boost::is_any_of("\t"));
+		FieldMap values;
+		parseFields(fields, 0, values);
+		status.id = fieldValue<size_t>(values, "id", 0);
+		string state = fieldValue<string>(values, "state", "");
+		status.state = JobStatus::PREPARING;
+		for (int s=JobStatus::PREPARING; s<=JobStatus::CANCELLED; s++) {
+			if (state == JobStatus::stateName(JobStatus::State(s))) status.state = JobStatus::State(s);
+		}
+		status.savePath = fieldValue<string>(values, "path", "");
+		status.fileSize = fieldValue<size_t>(values, "size", 0);
+		status.doneBytes = fieldValue<size_t>(values, "done", 0);
+		status.contiguousBytes = fieldValue<size_t>(values, "contiguous", 0);
+		status.cacheBytes = fieldValue<size_t>(values, "cache", 0);
+		status.cacheCapacity = fieldValue<size_t>(values, "cacheCapacity", 0);
+		status.speed = fieldValue<double>(values, "speed", 0.0);
+		status.message = fieldValue<string>(values, "message", "");
+	}
+
+	// scheme://host[:port], what a probe result is kept for
+	static const string urlOrigin(const string &url) {
+		size_t begin = url.find("://");
+		begin = begin == string::npos? 0: begin + 3;
+		return url.substr(0, url.find('/', begin));
+	}
+
+	/* JobStatus */
+	const char *JobStatus::stateName(State state) throw() {
+		static const char *names[] = {"preparing", "running", "done", "failed", "cancelled"};
+		return names[state];
+	}
+
+	/* Daemon */
+	Daemon::Job::Job(size_t id, const JobRequest &request) : id(id), request(request), jobFile(),
+			webctl(NULL), thread(NULL), status(), cancelled(false) {
+		status.id = id;
+		status.savePath = request.savePath;
+	}
+
+	Daemon::Daemon(const string &socketPath, const list<string> &proxies, size_t threadPerProxy,
+			ChunkCache *chunkCache, ProxyHistory *history) :
+			_socketPath(socketPath), _proxies(proxies), _threadPerProxy(max(threadPerProxy, (size_t)1)),
+			_chunkCache(chunkCache), _history(history), _listener(-1), _stopping(false), _pool(), _mutex(), _jobs(), _nextId(1), _probes(),
+			_connections(0), _connectionClosed() {
+		if (_proxies.empty()) throw ArgumentError("proxies", "The daemon needs a proxy or direct connection.");
+		ConnectionPool::install(&_pool);
+	}
+
+	Daemon::~Daemon() {
+		stop();
+		for (JobMap::iterator it=_jobs.begin(); it!=_jobs.end(); it++) {
+			it->second->cancelled.store(true);
+		}
+		for (JobMap::iterator it=_jobs.begin(); it!=_jobs.end(); it++) {
+			Job *job = it->second;
+			if (job->thread) {
+				job->thread->join();
+				delete job->thread;
+			}
+			delete job;
+		}
+		_jobs.clear();
+		if (_listener >= 0) {
+			close(_listener);
+			unlink(_socketPath.c_str());
+		}
+		ConnectionPool::install(NULL);
+	}
+
+	void Daemon::start() {
+		// a socket left by a daemon that died is replaced, a live one is not
+		int fd = connectSocket(_socketPath);
+		if (fd >= 0) {
+			close(fd);
+			throw IOException(_socketPath, "Another daemon is listening on " + _socketPath + ".");
+		}
+		struct stat st;
+		if (lstat(_socketPath.c_str(), &st) == 0) {
+			if (!S_ISSOCK(st.st_mode))
+				throw IOException(_socketPath, _socketPath + " exists and is not a socket.");
+			unlink(_socketPath.c_str());
+		}
+
+		sockaddr_un addr = socketAddress(_socketPath);
+		_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_listener < 0) throw IOException(_socketPath, "Cannot create socket.");
+		// only the owner may submit jobs
+		mode_t mask = umask(0077);
+		int ret = bind(_listener, (sockaddr*)&addr, sizeof(addr));
+		umask(mask);
+		if (ret != 0 || listen(_listener, SOMAXCONN) != 0) {
+			string err = strerror(errno);
+			close(_listener);
+			_listener = -1;
+			throw IOException(_socketPath, "Cannot listen on " + _socketPath + ". " + err);
+		}
+	}
+
+	void Daemon::run() {
+		if (_listener < 0) start();
+		while (!_stopping.load()) {
+			pollfd p = {_listener, POLLIN, 0};
+			if (poll(&p, 1, POLL_MS) <= 0) continue;
+			int fd = accept(_listener, NULL, NULL);
+			if (fd < 0) continue;
+			Mutex::scoped_lock lock(_mutex);
+			try {
+				boost::thread(boost::bind(&Daemon::serve, this, fd)).detach();
+				++_connections;
+			} catch (const boost::thread_resource_error &) {
+				close(fd);
+			}
+		}
+		close(_listener);
+		_listener = -1;
+		unlink(_socketPath.c_str());
+
+		// connections notice the stop within POLL_MS
+		Mutex::scoped_lock lock(_mutex);
+		while (_connections > 0) _connectionClosed.wait(lock);
+		for (JobMap::iterator it=_jobs.begin(); it!=_jobs.end(); it++) {
+			it->second->cancelled.store(true);
+		}
+	}
+
+	void Daemon::serve(int fd) {
+		string buffer, line;
+		int ret;
+		while (!_stopping.load() && (ret = readLine(fd, buffer, line, POLL_MS)) >= 0) {
+			if (ret == 0) continue;
+			if (!sendLine(fd, handle(line))) break;
+		}
+		close(fd);
+		Mutex::scoped_lock lock(_mutex);
+		--_connections;
+		_connectionClosed.notify_all();
+	}
+
+	const string Daemon::handle(const string &line) {
+		vector<string> fields;
+		boost::split(fields, line, boost::is_any_of("\t"));
+		const string &command = fields[0];
+		try {
+			if (command == "SUBMIT") {
+				FieldMap values;
+				parseFields(fields, 1, values);
+				JobRequest request;
+				parseRequest(values, request);
+				return "OK\t" + boost::lexical_cast<string>(submit(request));
+			}
+			if (command == "STATUS" && fields.size() == 2) {
+				JobStatus st;
+				if (!status(boost::lexical_cast<size_t>(fields[1]), st)) return "ERR\tNo such job.";
+				return "OK\t" + formatStatus(st);
+			}
+			if (command == "CANCEL" && fields.size() == 2) {
+				if (!cancel(boost::lexical_cast<size_t>(fields[1]))) return "ERR\tNo such job.";
+				return "OK\t";
+			}
+			if (command == "LIST") {
+				list<size_t> ids = jobs();
+				string ret = "OK\t";
+				for (list<size_t>::const_iterator it=ids.begin(); it!=ids.end(); it++) {
+					if (it != ids.begin()) ret += " ";
+					ret += boost::lexical_cast<string>(*it);
+				}
+				return ret;
+			}
+			return "ERR\tUnknown request.";
+		} catch (const Exception &ex) {
+			return "ERR\t" + oneLine(ex.message());
+		} catch (const boost::bad_lexical_cast &) {
+			return "ERR\tBad job id.";
+		} catch (const std::exception &ex) {
+			return "ERR\t" + oneLine(ex.what());
+		}
+	}
+
+	size_t Daemon::submit(const JobRequest &request) {
+		if (request.url.empty())
+			throw ArgumentError("url", "No url to download.");
+		if (!fs::path(request.savePath).is_absolute())
+			throw ArgumentError("path", "Output path must be absolute.");
+		SpeedProfile profile;
+		if (request.profile != "auto" && !speedProfileByName(request.profile, profile))
+			throw ArgumentError("profile", request.profile + " is not a speed profile.");
+		parseDurability(request.durability);
+
+		Mutex::scoped_lock lock(_mutex);
+		if (_stopping.load()) throw OperationCannotEmit("The daemon is stopping.");
+		for (JobMap::const_iterator it=_jobs.begin(); it!=_jobs.end(); it++) {
+			if (!it->second->status.finished() && it->second->request.savePath == request.savePath)
+				throw OperationCannotEmit("Output path is being downloaded by job " +
+						boost::lexical_cast<string>(it->first) + ".");
+		}
+		prune();
+		Job *job = new Job(_nextId++, request);
+		_jobs[job->id] = job;
+		job->thread = new boost::thread(boost::bind(&Daemon::runJob, this, job));
+		return job->id;
+	}
+
+	bool Daemon::status(size_t id, JobStatus &status) {
+		Mutex::scoped_lock lock(_mutex);
+		JobMap::const_iterator it = _jobs.find(id);
+		if (it == _jobs.end()) return false;
+		const Job *job = it->second;
+		status = job->status;
+		WebCtl *webctl = job->webctl;
+		if (webctl) {
+			// lock-free reads, the job thread holds no lock while downloading
+			SheetCtl &sheetCtl = webctl->sheetCtl();
+			size_t pageBytes = sheetCtl.cache().pageSize() * job->jobFile.sheetSize();
+			status.doneBytes = sheetCtl.doneBytes();
+			status.contiguousBytes = sheetCtl.contiguousBytes();
+			status.cacheBytes = sheetCtl.workPageCount() * pageBytes;
+			status.cacheCapacity = sheetCtl.pageCount() * pageBytes;
+			status.speed = webctl->getSpeed();
+		}
+		return true;
+	}
+
+	bool Daemon::cancel(size_t id) {
+		Mutex::scoped_lock lock(_mutex);
+		JobMap::iterator it = _jobs.find(id);
+		if (it == _jobs.end()) return false;
+		it->second->cancelled.store(true);
+		return true;
+	}
+
+	const list<size_t> Daemon::jobs() {
+		Mutex::scoped_lock lock(_mutex);
+		list<size_t> ret;
+		for (JobMap::const_iterator it=_jobs.begin(); it!=_jobs.end(); it++) ret.push_back(it->first);
+		return ret;
+	}
+
+	// call with _mutex held
+	void Daemon::prune() {
+		size_t finished = 0;
+		for (JobMap::const_iterator it=_jobs.begin(); it!=_jobs.end(); it++) {
+			if (it->second->status.finished()) ++finished;
+		}
+		JobMap::iterator it = _jobs.begin();
+		while (finished >= MAX_FINISHED_JOBS && it != _jobs.end()) {
+			Job *job = it->second;
+			if (!job->status.finished()) {
+				++it;
+				continue;
+			}
+			// finish() is the last thing the thread does
+			job->thread->join();
+			delete job->thread;
+			delete job;
+			_jobs.erase(it++);
+			--finished;
+		}
+	}
+
+	void Daemon::prepare(Job *job) {
+		const JobRequest &request = job->request;
+		bool autoProfile = request.profile == "auto";
+		SpeedProfile profile;
+		if (!autoProfile) speedProfileByName(request.profile, profile);
+
+		// the probe of a host is reused while it is fresh
+		string origin = urlOrigin(request.url);
+		ProbeResult probe;
+		bool known = false;
+		{
+			Mutex::scoped_lock lock(_mutex);
+			ProbeMap::const_iterator it = _probes.find(origin);
+			if (it != _probes.end() && time(NULL) - it->second.time < PROBE_TTL) {
+				probe = it->second.probe;
+				known = true;
+			}
+		}
+		bool probing = autoProfile && !known;
+		bool resuming = !isStreamPath(request.savePath) && fs::exists(request.savePath);
+		long long tmpSize = -1;
+		string redirected, body, validator;
+		ProbeResult measured;
+		// the probe fetches the first sheet, unless its size is not known yet
+		size_t probeSize = probing? PROBE_SIZE: autoProfile || resuming? 2: profile.sheetSize;
+		if (!WebCtl::checkDownload(request.url, request.cookies, _proxies.front(),
+				tmpSize, redirected, &measured, probeSize, resuming? NULL: &body, &validator))
+			throw WebError("Target url cannot be reached.");
+		if (tmpSize <= 0)
+			throw WebError("Cannot download target partially.");
+		if (probing) {
+			probe = measured;
+			Mutex::scoped_lock lock(_mutex);
+			CachedProbe &cached = _probes[origin];
+			cached.probe = probe;
+			cached.time = time(NULL);
+		}
+		size_t fileSize = size_t(tmpSize);
+		string url = request.useRedirectedUrl? request.url: redirected;
+		size_t connections = _proxies.size() * _threadPerProxy;
+		// a capped connection is only as fast as its share of the cap
+		if (request.rateLimit) {
+			double share = double(request.rateLimit) / connections;
+			probe.bandwidth = probe.bandwidth > 0? min(probe.bandwidth, share): share;
+		}
+		if (request.proxyRateLimit) {
+			double share = double(request.proxyRateLimit) / _threadPerProxy;
+			probe.bandwidth = probe.bandwidth > 0? min(probe.bandwidth, share): share;
+		}
+		if (autoProfile) profile = autoSpeedProfile(fileSize, connections, probe);
+
+		JobFile &jobFile = job->jobFile;
+		if (isStreamPath(request.savePath)) {
+			jobFile.createStream(url, request.cookies, request.savePath,
+					request.useRedirectedUrl, fileSize, profile.sheetSize, connections);
+		} else if (fs::exists(request.savePath)) {
+			bool lost = false;
+			try {
+				jobFile.open(request.savePath);
+			} catch (const JobNotExists &) {
+				if (!request.recover) throw IOException(request.savePath, "Output path already exists.");
+				lost = true;
+			} catch (const BadJobFile &) {
+				if (!request.recover) throw;
+				lost = true;
+			}
+			if (lost) {
+				jobFile.recover(url, request.cookies, request.savePath, request.useRedirectedUrl,
+						fileSize, profile.sheetSize, true, connections);
+			} else if (shouldRegrid(jobFile.sheetSize(), profile)) {
+				jobFile.regrid(SheetMap::tapered(fileSize, profile.sheetSize, connections));
+			}
+		} else {
+			jobFile.create(url, request.cookies, request.savePath, request.useRedirectedUrl,
+					fileSize, profile.sheetSize, connections);
+		}
+		if (autoProfile && jobFile.sheetSize() != profile.sheetSize) {
+			// resumed job kept its sheet size
+			profile = autoSpeedProfile(fileSize, connections, probe, jobFile.sheetSize());
+		}
+
+		WebCtl *webctl = new WebCtl(jobFile, profile, _threadPerProxy);
+		try {
+			webctl->fileBuffer().setDurability(parseDurability(request.durability));
+			webctl->sheetCtl().seed(body.data(), body.size());
+			if (_chunkCache) {
+				webctl->setChunkCache(_chunkCache, _chunkCache->object(redirected, validator, fileSize));
+				webctl->loadChunks();
+			}
+		} catch (...) {
+			delete webctl;
+			throw;
+		}
+		list<string> proxies = _proxies;
+		string host = ProxyHistory::hostOf(request.url);
+		if (_history) _history->rank(proxies, host);
+		webctl->addProxies(proxies);
+		webctl->setHistory(_history, host);
+		webctl->setRateLimit(request.rateLimit);
+		webctl->setProxyRateLimit(request.proxyRateLimit);
+		if (request.prefixFirst) webctl->sheetCtl().setPolicy(SheetCtl::PREFIX);
+		webctl->reportLevel() = 9999; // nobody reads the daemon's console
+		{
+			Mutex::scoped_lock lock(_mutex);
+			job->webctl = webctl;
+			job->status.fileSize = fileSize;
+			job->status.state = JobStatus::RUNNING;
+		}
+		webctl->perform();
+	}
+
+	void Daemon::runJob(Job *job) {
+		// whatever a job throws fails the job, an escape would end the daemon
+		bool prepared = false;
+		string error;
+		try {
+			prepare(job);
+			prepared = true;
+		} catch (const Exception &ex) {
+			error = ex.message();
+		} catch (const std::exception &ex) {
+			error = ex.what();
+		} catch (...) {
+			error = "Preparing the job failed.";
+		}
+		if (!prepared) {
+			job->jobFile.close();
+			finish(job, JobStatus::FAILED, error);
+			return;
+		}
+
+		WebCtl *webctl = job->webctl;
+		const int sleepMs = 100;
+		// give the workers a moment to start, as the console does
+		for (int i=0; i<20 && webctl->activeWorker() == 0 && !job->cancelled.load(); i++) {
+			boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
+		}
+		while (webctl->activeWorker() > 0 && !job->cancelled.load()) {
+			boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
+		}
+		bool cancelled = job->cancelled.load();
+		string message;
+		try {
+			if (cancelled) webctl->terminate();
+			webctl->flush();
+			webctl->fileBuffer().close();
+		} catch (const Exception &ex) {
+			message = ex.message();
+		} catch (const std::exception &ex) {
+			message = ex.what();
+		} catch (...) {
+			message = "Saving the download failed.";
+		}
+		job->jobFile.close();
+		if (_history) _history->save();
+		bool done = webctl->sheetCtl().allDone();
+		if (done && !job->jobFile.jobPath().empty()) {
+			try {
+				fs::remove(job->jobFile.jobPath());
+			} catch (const fs::filesystem_error &) {
+				// a stale job file only costs a resume check
+			}
+		}
+		if (!done && message.empty()) message = "Download unfinished.";
+		finish(job, done? JobStatus::DONE: cancelled? JobStatus::CANCELLED: JobStatus::FAILED,
+				done? string(): message);
+	}
+
+	void Daemon::finish(Job *job, JobStatus::State state, const string &message) {
+		WebCtl *webctl;
+		{
+			Mutex::scoped_lock lock(_mutex);
+			webctl = job->webctl;
+			if (webctl) {
+				SheetCtl &sheetCtl = webctl->sheetCtl();
+				job->status.doneBytes = sheetCtl.doneBytes();
+				job->status.contiguousBytes = sheetCtl.contiguousBytes();
+			}
+			job->webctl = NULL;
+		}
+		// joins the workers and frees the cache
+		delete webctl;
+		Mutex::scoped_lock lock(_mutex);
+		job->status.state = state;
+		job->status.message = message;
+	}
+
+	/* DaemonClient */
+	DaemonClient::DaemonClient(const string &socketPath) : _fd(connectSocket(socketPath)),
+			_socketPath(socketPath), _received() {
+		if (_fd < 0) throw IOException(socketPath, "Cannot connect to the daemon on " + socketPath + ".");
+	}
+
+	DaemonClient::~DaemonClient() {
+		close(_fd);
+	}
+
+	const string DaemonClient::call(const string &request) {
+		string line;
+		if (!sendLine(_fd, request) || readLine(_fd, _received, line, -1) <= 0)
+			throw IOException(_socketPath, "The daemon hung up.");
+		size_t tab = line.find('\t');
+		string status = line.substr(0, tab), rest = tab == string::npos? string(): line.substr(tab + 1);
+		if (status != "OK") throw RuntimeError(rest.empty()? "The daemon refused the request.": rest);
+		return rest;
+	}
+
+	size_t DaemonClient::submit(const JobRequest &request) {
+		string id = call(formatRequest(request));
+		try {
+			return boost::lexical_cast<size_t>(id);
+		} catch (const boost::bad_lexical_cast &) {
+			throw RuntimeError("The daemon sent a bad job id.");
+		}
+	}
+
+	void DaemonClient::status(size_t id, JobStatus &status) {
+		parseStatus(call("STATUS\t" + boost::lexical_cast<string>(id)), status);
+	}
+
+	void DaemonClient::cancel(size_t id) {
+		call("CANCEL\t" + boost::lexical_cast<string>(id));
+	}
+}
+
+#endif /* WIN32 */
@@ -0,0 +1,156 @@
+/*
+ * daemon.h
+ *
+ *  One long-running process that keeps the proxy pool, probes and
+ *  connections warm, and takes jobs over a Unix domain socket.
+ *
+ *  Protocol: one request per line, fields separated by tabs; the daemon
+ *  answers every request with one line, "OK" or "ERR", a tab and the rest.
+ *
+ *    SUBMIT <key=value>...   url, path (absolute), cookies, redirect=0|1,
+ *                            profile=auto|extreme|high|medium|low,
+ *                            limit=bytes/s, proxyLimit=bytes/s,
+ *                            prefix=0|1, recover=0|1     -> OK <id>
+ *    STATUS <id>             -> OK <key=value>...
+ *    LIST                    -> OK <id> <id> ...
+ *    CANCEL <id>             -> OK
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#ifndef WIN32
+
+#include <string>
+#include <list>
+#include <map>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include "webctl.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	// What a client asks the daemon to download.
+	struct JobRequest {
+	public:
+		inline JobRequest() : url(), savePath(), cookies(), useRedirectedUrl(false),
+				profile("auto"), rateLimit(0), proxyRateLimit(0), prefixFirst(false), recover(false),
+				durability("interval") {}
+		string url, savePath, cookies;
+		bool useRedirectedUrl;
+		string profile;
+		size_t rateLimit, proxyRateLimit;
+		bool prefixFirst, recover;
+		string durability;	// as parseDurability takes it
+	};
+
+	struct JobStatus {
+	public:
+		enum State { PREPARING, RUNNING, DONE, FAILED, CANCELLED };
+		inline JobStatus() : id(0), state(PREPARING), savePath(), message(), fileSize(0),
+				doneBytes(0), contiguousBytes(0), cacheBytes(0), cacheCapacity(0), speed(0.0) {}
+		size_t id;
+		State state;
+		string savePath, message;
+		size_t fileSize, doneBytes, contiguousBytes, cacheBytes, cacheCapacity;
+		double speed;
+		inline bool finished() const throw() { return state >= DONE; }
+		static const char *stateName(State state) throw();
+	};
+
+	class Daemon {
+	public:
+		/**
+		 * @param proxies: Checked proxies, kept for every job; empty string for direct.
+		 * @param threadPerProxy: Workers for each proxy in every job.
+		 * @param chunkCache: Shared by every job, NULL for none; must outlive the daemon.
+		 * @param history: Ranks the proxies for each job and is saved as each
+		 * 		one ends, NULL for none; must outlive the daemon.
+		 */
+		Daemon(const string &socketPath, const list<string> &proxies, size_t threadPerProxy=1,
+				ChunkCache *chunkCache=NULL, ProxyHistory *history=NULL);
+		virtual ~Daemon();
+
+		// Listen. Throws IOException if the socket is taken.
+		void start();
+		// Serve until stop(); finished jobs are closed, running ones cancelled.
+		void run();
+		// Safe from a signal handler.
+		inline void stop() throw() { _stopping.store(true); }
+		inline const list<string> &proxies() const throw() { return _proxies; }
+
+		size_t submit(const JobRequest &request);
+		bool status(size_t id, JobStatus &status);
+		bool cancel(size_t id);
+		const list<size_t> jobs();
+
+		static const size_t MAX_FINISHED_JOBS = 256;
+		static const int PROBE_TTL = 600; // seconds a probe of a host is trusted
+
+	protected:
+		struct Job {
+			Job(size_t id, const JobRequest &request);
+			size_t id;
+			JobRequest request;
+			JobFile jobFile;
+			WebCtl *webctl;
+			boost::thread *thread;
+			JobStatus status;	// live fields are filled from webctl
+			boost::atomic<bool> cancelled;
+		};
+		struct CachedProbe {
+			ProbeResult probe;
+			time_t time;
+		};
+		typedef boost::mutex Mutex;
+		typedef map<size_t, Job*> JobMap;
+		typedef map<string, CachedProbe> ProbeMap;
+
+		string _socketPath;
+		list<string> _proxies;
+		size_t _threadPerProxy;
+		ChunkCache *_chunkCache;
+		ProxyHistory *_history;
+		int _listener;
+		boost::atomic<bool> _stopping;
+		ConnectionPool _pool;
+
+		Mutex _mutex;
+		JobMap _jobs;
+		size_t _nextId;
+		ProbeMap _probes;
+		size_t _connections;
+		boost::condition_variable _connectionClosed;
+
+		void serve(int fd);
+		const string handle(const string &line);
+		void runJob(Job *job);
+		void prepare(Job *job);
+		void finish(Job *job, JobStatus::State state, const string &message);
+		void prune();
+	};
+
+	// The client side of the daemon protocol.
+	class DaemonClient {
+	public:
+		// Connect to the daemon, throws IOException.
+		DaemonClient(const string &socketPath);
+		virtual ~DaemonClient();
+
+		size_t submit(const JobRequest &request);
+		// Throws RuntimeError for an unknown job.
+		void status(size_t id, JobStatus &status);
+		void cancel(size_t id);
+
+	protected:
+		int _fd;
+		string _socketPath, _received;
+		// Send one request, return what follows "OK"; throws RuntimeError on "ERR".
+		const string call(const string &request);
+	};
+}
+
+#endif /* WIN32 */
+
+#endif /* DAEMON_H_ */
@@ -33,6 +33,9 @@ namespace PwxGet {
         virtual const string message() const throw() {
             return this->err;
         }
+        virtual const char* what() const throw() {
+            return this->err.c_str();
+        }
         virtual ~RuntimeError() throw () {}
     protected:
         string err;
@@ -128,6 +131,9 @@ namespace PwxGet {
         virtual const string message() const throw() {
             return _message;
         }
+        virtual const char* what() const throw() {
+            return _message.c_str();
+        }
         const string arg() const throw() { return _arg ; }
         virtual ~ArgumentError() throw () {}
     protected:
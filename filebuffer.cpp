@@ -6,6 +6,25 @@
  */
 
 #include "filebuffer.h"
+#include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 namespace fs = boost::filesystem;
 
 namespace PwxGet {
@@ -48,17 +67,99 @@ namespace PwxGet {
             throw IOException(path, "Write file " + path + " failed.");
     }
     
+    void syncFile(const string &path, bool dataOnly) {
+#ifdef WIN32
+        int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+        bool ok = fd >= 0 && _commit(fd) == 0;
+        if (fd >= 0) _close(fd);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY);
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        bool ok = fd >= 0 && (dataOnly? fdatasync(fd): fsync(fd)) == 0;
+#else
+        bool ok = fd >= 0 && fsync(fd) == 0;
+#endif
+        if (fd >= 0) ::close(fd);
+#endif
+        if (!ok) throw IOException(path, "Cannot sync file " + path + ".");
+    }
+
+    namespace {
+        // Sync the directory holding path, where a rename is recorded.
+        bool syncParent(const string &path) {
+#ifdef WIN32
+            return true;
+#else
+            char dir[PATH_MAX];
+            size_t slash = path.rfind('/');
+            if (slash == string::npos) strcpy(dir, ".");
+            else if (slash >= sizeof(dir)) return false;
+            else {
+                memcpy(dir, path.data(), max(slash, (size_t)1));
+                dir[max(slash, (size_t)1)] = '\0';
+            }
+            int fd = ::open(dir, O_RDONLY);
+            bool ok = fd >= 0 && fsync(fd) == 0;
+            if (fd >= 0) ::close(fd);
+            return ok;
+#endif
+        }
+    }
+
+    void replacefile(const string &path, const string &temp, const char *data, size_t length, bool sync) {
+#ifdef WIN32
+        int fd = _open(temp.c_str(), _O_WRONLY | _O_BINARY | _O_CREAT | _O_TRUNC, _S_IREAD | _S_IWRITE);
+#else
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (fd < 0)
+            throw IOException(temp, "Cannot open file " + temp + " for write.");
+        bool ok = true;
+        size_t done = 0;
+        while (ok && done < length) {
+#ifdef WIN32
+            int n = _write(fd, data + done, (unsigned int)(length - done));
+#else
+            ssize_t n = ::write(fd, data + done, length - done);
+            if (n < 0 && errno == EINTR) continue;
+#endif
+            ok = n > 0;
+            if (ok) done += n;
+        }
+#ifdef WIN32
+        if (ok && sync) ok = _commit(fd) == 0;
+        _close(fd);
+        // rename does not replace a file here
+        if (ok) ok = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        if (ok && sync) ok = fdatasync(fd) == 0;
+#else
+        if (ok && sync) ok = fsync(fd) == 0;
+#endif
+        ::close(fd);
+        if (ok) ok = ::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+        if (!ok) {
+            ::remove(temp.c_str());
+            throw IOException(path, "Cannot replace file " + path + ".");
+        }
+        if (sync && !syncParent(path))
+            throw IOException(path, "Cannot sync the directory of " + path + ".");
+    }
+
     FileBuffer::PackedIndexFile::PackedIndexFile(const string &indexPath) :
-    		FileBuffer::PackedIndex(), _valid(false), _data(), _indexPath(indexPath) {
+    		FileBuffer::PackedIndex(), _valid(false), _data(), _indexPath(indexPath),
+    		_tempPath(indexPath + ".tmp") {
         if (fs::is_regular_file(indexPath)) {
             _data = readfile(indexPath);
             _valid = true;
         }
     }
     
-    void FileBuffer::PackedIndexFile::setData(const string &data) {
+    void FileBuffer::PackedIndexFile::setData(const string &data, bool sync) {
         _data = data;
-        writefile(this->_indexPath, data);
+        replacefile(this->_indexPath, this->_tempPath, data.data(), data.size(), sync);
         _valid = true;
     }
     
@@ -66,15 +167,98 @@ namespace PwxGet {
         _valid = false;
     }
 
-    FileBuffer::FileBuffer(const string &path, size_t size, PackedIndex &packedIndex, size_t sheetSize) :
+    /* SheetMap */
+    const size_t SheetMap::MAX_TAIL_ZONES;
+    const size_t SheetMap::MIN_TAIL_SHEET;
+
+    SheetMap::SheetMap(size_t fileSize, size_t sheetSize) : _fileSize(fileSize),
+            _sheetSize(max(sheetSize, (size_t)1)), _sheetCount(0), _zones(0), _zoneSheets(0) {
+        layout();
+    }
+
+    SheetMap::SheetMap(size_t fileSize, size_t sheetSize, size_t tailZones, size_t zoneSheets) :
+            _fileSize(fileSize), _sheetSize(max(sheetSize, (size_t)1)), _sheetCount(0),
+            _zones(min(tailZones, MAX_TAIL_ZONES)), _zoneSheets(zoneSheets) {
+        // zones of empty sheets are no zones
+        while (_zones && (_sheetSize >> _zones) == 0) --_zones;
+        if (!_zoneSheets) _zones = 0;
+        layout();
+    }
+
+    SheetMap SheetMap::tapered(size_t fileSize, size_t sheetSize, size_t connections) {
+        size_t zones = 0;
+        while (zones < MAX_TAIL_ZONES && (sheetSize >> (zones + 1)) >= MIN_TAIL_SHEET) ++zones;
+        if (connections < 2 || !zones) return SheetMap(fileSize, sheetSize);
+        // the tail takes n * sheetSize * (1 - 2^-zones) bytes before its last zone
+        size_t n = connections;
+        while (zones && n * (sheetSize - (sheetSize >> zones)) > fileSize / 2) {
+            if (n > 1) n /= 2;
+            else --zones;
+        }
+        return zones? SheetMap(fileSize, sheetSize, zones, n): SheetMap(fileSize, sheetSize);
+    }
+
+    void SheetMap::layout() {
+        _zoneStart[0] = _zoneOffset[0] = 0;
+        if (!_zones) {
+            _sheetCount = _fileSize / _sheetSize + (_fileSize % _sheetSize? 1: 0);
+            return;
+        }
+        // the bulk leaves the tail its full zones and a last one at least as long
+        size_t tail = 0;
+        for (size_t z=1; z<=_zones; z++) tail += _zoneSheets * (_sheetSize >> z);
+        size_t bulk = _fileSize > tail? (_fileSize - tail) / _sheetSize: 0;
+        size_t start = bulk, offset = bulk * _sheetSize;
+        for (size_t z=1; z<=_zones; z++) {
+            _zoneStart[z] = start;
+            _zoneOffset[z] = offset;
+            // the last zone runs to the end, the others may be cut short by a small file
+            size_t size = _sheetSize >> z, left = _fileSize - offset,
+                    sheets = z == _zones? left / size + (left % size? 1: 0): min(_zoneSheets, left / size);
+            start += sheets;
+            offset += sheets * size;
+        }
+        _sheetCount = start;
+    }
+
+    size_t SheetMap::sheetAt(size_t offset) const throw() {
+        if (offset >= _fileSize) return _sheetCount;
+        size_t z = 0;
+        while (z < _zones && offset >= _zoneOffset[z + 1]) ++z;
+        return _zoneStart[z] + (offset - _zoneOffset[z]) / (_sheetSize >> z);
+    }
+
+    bool SheetMap::operator==(const SheetMap &other) const throw() {
+        return _fileSize == other._fileSize && _sheetSize == other._sheetSize &&
+                _zones == other._zones && (!_zones || _zoneSheets == other._zoneSheets);
+    }
+
+    FileBuffer::FileBuffer(const string &path, size_t size, PackedIndex &packedIndex, size_t sheetSize,
+    			bool stream) :
 				_mutex(), _f(), _valid(false), _path(path), _size(size), _sheetCount(0), _sheetSize(sheetSize),
-				_managedIndex(), _index(NULL), _doneSheet(0), _packedIndex(packedIndex) {
+				_sheets(size, sheetSize), _managedIndex(), _index(NULL), _packed(), _doneSheet(0), _doneBytes(0),
+				_packedIndex(packedIndex), _out(NULL), _streamed(0), _durability(), _syncFd(-1), _unflushed(0),
+				_lastFlush(monotonicSeconds()) {
+        open(packedIndex, stream);
+    }
+
+    FileBuffer::FileBuffer(const string &path, const SheetMap &sheets, PackedIndex &packedIndex,
+    			bool stream) :
+				_mutex(), _f(), _valid(false), _path(path), _size(sheets.fileSize()), _sheetCount(0),
+				_sheetSize(sheets.sheetSize()), _sheets(sheets), _managedIndex(), _index(NULL), _packed(),
+				_doneSheet(0), _doneBytes(0), _packedIndex(packedIndex), _out(NULL), _streamed(0), _durability(),
+				_syncFd(-1), _unflushed(0), _lastFlush(monotonicSeconds()) {
+        open(packedIndex, stream);
+    }
+
+    void FileBuffer::open(PackedIndex &packedIndex, bool stream) {
+        const string &path = _path;
+        size_t size = _size;
     	// close system buffer (I use pagedMemoryCache)
     	_f.rdbuf()->pubsetbuf(NULL, 0);
 
         // read file index
-        this->_sheetCount = this->_size / this->_sheetSize;
-        if (this->_sheetSize * this->_sheetCount != this->_size) ++this->_sheetCount;
+        this->_sheetCount = _sheets.sheetCount();
 
         if (packedIndex.isValid()) {
             size_t packedSheetCount = this->_sheetCount / 8;
@@ -84,11 +268,30 @@ namespace PwxGet {
                 throw BadIndex("Bad sheet index " + packedIndex.identifier() + ".");
             }
             this->unpackIndex(data, this->_managedIndex, this->_doneSheet);
+            this->countDoneBytes();
         } else {
             this->_managedIndex.resize(this->_sheetCount);
             memset((char*)this->_managedIndex.data(), 0, this->_sheetCount);
         }
         this->_index = (byte*)(this->_managedIndex.data());
+
+        if (stream) {
+            // a stream cannot be resumed, so it always starts from scratch
+            memset(this->_index, 0, this->_sheetCount);
+            this->_doneSheet = this->_doneBytes = 0;
+            if (path == "-") {
+                _out = stdout;
+#ifdef WIN32
+                _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            } else {
+                _out = fopen(path.c_str(), "wb");
+                if (!_out)
+                    throw IOException("Cannot open output stream " + path + ".");
+            }
+            _valid = true;
+            return;
+        }
         
         // resize file
         if (!fs::is_regular_file(path)) {
@@ -117,15 +320,21 @@ namespace PwxGet {
     }
     
     void FileBuffer::flush() {
+        TraceSpan span("checkpoint");
         this->lock();
         try {
             if (_valid) {
+                // the index packed before the sync marks only synced sheets
+                this->packIndex(this->_managedIndex, this->_packed);
                 // flush data
-                _f.flush();
+                if (_out) fflush(_out);
+                else _f.flush();
+                bool sync = _durability.mode != Durability::NONE && !_out;
+                if (sync) this->syncData();
                 // write index
-                string data;
-                this->packIndex(this->_managedIndex, data);
-                this->_packedIndex.setData(data);
+                this->_packedIndex.setData(this->_packed, sync);
+                _unflushed = 0;
+                _lastFlush = monotonicSeconds();
             }
         } catch (...) {
             this->unlock();
@@ -133,12 +342,55 @@ namespace PwxGet {
         }
         this->unlock();
     }
+
+    void FileBuffer::checkpoint() {
+        if (_durability.mode != Durability::STRICT) {
+            bool due = (_durability.intervalBytes && _unflushed >= _durability.intervalBytes) ||
+                    (_durability.intervalMs && monotonicSeconds() - _lastFlush >= _durability.intervalMs / 1000.0);
+            if (!due) return;
+        }
+        this->flush();
+    }
+
+    void FileBuffer::setDurability(const Durability &durability) {
+        _durability = durability;
+    }
+
+    void FileBuffer::syncData() {
+        TraceSpan span("sync");
+#ifdef WIN32
+        if (_syncFd < 0) _syncFd = _open(_path.c_str(), _O_WRONLY | _O_BINARY);
+        if (_syncFd < 0 || _commit(_syncFd) != 0)
+            throw IOException(_path, "Cannot sync data file " + _path + ".");
+#else
+        if (_syncFd < 0) _syncFd = ::open(_path.c_str(), O_WRONLY);
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        if (_syncFd < 0 || fdatasync(_syncFd) != 0)
+#else
+        if (_syncFd < 0 || fsync(_syncFd) != 0)
+#endif
+            throw IOException(_path, "Cannot sync data file " + _path + ".");
+#endif
+    }
     
     void FileBuffer::close() {
         this->lock();
         if (_valid) {
             this->flush();
-            _f.close();
+            if (_out) {
+                if (_out != stdout) fclose(_out);
+                _out = NULL;
+            } else {
+                _f.close();
+            }
+            if (_syncFd >= 0) {
+#ifdef WIN32
+                _close(_syncFd);
+#else
+                ::close(_syncFd);
+#endif
+                _syncFd = -1;
+            }
             _valid = false;
         }
         this->unlock();
@@ -176,6 +428,13 @@ namespace PwxGet {
         }
     }
     
+    void FileBuffer::countDoneBytes() {
+        _doneBytes = 0;
+        for (size_t i=0; i<_sheetCount; i++) {
+            if (_managedIndex[i]) _doneBytes += _sheets.length(i);
+        }
+    }
+
     void FileBuffer::packIndex(const string& data, string& dst) {
         size_t dstlen = this->_sheetCount / 8;
         if (dstlen * 8 != this->_sheetCount) ++dstlen;
@@ -204,6 +463,7 @@ namespace PwxGet {
         for (size_t i=startSheet; i<endSheet; i++) {
             if (this->_index[i]) {
                 --this->_doneSheet;
+                this->_doneBytes -= _sheets.length(i);
                 this->_index[i] = 0;
             }
         }
@@ -216,22 +476,35 @@ namespace PwxGet {
             this->unlock();
             throw OutOfRange("startSheet");
         }
-        if (!_f.seekg(startSheet * _sheetSize, ios::beg)) {
-            this->unlock();
-            throw SeekError(_path, startSheet * _sheetSize);
-        }
-        size_t total = min(sheetCount * _sheetSize, _size-startSheet*_sheetSize);
-        // "min" to fix the last sheet 
-        
-        if (!_f.write((const char*)buffer, total)) {
-            this->unlock();
-            return 0;
+        size_t offset = _sheets.offset(startSheet), total = _sheets.bytes(startSheet, sheetCount);
+        if (_out) {
+            // streams only go forward
+            if (startSheet != _streamed) {
+                this->unlock();
+                throw OutOfRange("startSheet");
+            }
+            if (fwrite(buffer, 1, total, _out) != total) {
+                this->unlock();
+                throw IOException(_path, "Write to stream " + _path + " failed.");
+            }
+            _streamed += sheetCount;
+        } else {
+            if (!_f.seekg(offset, ios::beg)) {
+                this->unlock();
+                throw SeekError(_path, offset);
+            }
+            if (!_f.write((const char*)buffer, total)) {
+                this->unlock();
+                return 0;
+            }
         }
+        _unflushed += total;
 
         for (size_t i=0; i<sheetCount; i++) {
             size_t j = startSheet+i;
             if (!this->_index[j]) {
                 ++this->_doneSheet;
+                this->_doneBytes += _sheets.length(j);
                 this->_index[j] = 1;
             }
         }
@@ -239,19 +512,117 @@ namespace PwxGet {
         return sheetCount;
     }
     
+    const size_t FileBuffer::ZERO_CHECK_SIZE;
+
+    size_t FileBuffer::recover(bool checkZeros) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (_out) throw OperationCannotEmit("Cannot recover stream " + _path + ".");
+        _f.flush();
+        int fd = ::open(_path.c_str(), O_RDONLY);
+        if (fd < 0) throw IOException(_path, "Cannot open data file " + _path + ".");
+
+        // data regions, [begin, end)
+        vector<pair<off_t, off_t> > regions;
+        off_t pos = 0, size = _size, dataBytes = 0;
+        while (pos < size) {
+            off_t begin = lseek(fd, pos, SEEK_DATA);
+            if (begin < 0) break; // ENXIO: only a hole is left
+            off_t end = lseek(fd, begin, SEEK_HOLE);
+            if (end < 0 || end > size) end = size;
+            regions.push_back(make_pair(begin, end));
+            dataBytes += end - begin;
+            pos = end;
+        }
+        // without hole support the whole file reads as data, allocated or not
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (regions.size() == 1 && dataBytes == size &&
+                (off_t)st.st_blocks * 512 + (off_t)_sheetSize < size)) {
+            ::close(fd);
+            throw OperationCannotEmit("The file system of " + _path + " does not report holes.");
+        }
+
+        this->lock();
+        memset(_index, 0, _sheetCount);
+        _doneSheet = _doneBytes = 0;
+        string tail;
+        for (size_t r=0; r<regions.size(); r++) {
+            // whole sheets inside the region
+            size_t first = _sheets.sheetAt(regions[r].first),
+                    last = _sheets.sheetAt(regions[r].second);
+            if (_sheets.offset(first) < (size_t)regions[r].first) ++first;
+            for (size_t i=first; i<last; i++) {
+                if (checkZeros && (i == first || i + 1 == last)) {
+                    // an allocated block nothing was written to reads as zeros
+                    size_t end = _sheets.offset(i + 1),
+                            n = min(ZERO_CHECK_SIZE, _sheets.length(i));
+                    tail.resize(n);
+                    if (pread(fd, &tail[0], n, end - n) != (ssize_t)n ||
+                            tail.find_first_not_of('\0') == string::npos) continue;
+                }
+                _index[i] = 1;
+                ++_doneSheet;
+                _doneBytes += _sheets.length(i);
+            }
+        }
+        this->unlock();
+        ::close(fd);
+        this->flush();
+        return _doneSheet;
+#else
+        throw OperationCannotEmit("Recovery needs SEEK_DATA / SEEK_HOLE.");
+#endif
+    }
+
+    bool FileBuffer::clone(size_t sheet, const vector<Source> &sources) {
+#ifdef FICLONERANGE
+        if (_out || sheet >= _sheetCount) return false;
+        int dst = ::open(_path.c_str(), O_WRONLY);
+        if (dst < 0) return false;
+        size_t offset = _sheets.offset(sheet), end = _sheets.offset(sheet + 1);
+        for (size_t i=0; i<sources.size() && offset < end; i++) {
+            int src = ::open(sources[i].path.c_str(), O_RDONLY);
+            if (src < 0) break;
+            // an unaligned length is fine where it ends the source
+            struct file_clone_range range;
+            range.src_fd = src;
+            range.src_offset = sources[i].offset;
+            range.src_length = sources[i].length;
+            range.dest_offset = offset;
+            bool ok = ioctl(dst, FICLONERANGE, &range) == 0;
+            ::close(src);
+            if (!ok) break;
+            offset += sources[i].length;
+        }
+        ::close(dst);
+        if (offset != end) return false;
+
+        this->lock();
+        if (!this->_index[sheet]) {
+            ++this->_doneSheet;
+            this->_doneBytes += _sheets.length(sheet);
+            this->_index[sheet] = 1;
+        }
+        this->unlock();
+        return true;
+#else
+        return false;
+#endif
+    }
+
     size_t FileBuffer::read(byte *buffer, size_t startSheet, size_t sheetCount) {
+        if (_out) throw OperationCannotEmit("Cannot read back from stream " + _path + ".");
         this->lock();
         if (startSheet < 0 || startSheet >= _sheetCount) {
             this->unlock();
             throw OutOfRange("startSheet");
         }
-        if (!_f.seekg(startSheet * _sheetSize, ios::beg)) {
+        size_t offset = _sheets.offset(startSheet);
+        if (!_f.seekg(offset, ios::beg)) {
             this->unlock();
-            throw SeekError(_path, startSheet * _sheetSize);
+            throw SeekError(_path, offset);
         }
         size_t done = 0;
-        size_t total = min(sheetCount*_sheetSize, _size-startSheet*_sheetSize);
-        // "min" to fix the last sheet 
+        size_t total = _sheets.bytes(startSheet, sheetCount);
         
         while (done < total) {
             if (!_f.read((char*)buffer+done, total-done)) break;
@@ -259,8 +630,10 @@ namespace PwxGet {
         }
 
         this->unlock();
-        size_t ret = done / _sheetSize;
-        if (ret * _sheetSize != done) ++ret; // fix the last sheet
+        if (done == total) return min(sheetCount, _sheetCount - startSheet);
+        // a sheet read in part counts, like the short last one
+        size_t ret = _sheets.sheetAt(offset + done) - startSheet;
+        if (_sheets.offset(startSheet + ret) != offset + done) ++ret;
         return ret;
     }
 }
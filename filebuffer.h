@@ -10,9 +10,12 @@
 
 #include <string>
 #include <fstream>
+#include <vector>
+#include <stdio.h>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 #include "exceptions.h"
+#include "trace.h"
 
 namespace PwxGet {
     using namespace std;
@@ -27,6 +30,95 @@ namespace PwxGet {
      */
     string readfile(const string& path);
     void writefile(const string &path, const string &cnt);
+    /**
+     * Make what was written to a file survive a crash of the system.
+     * @param dataOnly: Leave out metadata the data can be read without (fdatasync).
+     */
+    void syncFile(const string &path, bool dataOnly = false);
+    /**
+     * Write a file anew under temp and rename it over path, so a crash
+     * leaves the old content or the new, never a torn one.
+     * @param sync: Sync temp before the rename and the directory after,
+     *              so the new content survives a crash of the system.
+     */
+    void replacefile(const string &path, const string &temp, const char *data, size_t length, bool sync);
+
+    /**
+     * When written sheets are made to reach the disk, and the index with them.
+     * An index that is written never marks a sheet written after the data
+     * was synced, so a resumed job never trusts data that may be lost.
+     */
+    struct Durability {
+        enum Mode {
+            NONE,       // never synced; the index is written every interval
+            INTERVAL,   // every interval the data is synced, then the index
+            STRICT      // the same after every write
+        };
+        inline Durability(Mode mode = INTERVAL, size_t intervalMs = 1000,
+                size_t intervalBytes = 64 * 1024 * 1024) :
+                mode(mode), intervalMs(intervalMs), intervalBytes(intervalBytes) {}
+        Mode mode;
+        size_t intervalMs, intervalBytes; // whichever comes first, 0 for no limit
+    };
+
+    /**
+     * Where each sheet of a file starts.
+     *
+     * Sheets are sheetSize() bytes in the bulk of the file. A tapered map
+     * ends in tailZones() zones: zone k holds zoneSheets() sheets of
+     * sheetSize() >> k bytes, and the last zone runs to the end of the
+     * file. Since the scan hands sheets out from the start, the requests
+     * shrink by themselves while the download closes in on the end, and
+     * no connection is left holding one big last sheet. Only the last
+     * sheet of the file may be short.
+     */
+    class SheetMap {
+    public:
+        static const size_t MAX_TAIL_ZONES = 4;
+        static const size_t MIN_TAIL_SHEET = DEFAULT_SHEET_SIZE;
+
+        // Sheets all of sheetSize.
+        SheetMap(size_t fileSize, size_t sheetSize);
+        SheetMap(size_t fileSize, size_t sheetSize, size_t tailZones, size_t zoneSheets);
+        /**
+         * A tail tapered for connections downloading at once: a zone of
+         * halved sheets for each of them, as many zones as keep the
+         * sheets at MIN_TAIL_SHEET or more, and at most half the file.
+         */
+        static SheetMap tapered(size_t fileSize, size_t sheetSize, size_t connections);
+
+        inline size_t fileSize() const throw() { return _fileSize; }
+        // Of the bulk, the largest sheets.
+        inline size_t sheetSize() const throw() { return _sheetSize; }
+        inline size_t sheetCount() const throw() { return _sheetCount; }
+        inline size_t tailZones() const throw() { return _zones; }
+        inline size_t zoneSheets() const throw() { return _zoneSheets; }
+        inline bool uniform() const throw() { return _zones == 0; }
+
+        // First byte of sheet, fileSize() from sheetCount() on.
+        inline size_t offset(size_t sheet) const throw() {
+            if (sheet >= _sheetCount) return _fileSize;
+            size_t z = 0;
+            while (z < _zones && sheet >= _zoneStart[z + 1]) ++z;
+            return _zoneOffset[z] + (sheet - _zoneStart[z]) * (_sheetSize >> z);
+        }
+        inline size_t length(size_t sheet) const throw() { return offset(sheet + 1) - offset(sheet); }
+        // Bytes of count sheets from sheet on.
+        inline size_t bytes(size_t sheet, size_t count) const throw() {
+            return offset(sheet + count) - offset(sheet);
+        }
+        // Sheet holding the byte at offset, sheetCount() from fileSize() on.
+        size_t sheetAt(size_t offset) const throw();
+
+        bool operator==(const SheetMap &other) const throw();
+        inline bool operator!=(const SheetMap &other) const throw() { return !(*this == other); }
+
+    protected:
+        size_t _fileSize, _sheetSize, _sheetCount, _zones, _zoneSheets;
+        // zone 0 is the bulk
+        size_t _zoneStart[MAX_TAIL_ZONES + 1], _zoneOffset[MAX_TAIL_ZONES + 1];
+        void layout();
+    };
 
     /**
      * Sheeted file buffer.
@@ -40,7 +132,8 @@ namespace PwxGet {
         class PackedIndex {
         public:
             virtual const string &getData() const = 0;
-            virtual void setData(const string &data) = 0;
+            // @param sync: Make data survive a crash of the system.
+            virtual void setData(const string &data, bool sync=false) = 0;
             virtual bool isValid() const throw() = 0;
             virtual const string identifier() const throw() = 0;
         };
@@ -51,11 +144,11 @@ namespace PwxGet {
             virtual bool isValid() const throw() { return _valid; }
             virtual const string identifier() const throw() { return _indexPath; }
             virtual const string &getData() const { return _data; }
-            virtual void setData(const string &data);
+            virtual void setData(const string &data, bool sync=false);
             virtual ~PackedIndexFile();
         protected:
             bool _valid;
-            string _data, _indexPath;
+            string _data, _indexPath, _tempPath;
         };
         
         /**
@@ -64,9 +157,14 @@ namespace PwxGet {
          * @param size: The destination file size.
          * @param packedIndex: Sheet index object.
          * @param sheetSize: Sheet size for the destination file.
+         * @param stream: Write to a pipe or stdout ("-") strictly in order
+         *                instead of seeking in a regular file.
          */
         FileBuffer(const string &path, size_t size, PackedIndex &packedIndex, 
-                size_t sheetSize = DEFAULT_SHEET_SIZE);
+                size_t sheetSize = DEFAULT_SHEET_SIZE, bool stream = false);
+        // Sheets laid out by sheets, the file is sheets.fileSize() long.
+        FileBuffer(const string &path, const SheetMap &sheets, PackedIndex &packedIndex,
+                bool stream = false);
         FileBuffer(const FileBuffer& orig);
         virtual ~FileBuffer() throw();
         
@@ -75,15 +173,49 @@ namespace PwxGet {
         size_t size() const throw () { return _size; }
         size_t sheetCount() const throw () { return _sheetCount; }
         size_t sheetSize() const throw () { return _sheetSize; }
+        const SheetMap &sheetMap() const throw () { return _sheets; }
         size_t doneSheet() const throw() { return _doneSheet; }
+        size_t doneBytes() const throw() { return _doneBytes; }
+        bool stream() const throw () { return _out != NULL; }
+        // Stream mode: the sheet the next write must start at.
+        size_t nextSheet() const throw() { return _streamed; }
         PackedIndex &packedIndex() const throw () { return _packedIndex; }
         
         void close();
+        // Write the index out now, with the syncs the durability asks for.
         void flush();
+        // After writing: flush() once the durability says it is due.
+        void checkpoint();
+        void setDurability(const Durability &durability);
+        const Durability &durability() const throw() { return _durability; }
         
         size_t write(const byte *buffer, size_t startSheet, size_t sheetCount);
         size_t read(byte *buffer, size_t startSheet, size_t sheetCount);
         void erase(size_t startSheet, size_t sheetCount);
+
+        /**
+         * Rebuild the index from the sparse layout of the file, for a job
+         * whose index is lost. The file is created sparse, so a sheet no
+         * hole falls into was written.
+         * @param checkZeros: Also refetch sheets next to a hole whose last
+         *                    block reads as zeros (allocated, never written).
+         * @return Sheets found written.
+         */
+        size_t recover(bool checkZeros = true);
+        static const size_t ZERO_CHECK_SIZE = 4096;
+
+        // Bytes of another file.
+        struct Source {
+            string path;
+            size_t offset, length;
+        };
+        /**
+         * Share the blocks of other files as one sheet (a reflink), and
+         * mark it written.
+         * @param sources: Together the sheet's bytes, in order.
+         * @return false where the file system cannot; the sheet stays unwritten.
+         */
+        bool clone(size_t sheet, const vector<Source> &sources);
         
     protected:
         boost::recursive_mutex _mutex;
@@ -91,9 +223,19 @@ namespace PwxGet {
         bool _valid;
         string _path;
         size_t _size, _sheetCount, _sheetSize;
+        SheetMap _sheets;
         string _managedIndex; byte *_index;
-        size_t _doneSheet;
+        string _packed; // reused by every flush
+        size_t _doneSheet, _doneBytes;
         PackedIndex &_packedIndex;
+        FILE *_out; // stream mode only
+        size_t _streamed;
+        Durability _durability;
+        int _syncFd;            // the data file, for syncing; -1 until needed
+        size_t _unflushed;      // bytes written since the last flush
+        double _lastFlush;
+        void syncData();
+        void open(PackedIndex &packedIndex, bool stream);
         
         //void lock() { _mutex.lock(); }
         //void unlock() { _mutex.unlock(); }
@@ -103,6 +245,7 @@ namespace PwxGet {
         //bool getSheetState(long long index);
         //void setSheetState(long long index, bool state);
         void unpackIndex(const string &data, string &dst, size_t &doneSheet);
+        void countDoneBytes();
         void packIndex  (const string &data, string &dst);
     };
 
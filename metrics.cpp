@@ -0,0 +1,334 @@
+/*
+ * metrics.cpp
+ *
+ *  Runtime counters and histograms, exported as Prometheus text and JSON.
+ */
+
+#include "metrics.h"
+#include "filebuffer.h"
+#include <stdio.h>
+#include <time.h>
+#include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+namespace fs = boost::filesystem;
+
+namespace PwxGet {
+	double monotonicSeconds() throw() {
+#ifndef WIN32
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+		static const boost::posix_time::ptime epoch = boost::posix_time::microsec_clock::universal_time();
+		return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds() / 1e6;
+#endif
+	}
+
+	MetricLabels metricLabels(const string &name, const string &value) {
+		MetricLabels ret;
+		ret.push_back(make_pair(name, value));
+		return ret;
+	}
+
+	MetricLabels metricLabels(const string &name1, const string &value1,
+			const string &name2, const string &value2) {
+		MetricLabels ret = metricLabels(name1, value1);
+		ret.push_back(make_pair(name2, value2));
+		return ret;
+	}
+
+	static const string formatNumber(double value) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.9g", value);
+		return buffer;
+	}
+
+	static const string formatNumber(unsigned long long value) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%llu", value);
+		return buffer;
+	}
+
+	static const string escape(const string &value) {
+		string ret;
+		for (size_t i=0; i<value.size(); i++) {
+			char ch = value[i];
+			if (ch == '"' || ch == '\\') ret += '\\';
+			if (ch == '\n') { ret += "\\n"; continue; }
+			ret += ch;
+		}
+		return ret;
+	}
+
+	/* Histogram */
+	Histogram::Histogram(const vector<double> &bounds) : _bounds(bounds),
+			_buckets(new boost::atomic<unsigned long long>[bounds.size() + 1]), _sumNs(0) {
+		for (size_t i=0; i<=_bounds.size(); i++) _buckets[i].store(0);
+	}
+
+	Histogram::~Histogram() {
+		delete [] _buckets;
+	}
+
+	void Histogram::observe(double seconds) throw() {
+		size_t i = 0;
+		while (i < _bounds.size() && seconds > _bounds[i]) ++i;
+		_buckets[i].fetch_add(1, boost::memory_order_relaxed);
+		if (seconds > 0)
+			_sumNs.fetch_add((unsigned long long)(seconds * 1e9), boost::memory_order_relaxed);
+	}
+
+	unsigned long long Histogram::cumulative(size_t i) const throw() {
+		unsigned long long ret = 0;
+		for (size_t j=0; j<=i && j<=_bounds.size(); j++)
+			ret += _buckets[j].load(boost::memory_order_relaxed);
+		return ret;
+	}
+
+	/* RateWindow */
+	RateWindow::RateWindow(double seconds) : _mutex(), _seconds(seconds), _rate(0.0), _samples() {
+	}
+
+	double RateWindow::sample(double now, unsigned long long total) {
+		Mutex::scoped_lock lock(_mutex);
+		_samples.push_back(make_pair(now, total));
+		// keep one sample at or before the window start
+		while (_samples.size() > 2 && _samples[1].first <= now - _seconds) _samples.pop_front();
+		double dt = now - _samples.front().first;
+		if (dt > 0 && total >= _samples.front().second)
+			_rate = (total - _samples.front().second) / dt;
+		return _rate;
+	}
+
+	double RateWindow::rate() {
+		Mutex::scoped_lock lock(_mutex);
+		return _rate;
+	}
+
+	/* MetricsRegistry */
+	MetricsRegistry::MetricsRegistry() : _mutex(), _families() {
+	}
+
+	MetricsRegistry::~MetricsRegistry() {
+		for (FamilyMap::iterator f=_families.begin(); f!=_families.end(); f++) {
+			for (map<string, Child>::iterator c=f->second.children.begin();
+					c!=f->second.children.end(); c++) {
+				switch (f->second.type) {
+				case COUNTER: delete (Counter*)c->second.metric; break;
+				case GAUGE: delete (Gauge*)c->second.metric; break;
+				case HISTOGRAM: delete (Histogram*)c->second.metric; break;
+				}
+			}
+		}
+		_families.clear();
+	}
+
+	MetricsRegistry &MetricsRegistry::global() {
+		static MetricsRegistry registry;
+		return registry;
+	}
+
+	const vector<double> &MetricsRegistry::latencyBounds() {
+		static const double b[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+				0.5, 1, 2.5, 5, 10, 30, 60};
+		static const vector<double> bounds(b, b + sizeof(b) / sizeof(b[0]));
+		return bounds;
+	}
+
+	void *MetricsRegistry::find(const string &name, const string &help, Type type,
+			const MetricLabels &labels) {
+		FamilyMap::iterator f = _families.find(name);
+		if (f == _families.end()) {
+			Family family;
+			family.type = type;
+			family.help = help;
+			f = _families.insert(make_pair(name, family)).first;
+		} else if (f->second.type != type) {
+			throw ArgumentError(name, "Metric " + name + " is registered as a " +
+					typeName(f->second.type) + ".");
+		}
+		map<string, Child>::iterator c = f->second.children.find(promLabels(labels));
+		return c == f->second.children.end()? NULL: c->second.metric;
+	}
+
+	Counter &MetricsRegistry::counter(const string &name, const string &help,
+			const MetricLabels &labels) {
+		Mutex::scoped_lock lock(_mutex);
+		void *metric = find(name, help, COUNTER, labels);
+		if (!metric) {
+			Child child;
+			child.labels = labels;
+			child.metric = metric = new Counter();
+			_families[name].children[promLabels(labels)] = child;
+		}
+		return *(Counter*)metric;
+	}
+
+	Gauge &MetricsRegistry::gauge(const string &name, const string &help,
+			const MetricLabels &labels) {
+		Mutex::scoped_lock lock(_mutex);
+		void *metric = find(name, help, GAUGE, labels);
+		if (!metric) {
+			Child child;
+			child.labels = labels;
+			child.metric = metric = new Gauge();
+			_families[name].children[promLabels(labels)] = child;
+		}
+		return *(Gauge*)metric;
+	}
+
+	Histogram &MetricsRegistry::histogram(const string &name, const string &help,
+			const MetricLabels &labels, const vector<double> &bounds) {
+		Mutex::scoped_lock lock(_mutex);
+		void *metric = find(name, help, HISTOGRAM, labels);
+		if (!metric) {
+			Child child;
+			child.labels = labels;
+			child.metric = metric = new Histogram(bounds);
+			_families[name].children[promLabels(labels)] = child;
+		}
+		return *(Histogram*)metric;
+	}
+
+	const string MetricsRegistry::typeName(Type type) {
+		switch (type) {
+		case COUNTER: return "counter";
+		case GAUGE: return "gauge";
+		default: return "histogram";
+		}
+	}
+
+	const string MetricsRegistry::promLabels(const MetricLabels &labels, const string &extra) {
+		string ret;
+		for (size_t i=0; i<labels.size(); i++) {
+			if (!ret.empty()) ret += ",";
+			ret += labels[i].first + "=\"" + escape(labels[i].second) + "\"";
+		}
+		if (!extra.empty()) ret += (ret.empty()? "": ",") + extra;
+		return ret.empty()? ret: "{" + ret + "}";
+	}
+
+	const string MetricsRegistry::jsonLabels(const MetricLabels &labels) {
+		string ret;
+		for (size_t i=0; i<labels.size(); i++) {
+			if (!ret.empty()) ret += ", ";
+			ret += "\"" + escape(labels[i].first) + "\": \"" + escape(labels[i].second) + "\"";
+		}
+		return "{" + ret + "}";
+	}
+
+	const string MetricsRegistry::prometheus() {
+		Mutex::scoped_lock lock(_mutex);
+		string ret;
+		for (FamilyMap::const_iterator f=_families.begin(); f!=_families.end(); f++) {
+			const string &name = f->first;
+			ret += "# HELP " + name + " " + f->second.help + "\n";
+			ret += "# TYPE " + name + " " + typeName(f->second.type) + "\n";
+			for (map<string, Child>::const_iterator c=f->second.children.begin();
+					c!=f->second.children.end(); c++) {
+				const MetricLabels &l = c->second.labels;
+				if (f->second.type == COUNTER) {
+					ret += name + c->first + " " + formatNumber(((Counter*)c->second.metric)->value()) + "\n";
+				} else if (f->second.type == GAUGE) {
+					ret += name + c->first + " " + formatNumber((double)((Gauge*)c->second.metric)->value()) + "\n";
+				} else {
+					Histogram *h = (Histogram*)c->second.metric;
+					for (size_t i=0; i<h->bounds().size(); i++) {
+						ret += name + "_bucket" + promLabels(l, "le=\"" + formatNumber(h->bounds()[i]) + "\"")
+								+ " " + formatNumber(h->cumulative(i)) + "\n";
+					}
+					ret += name + "_bucket" + promLabels(l, "le=\"+Inf\"") + " " + formatNumber(h->count()) + "\n";
+					ret += name + "_sum" + c->first + " " + formatNumber(h->sum()) + "\n";
+					ret += name + "_count" + c->first + " " + formatNumber(h->count()) + "\n";
+				}
+			}
+		}
+		return ret;
+	}
+
+	const string MetricsRegistry::json() {
+		Mutex::scoped_lock lock(_mutex);
+		string ret = "{\"metrics\": [";
+		for (FamilyMap::const_iterator f=_families.begin(); f!=_families.end(); f++) {
+			if (f != _families.begin()) ret += ",";
+			ret += "\n  {\"name\": \"" + f->first + "\", \"type\": \"" + typeName(f->second.type)
+					+ "\", \"help\": \"" + escape(f->second.help) + "\", \"samples\": [";
+			for (map<string, Child>::const_iterator c=f->second.children.begin();
+					c!=f->second.children.end(); c++) {
+				if (c != f->second.children.begin()) ret += ", ";
+				ret += "{\"labels\": " + jsonLabels(c->second.labels);
+				if (f->second.type == COUNTER) {
+					ret += ", \"value\": " + formatNumber(((Counter*)c->second.metric)->value());
+				} else if (f->second.type == GAUGE) {
+					ret += ", \"value\": " + formatNumber((double)((Gauge*)c->second.metric)->value());
+				} else {
+					Histogram *h = (Histogram*)c->second.metric;
+					ret += ", \"buckets\": [";
+					for (size_t i=0; i<h->bounds().size(); i++) {
+						if (i) ret += ", ";
+						ret += "[" + formatNumber(h->bounds()[i]) + ", " + formatNumber(h->cumulative(i)) + "]";
+					}
+					ret += "], \"sum\": " + formatNumber(h->sum()) + ", \"count\": " + formatNumber(h->count());
+				}
+				ret += "}";
+			}
+			ret += "]}";
+		}
+		ret += "\n]}\n";
+		return ret;
+	}
+
+	/* MetricsWriter */
+	MetricsWriter::MetricsWriter(MetricsRegistry &registry, const string &promPath,
+			const string &jsonPath, size_t intervalMs) : _registry(registry),
+			_promPath(promPath), _jsonPath(jsonPath), _intervalMs(intervalMs), _thread(NULL) {
+	}
+
+	MetricsWriter::~MetricsWriter() {
+		stop();
+	}
+
+	void MetricsWriter::start() {
+		if (_thread) return;
+		_thread = new boost::thread(boost::bind(&MetricsWriter::loop, this));
+	}
+
+	void MetricsWriter::stop() {
+		if (!_thread) return;
+		_thread->interrupt();
+		_thread->join();
+		delete _thread;
+		_thread = NULL;
+		try {
+			write();
+		} catch (const IOException &) {}
+	}
+
+	static void replaceFile(const string &path, const string &content) {
+		string tmp = path + ".tmp";
+		writefile(tmp, content);
+		try {
+			fs::rename(tmp, path);
+		} catch (const fs::filesystem_error &) {
+			throw IOException(path, "Cannot replace metrics file " + path + ".");
+		}
+	}
+
+	void MetricsWriter::write() {
+		if (!_promPath.empty()) replaceFile(_promPath, _registry.prometheus());
+		if (!_jsonPath.empty()) replaceFile(_jsonPath, _registry.json());
+	}
+
+	void MetricsWriter::loop() {
+		try {
+			while (true) {
+				try {
+					write();
+				} catch (const IOException &) {
+					// keep trying, the directory may come back
+				}
+				boost::this_thread::sleep(boost::posix_time::milliseconds(_intervalMs));
+			}
+		} catch (const boost::thread_interrupted &) {}
+	}
+}
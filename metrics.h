@@ -0,0 +1,169 @@
+/*
+ * metrics.h
+ *
+ *  Runtime counters and histograms, exported as Prometheus text and JSON.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include "exceptions.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	/**
+	 * Seconds on a monotonic clock, for measuring intervals.
+	 */
+	double monotonicSeconds() throw();
+
+	typedef vector<pair<string, string> > MetricLabels;
+
+	MetricLabels metricLabels(const string &name, const string &value);
+	MetricLabels metricLabels(const string &name1, const string &value1,
+			const string &name2, const string &value2);
+
+	// Monotonic counter, safe to bump from any thread.
+	class Counter {
+	public:
+		inline Counter() : _value(0) {}
+		inline void inc(unsigned long long n=1) throw() { _value.fetch_add(n, boost::memory_order_relaxed); }
+		inline unsigned long long value() const throw() { return _value.load(boost::memory_order_relaxed); }
+	protected:
+		boost::atomic<unsigned long long> _value;
+	};
+
+	class Gauge {
+	public:
+		inline Gauge() : _value(0) {}
+		inline void set(long long v) throw() { _value.store(v, boost::memory_order_relaxed); }
+		inline void add(long long n) throw() { _value.fetch_add(n, boost::memory_order_relaxed); }
+		inline long long value() const throw() { return _value.load(boost::memory_order_relaxed); }
+	protected:
+		boost::atomic<long long> _value;
+	};
+
+	/**
+	 * Histogram of durations in seconds with fixed upper bounds.
+	 */
+	class Histogram {
+	public:
+		Histogram(const vector<double> &bounds);
+		~Histogram();
+		void observe(double seconds) throw();
+		inline const vector<double> &bounds() const throw() { return _bounds; }
+		// count of observations <= bounds()[i]; i == bounds().size() gives all
+		unsigned long long cumulative(size_t i) const throw();
+		inline unsigned long long count() const throw() { return cumulative(_bounds.size()); }
+		inline double sum() const throw() { return _sumNs.load(boost::memory_order_relaxed) / 1e9; }
+	protected:
+		vector<double> _bounds;
+		boost::atomic<unsigned long long> *_buckets;
+		boost::atomic<unsigned long long> _sumNs;
+	private:
+		Histogram(const Histogram &);
+		Histogram &operator=(const Histogram &);
+	};
+
+	/**
+	 * Rate of a growing total over the last few seconds.
+	 *
+	 * Writers only bump the total (e.g. a Counter); whoever reports feeds
+	 * the total in now and then, so no lock is shared with the writers.
+	 */
+	class RateWindow {
+	public:
+		RateWindow(double seconds);
+		// Add a sample of the running total, returns the rate in units/s.
+		double sample(double now, unsigned long long total);
+		double rate();
+	protected:
+		typedef boost::mutex Mutex;
+		Mutex _mutex;
+		double _seconds, _rate;
+		deque<pair<double, unsigned long long> > _samples;
+	};
+
+	/**
+	 * Named metric families with labelled children.
+	 *
+	 * Looking a metric up takes a lock; hot paths should look theirs up once
+	 * and keep the reference, which stays valid for the registry's lifetime.
+	 */
+	class MetricsRegistry {
+	public:
+		MetricsRegistry();
+		virtual ~MetricsRegistry();
+
+		// The registry shared by all components of the process.
+		static MetricsRegistry &global();
+		// Default bounds for latency histograms, 1 ms to 60 s.
+		static const vector<double> &latencyBounds();
+
+		Counter &counter(const string &name, const string &help,
+				const MetricLabels &labels=MetricLabels());
+		Gauge &gauge(const string &name, const string &help,
+				const MetricLabels &labels=MetricLabels());
+		Histogram &histogram(const string &name, const string &help,
+				const MetricLabels &labels=MetricLabels(),
+				const vector<double> &bounds=latencyBounds());
+
+		// exports
+		const string prometheus();
+		const string json();
+
+	protected:
+		enum Type { COUNTER, GAUGE, HISTOGRAM };
+		struct Child {
+			MetricLabels labels;
+			void *metric;
+		};
+		struct Family {
+			Type type;
+			string help;
+			map<string, Child> children; // keyed by rendered labels
+		};
+		typedef boost::mutex Mutex;
+		typedef map<string, Family> FamilyMap;
+
+		Mutex _mutex;
+		FamilyMap _families;
+
+		void *find(const string &name, const string &help, Type type, const MetricLabels &labels);
+		static const string typeName(Type type);
+		static const string promLabels(const MetricLabels &labels, const string &extra=string());
+		static const string jsonLabels(const MetricLabels &labels);
+	};
+
+	/**
+	 * Rewrites the Prometheus textfile and/or the JSON file periodically.
+	 * Files are replaced atomically so scrapers never see half a file.
+	 */
+	class MetricsWriter {
+	public:
+		MetricsWriter(MetricsRegistry &registry, const string &promPath,
+				const string &jsonPath, size_t intervalMs=METRICS_INTERVAL_MS);
+		virtual ~MetricsWriter();
+		void start();
+		void stop();
+		void write();
+
+		static const size_t METRICS_INTERVAL_MS = 5000;
+
+	protected:
+		MetricsRegistry &_registry;
+		string _promPath, _jsonPath;
+		size_t _intervalMs;
+		boost::thread *_thread;
+
+		void loop();
+	};
+}
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,289 @@
+/*
+ * proxyhistory.cpp
+ */
+
+#include "proxyhistory.h"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+namespace fs = boost::filesystem;
+
+namespace PwxGet {
+
+	namespace {
+		// bucket of value in units, by power of two
+		size_t bucket(double value) {
+			size_t i = 0;
+			while (i + 1 < ProxyStats::BUCKETS && value >= 2.0) {
+				value /= 2.0;
+				++i;
+			}
+			return i;
+		}
+
+		// middle of the bucket holding the q quantile, in units
+		double quantile(const double *counts, double q) {
+			double total = 0.0;
+			for (size_t i=0; i<ProxyStats::BUCKETS; i++) total += counts[i];
+			if (total <= 0.0) return 0.0;
+			double seen = 0.0;
+			for (size_t i=0; i<ProxyStats::BUCKETS; i++) {
+				seen += counts[i];
+				if (seen >= q * total) return ldexp(1.5, (int)i);
+			}
+			return ldexp(1.5, (int)ProxyStats::BUCKETS - 1);
+		}
+
+		double score(const ProxyStats &stats) {
+			if (stats.requests < ProxyHistory::MIN_REQUESTS) return 0.0;
+			return stats.rate(0.5) * (1.0 - stats.failureRate());
+		}
+
+		bool failing(const ProxyStats &stats) {
+			return stats.requests >= ProxyHistory::MIN_REQUESTS && stats.failureRate() >= ProxyHistory::FAILING;
+		}
+
+		const string joinCounts(const double *counts) {
+			ostringstream out;
+			for (size_t i=0; i<ProxyStats::BUCKETS; i++) out << (i? ",": "") << counts[i];
+			return out.str();
+		}
+
+		bool splitCounts(const string &text, double *counts) {
+			vector<string> fields;
+			boost::split(fields, text, boost::is_any_of(","));
+			if (fields.size() != ProxyStats::BUCKETS) return false;
+			for (size_t i=0; i<ProxyStats::BUCKETS; i++) counts[i] = boost::lexical_cast<double>(fields[i]);
+			return true;
+		}
+	}
+
+	/* ProxyStats */
+	ProxyStats::ProxyStats() : requests(0.0), failures(0.0), lastSeen(0) {
+		fill(rates, rates + BUCKETS, 0.0);
+		fill(firstBytes, firstBytes + BUCKETS, 0.0);
+	}
+
+	void ProxyStats::add(bool ok, size_t bytes, double firstByte, double total) throw() {
+		requests += 1.0;
+		if (!ok) failures += 1.0;
+		else if (bytes && total > 0.0) rates[bucket(bytes / total / 1024.0)] += 1.0;
+		if (firstByte > 0.0) firstBytes[bucket(firstByte * 1000.0)] += 1.0;
+	}
+
+	void ProxyStats::merge(const ProxyStats &other) throw() {
+		requests += other.requests;
+		failures += other.failures;
+		for (size_t i=0; i<BUCKETS; i++) {
+			rates[i] += other.rates[i];
+			firstBytes[i] += other.firstBytes[i];
+		}
+		lastSeen = max(lastSeen, other.lastSeen);
+	}
+
+	void ProxyStats::fade(time_t now) throw() {
+		if (now <= lastSeen) return;
+		double factor = pow(0.5, double(now - lastSeen) / ProxyHistory::HALF_LIFE);
+		requests *= factor;
+		failures *= factor;
+		for (size_t i=0; i<BUCKETS; i++) {
+			rates[i] *= factor;
+			firstBytes[i] *= factor;
+		}
+	}
+
+	double ProxyStats::rate(double q) const throw() {
+		return quantile(rates, q) * 1024.0;
+	}
+
+	double ProxyStats::firstByte(double q) const throw() {
+		return quantile(firstBytes, q) / 1000.0;
+	}
+
+	/* ProxyHistory */
+	const double ProxyHistory::FAILING = 0.5;
+
+	ProxyHistory::ProxyHistory(const string &path) : _path(path), _mutex(), _known(), _session() {
+		read(_path, _known);
+		time_t now = time(NULL);
+		for (StatsMap::iterator it=_known.begin(); it!=_known.end(); it++) it->second.fade(now);
+	}
+
+	ProxyHistory::~ProxyHistory() throw() {
+	}
+
+	const string ProxyHistory::hostOf(const string &url) {
+		size_t begin = url.find("://");
+		begin = begin == string::npos? 0: begin + 3;
+		size_t end = url.find_first_of("/?#", begin);
+		string host = url.substr(begin, end == string::npos? string::npos: end - begin);
+		size_t at = host.rfind('@');
+		if (at != string::npos) host.erase(0, at + 1);
+		return boost::to_lower_copy(host);
+	}
+
+	const string ProxyHistory::key(const string &proxy, const string &host) {
+		return (proxy.empty()? string("-"): proxy) + "\t" + host;
+	}
+
+	const ProxyStats *ProxyHistory::known(const string &proxy, const string &host) {
+		StatsMap::const_iterator it = _known.find(key(proxy, host));
+		return it == _known.end()? NULL: &it->second;
+	}
+
+	double ProxyHistory::score(const string &proxy, const string &host) {
+		Mutex::scoped_lock lock(_mutex);
+		const ProxyStats *stats = known(proxy, host);
+		return stats? PwxGet::score(*stats): 0.0;
+	}
+
+	bool ProxyHistory::failing(const string &proxy, const string &host) {
+		Mutex::scoped_lock lock(_mutex);
+		const ProxyStats *stats = known(proxy, host);
+		return stats && PwxGet::failing(*stats);
+	}
+
+	void ProxyHistory::rank(list<string> &proxies, const string &host) {
+		// (class, -score, position), class 0 works, 1 unknown, 2 fails
+		typedef pair<pair<int, double>, size_t> Rank;
+		vector<pair<Rank, string> > ranked;
+		{
+			Mutex::scoped_lock lock(_mutex);
+			for (list<string>::const_iterator it=proxies.begin(); it!=proxies.end(); it++) {
+				const ProxyStats *stats = known(*it, host);
+				double s = stats? PwxGet::score(*stats): 0.0;
+				int rankClass = stats && PwxGet::failing(*stats)? 2: s > 0.0? 0: 1;
+				ranked.push_back(make_pair(Rank(make_pair(rankClass, -s), ranked.size()), *it));
+			}
+		}
+		sort(ranked.begin(), ranked.end());
+		proxies.clear();
+		for (size_t i=0; i<ranked.size(); i++) proxies.push_back(ranked[i].second);
+	}
+
+	size_t ProxyHistory::concurrency(const string &proxy, const string &host, size_t threads) {
+		threads = max(threads, (size_t)1);
+		Mutex::scoped_lock lock(_mutex);
+		const ProxyStats *stats = known(proxy, host);
+		if (!stats) return threads;
+		if (PwxGet::failing(*stats)) return 1;
+		double s = PwxGet::score(*stats), best = 0.0;
+		if (s <= 0.0) return threads;
+		string suffix = "\t" + host;
+		for (StatsMap::const_iterator it=_known.begin(); it!=_known.end(); it++) {
+			if (boost::ends_with(it->first, suffix)) best = max(best, PwxGet::score(it->second));
+		}
+		// at half the best speed or more, all of them
+		double share = min(1.0, 2.0 * s / best);
+		return max((size_t)1, min(threads, (size_t)ceil(threads * share)));
+	}
+
+	void ProxyHistory::record(const string &proxy, const string &host, const ProxyStats &stats) {
+		if (stats.requests <= 0.0) return;
+		Mutex::scoped_lock lock(_mutex);
+		ProxyStats &session = _session[key(proxy, host)];
+		session.merge(stats);
+		session.lastSeen = time(NULL);
+	}
+
+	bool ProxyHistory::save() {
+		Mutex::scoped_lock lock(_mutex);
+		if (_session.empty()) return true;
+		string lockPath = _path + ".lock";
+		boost::system::error_code ec;
+		fs::path parent = fs::path(_path).parent_path();
+		if (!parent.empty()) fs::create_directories(parent, ec);
+		{
+			ofstream touch(lockPath.c_str(), ios::app);
+			if (!touch) return false;
+		}
+		StatsMap merged;
+		try {
+			boost::interprocess::file_lock fileLock(lockPath.c_str());
+			boost::interprocess::scoped_lock<boost::interprocess::file_lock> locked(fileLock);
+			// what other runs saved meanwhile counts too
+			read(_path, merged);
+			time_t now = time(NULL);
+			for (StatsMap::const_iterator it=_session.begin(); it!=_session.end(); it++) {
+				ProxyStats &stats = merged[it->first];
+				stats.fade(now);
+				stats.merge(it->second);
+				stats.lastSeen = now;
+			}
+			StatsMap::iterator it = merged.begin();
+			while (it != merged.end()) {
+				if (now - it->second.lastSeen > MAX_AGE) merged.erase(it++);
+				else ++it;
+			}
+			if (!write(_path, merged)) return false;
+			_session.clear();
+			for (it=merged.begin(); it!=merged.end(); it++) it->second.fade(now);
+			_known.swap(merged);
+		} catch (const boost::interprocess::interprocess_exception &) {
+			return false;
+		}
+		return true;
+	}
+
+	void ProxyHistory::read(const string &path, StatsMap &stats) {
+		stats.clear();
+		ifstream in(path.c_str());
+		string line;
+		vector<string> fields;
+		while (getline(in, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			boost::split(fields, line, boost::is_any_of("\t"));
+			if (fields.size() != 7) continue;
+			ProxyStats record;
+			try {
+				record.lastSeen = boost::lexical_cast<time_t>(fields[2]);
+				record.requests = boost::lexical_cast<double>(fields[3]);
+				record.failures = boost::lexical_cast<double>(fields[4]);
+				if (!splitCounts(fields[5], record.rates) || !splitCounts(fields[6], record.firstBytes))
+					continue;
+			} catch (const boost::bad_lexical_cast &) {
+				continue; // a line from a newer format, or damage
+			}
+			stats[fields[0] + "\t" + fields[1]] = record;
+		}
+	}
+
+	bool ProxyHistory::write(const string &path, const StatsMap &stats) {
+		string temp = path + ".tmp-" + boost::lexical_cast<string>(getpid());
+		boost::system::error_code ec;
+		{
+			ofstream out(temp.c_str(), ios::trunc);
+			out << "# pwxget proxy history: proxy, host, last seen, requests, failures,"
+					" requests by rate (1K/s doubling), requests by first byte (1 ms doubling)\n";
+			for (StatsMap::const_iterator it=stats.begin(); it!=stats.end(); it++) {
+				const ProxyStats &s = it->second;
+				out << it->first << "\t" << s.lastSeen << "\t" << s.requests << "\t" << s.failures
+						<< "\t" << joinCounts(s.rates) << "\t" << joinCounts(s.firstBytes) << "\n";
+			}
+			if (!out || (out.close(), !out)) {
+				fs::remove(temp, ec);
+				return false;
+			}
+		}
+		fs::rename(temp, path, ec);
+		if (ec) {
+			fs::remove(temp, ec);
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * proxyhistory.h
+ *
+ *  How each proxy did for each target host in earlier runs, kept in a
+ *  small file, so a run ranks proxies and spreads connections over them
+ *  from the start instead of learning it all again.
+ *
+ *  One line per proxy and host, tab separated:
+ *
+ *    <proxy> <host> <last seen> <requests> <failures> <rates> <first bytes>
+ *
+ *  The direct connection is written as "-". Rates and first bytes are
+ *  comma separated request counts by power of two: bytes/s from 1K up,
+ *  milliseconds to the first byte from 1 up. Counts fade with a half-life
+ *  of HALF_LIFE seconds from the last time the pair was seen, and pairs
+ *  not seen for MAX_AGE are dropped.
+ *
+ *  save() merges the run into what the file holds by then, under
+ *  <path>.lock, and renames the new file into place, so runs ending at
+ *  the same time lose nothing and readers never see half a file.
+ */
+
+#ifndef PROXYHISTORY_H_
+#define PROXYHISTORY_H_
+
+#include <string>
+#include <list>
+#include <map>
+#include <ctime>
+#include <boost/thread.hpp>
+
+namespace PwxGet {
+	using namespace std;
+
+	// Requests through one proxy to one host; plain data, filled without allocating.
+	class ProxyStats {
+	public:
+		static const size_t BUCKETS = 24;
+		ProxyStats();
+		// One request: bytes of body in total seconds, firstByte 0 if none arrived.
+		void add(bool ok, size_t bytes, double firstByte, double total) throw();
+		// Add other's counts to these, taking the later last seen.
+		void merge(const ProxyStats &other) throw();
+		// Scale the counts down for the time since lastSeen.
+		void fade(time_t now) throw();
+		// Bytes/s q of the requests beat, 0 without any.
+		double rate(double q) const throw();
+		// Seconds to the first byte, 0 without any.
+		double firstByte(double q) const throw();
+		inline double failureRate() const throw() { return requests > 0? failures / requests: 0.0; }
+		double requests, failures;
+		double rates[BUCKETS], firstBytes[BUCKETS];
+		time_t lastSeen;
+	};
+
+	class ProxyHistory {
+	public:
+		// Read path; a missing or broken file is an empty history.
+		ProxyHistory(const string &path);
+		virtual ~ProxyHistory() throw();
+
+		inline const string &path() const throw() { return _path; }
+		// The key part of a url: host[:port], lower case.
+		static const string hostOf(const string &url);
+
+		/**
+		 * Bytes/s a connection through proxy is expected to get from host,
+		 * failures counted in; 0 if too little is known.
+		 */
+		double score(const string &proxy, const string &host);
+		// Whether most requests through proxy to host failed.
+		bool failing(const string &proxy, const string &host);
+		/**
+		 * Order proxies for host: those known to work, fastest first, then
+		 * the unknown, then those known to fail. Stable within each.
+		 */
+		void rank(list<string> &proxies, const string &host);
+		/**
+		 * Connections to open through proxy: all of threads unless it is
+		 * much slower than the best proxy known for host, at least one.
+		 */
+		size_t concurrency(const string &proxy, const string &host, size_t threads);
+
+		// Add what this run saw; thread-safe.
+		void record(const string &proxy, const string &host, const ProxyStats &stats);
+		// Merge the recorded stats into the file. False if it cannot be written.
+		bool save();
+
+		static const int HALF_LIFE = 3 * 86400;
+		static const int MAX_AGE = 30 * 86400;
+		static const size_t MIN_REQUESTS = 4; // fewer is not known
+		static const double FAILING; // failure rate
+
+	protected:
+		typedef boost::mutex Mutex;
+		typedef map<string, ProxyStats> StatsMap; // by proxy "\t" host
+		string _path;
+		Mutex _mutex;
+		StatsMap _known;	// faded to when it was loaded
+		StatsMap _session;	// recorded since the last save
+
+		static const string key(const string &proxy, const string &host);
+		const ProxyStats *known(const string &proxy, const string &host); // call with _mutex held
+		static void read(const string &path, StatsMap &stats);
+		static bool write(const string &path, const StatsMap &stats);
+	};
+}
+
+#endif /* PROXYHISTORY_H_ */
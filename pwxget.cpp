@@ -14,7 +14,9 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "webctl.h"
+#include "daemon.h"
 
 #ifdef WINNT
 #include <getopt.h>
@@ -37,9 +39,29 @@ public:
 	list<string> proxies;
 	bool useRedirectedUrl;
 	SpeedProfile speedProfile;
+	bool autoProfile;
+	string metricsPath, metricsJsonPath;
+	string tracePath;
+	size_t rateLimit, proxyRateLimit;
+	bool prefixFirst, recover;
+	string daemonSocket, clientSocket;
+	string chunkCacheDir;
+	size_t chunkCacheSize;
+	string historyPath;
+	string durability;
 
 	inline Arguments() : threadPerProxy(1), url(), url2(), savePath(), cookies(),
-			direct(false), proxies(), useRedirectedUrl(false), speedProfile() {
+			direct(false), proxies(), useRedirectedUrl(false), speedProfile(), autoProfile(true),
+			metricsPath(), metricsJsonPath(), tracePath(),
+			rateLimit(0), proxyRateLimit(0), prefixFirst(false), recover(false),
+			daemonSocket(), clientSocket(), chunkCacheDir(), chunkCacheSize(DEFAULT_CHUNK_CACHE_SIZE),
+			historyPath(), durability("interval") {
+#ifdef WIN32
+		const char *home = getenv("APPDATA");
+#else
+		const char *home = getenv("HOME");
+#endif
+		if (home && *home) historyPath = (fs::path(home) / ".pwxget" / "history").string();
 	}
 	inline ~Arguments() {}
 
@@ -55,12 +77,17 @@ public:
 				<< "SpeedProfile=" << speedProfile.name << endl;
 	}*/
 } arguments;
-static const char *optFormat = "n:c:p:drs:h?";
+static const char *optFormat = "n:c:p:drs:l:L:PRy:k:K:w:m:j:t:D:C:h?";
 int retCode = 0;
+// progress & messages; stderr when the data itself goes to stdout
+FILE *console = stdout;
 
 void usage() {
 	printf(	"pwxget - Download from multi proxy servers.\n"
 			"Usage: pwxget [options] ... target-url output-path\n"
+#ifndef WIN32
+			"       pwxget -D socket [options]\n"
+#endif
 			"\n"
 			"  -n [count]       Downloading threads for each proxy.\n"
 			"  -c [cookies]     HTTP Cookies.\n"
@@ -70,10 +97,39 @@ void usage() {
 			"  -r               If request got an HTTP redirection, new threads should use\n"
 			"                   the redirected url instead of the origin one.\n"
 			"  -s [profile]     Speed profile. Control the file sheet and memory cache size.\n"
-			"                   Profile may be extreme, high, medium and low.\n"
+			"                   Profile may be auto (default), extreme, high, medium and low.\n"
+			"                   Auto derives sizes from the file and a probe of the link,\n"
+			"                   and keeps adjusting them while downloading.\n"
+			"  -l [rate]        Limit the total download speed, in bytes/s (e.g. 800K, 4M).\n"
+			"  -L [rate]        Limit the download speed through each proxy.\n"
+			"  -P               Fetch the lowest missing sheets first, so the file can be\n"
+			"                   read from the start while it grows.\n"
+			"  -R               Resume from the data in the output path when its job file\n"
+			"                   is lost or broken. Needs a file system that reports holes.\n"
+			"  -y [policy]      When written data is synced to disk: none, strict (after\n"
+			"                   every write) or interval[:ms[:size]] (default interval:1000:64M,\n"
+			"                   so a crash loses up to a second or 64M of progress).\n"
+			"                   The job file only marks sheets synced before it, and is\n"
+			"                   replaced whole, so a crash never leaves it torn.\n"
+			"  -k [dir]         Keep fetched sheets in a chunk cache shared by every job\n"
+			"                   on this host, and copy the sheets it holds from there.\n"
+			"  -K [size]        Chunk cache size cap (default 1G).\n"
+			"  -w [file]        Remember how fast each proxy was for each host in file, and\n"
+			"                   start with the fast ones (default ~/.pwxget/history; - for none).\n"
+			"  -m [file]        Keep writing metrics to file in Prometheus text format.\n"
+			"  -j [file]        Keep writing metrics to file in JSON.\n"
+			"  -t [file]        Trace workers and write the timeline to file in Chrome\n"
+			"                   trace format on exit, or at once on SIGUSR1.\n"
+#ifndef WIN32
+			"  -D [socket]      Run as a daemon taking jobs on a Unix socket. Proxies are\n"
+			"                   checked once; no url or output path is given.\n"
+			"  -C [socket]      Hand the download to the daemon on socket and follow it.\n"
+#endif
 			"  -h, -?           Show usage.\n"
 			"\n"
-			"Target url will be downloaded and saved to output path.\n");
+			"Target url will be downloaded and saved to output path.\n"
+			"Output path may be - for stdout or a named pipe, then data is written\n"
+			"in order as it arrives and the download cannot be resumed.\n");
 }
 
 bool parseArguments(int argc, char **argv) {
@@ -85,7 +141,7 @@ bool parseArguments(int argc, char **argv) {
 		case 'n':
 			try {
 				arguments.threadPerProxy = boost::lexical_cast<size_t>(optarg);
-			} catch (boost::bad_lexical_cast) {
+			} catch (const boost::bad_lexical_cast &) {
 				retCode = 1;
 				return false;
 			}
@@ -106,19 +162,69 @@ bool parseArguments(int argc, char **argv) {
 			arguments.useRedirectedUrl = true;
 			break;
 		case 's':
-			if (strcmp(optarg, "extreme") == 0)
-				arguments.speedProfile = SPD_EXTREME;
-			else if (strcmp(optarg, "high") == 0 || strcmp(optarg, "fast") == 0)
-				arguments.speedProfile = SPD_HIGH;
-			else if (strcmp(optarg, "medium") == 0 || strcmp(optarg, "normal") == 0)
-				arguments.speedProfile = SPD_MEDIUM;
-			else if (strcmp(optarg, "low") == 0 || strcmp(optarg, "slow") == 0)
-				arguments.speedProfile = SPD_LOW;
-			else {
+			arguments.autoProfile = false;
+			if (strcmp(optarg, "auto") == 0)
+				arguments.autoProfile = true;
+			else if (!speedProfileByName(optarg, arguments.speedProfile)) {
 				retCode = 2;
 				return false;
 			}
 			break;
+		case 'l':
+		case 'L':
+			try {
+				(opt == 'l'? arguments.rateLimit: arguments.proxyRateLimit) = parseSize(optarg);
+			} catch (const ArgumentError &) {
+				retCode = 4;
+				return false;
+			}
+			break;
+		case 'P':
+			arguments.prefixFirst = true;
+			break;
+		case 'R':
+			arguments.recover = true;
+			break;
+		case 'y':
+			try {
+				parseDurability(optarg);
+			} catch (const ArgumentError &) {
+				retCode = 4;
+				return false;
+			}
+			arguments.durability = string(optarg);
+			break;
+		case 'k':
+			arguments.chunkCacheDir = string(optarg);
+			break;
+		case 'K':
+			try {
+				arguments.chunkCacheSize = parseSize(optarg);
+			} catch (const ArgumentError &) {
+				retCode = 4;
+				return false;
+			}
+			break;
+		case 'w':
+			arguments.historyPath = string(optarg) == "-"? string(): string(optarg);
+			break;
+		case 'm':
+			arguments.metricsPath = string(optarg);
+			break;
+		case 'j':
+			arguments.metricsJsonPath = string(optarg);
+			break;
+		case 't':
+			arguments.tracePath = string(optarg);
+			break;
+#ifndef WIN32
+		case 'D':
+			arguments.daemonSocket = string(optarg);
+			break;
+		case 'C':
+			arguments.clientSocket = string(optarg);
+			break;
+#endif
 		case 'h':
 		case '?':
 			return false;
@@ -128,6 +234,7 @@ bool parseArguments(int argc, char **argv) {
 
 		opt = getopt(argc, argv, optFormat);
 	}
+	if (!arguments.daemonSocket.empty() && optind == argc) return true;
 	if (optind != argc - 2) {
 		retCode = 3;
 		return false;
@@ -179,15 +286,68 @@ string humanTime(time_t time) {
 	return boost::join(ret, string(" "));
 }
 
+// Rewrite the progress line in place, returns its length for the next call.
+size_t showProgress(size_t doneBytes, size_t fileSize, double speed, double rate,
+		size_t cacheBytes, size_t cacheCapacity, size_t lastOutputLength) {
+	char outputBuffer[1024] = {0};
+	string percent = boost::lexical_cast<string>(fileSize? (unsigned long long)doneBytes * 100 / fileSize: 0),
+			doneSize = humanSize(doneBytes), totalSize = humanSize(fileSize);
+	string speedSize = humanSize(speed);
+	string workPageSize = humanSize(cacheBytes), allPageSize = humanSize(cacheCapacity);
+	string eta = "--";
+	if (doneBytes >= fileSize)
+		eta = "0s";
+	else if (rate > 0)
+		eta = humanTime(time_t((fileSize - doneBytes) / rate) + 1);
+	// make current line
+	sprintf(outputBuffer, "Progress: %s%%, %s/%s. Speed: %s/s. ETA: %s. Cache: %s/%s.",
+			percent.c_str(), doneSize.c_str(), totalSize.c_str(), speedSize.c_str(), eta.c_str(),
+			workPageSize.c_str(), allPageSize.c_str() );
+	size_t curOutputLength = strlen(outputBuffer);
+	fprintf(console, "\r%s", outputBuffer);
+	int lenOffset = lastOutputLength-curOutputLength;
+	if (lenOffset > 0) {
+		for (int i=0; i<lenOffset; i++)
+			outputBuffer[i] = ' ';
+		outputBuffer[lenOffset] = 0;
+		fprintf(console, "%s", outputBuffer);
+	}
+	fflush(console);
+	return curOutputLength;
+}
+
 // Instances
 JobFile *globalJobFile = NULL;
 WebCtl *globalWebCtl = NULL;
+MetricsWriter *globalMetricsWriter = NULL;
+ProxyHistory *globalHistory = NULL;
+#ifndef WIN32
+Daemon *globalDaemon = NULL;
+#endif
 time_t beginTime = time(NULL);
 
+// write the trace, if tracing
+void dumpTrace() {
+	if (arguments.tracePath.empty()) return;
+	try {
+		Tracer::global().dump(arguments.tracePath);
+	} catch (const Exception &ex) {
+		string errmsg = ex.message();
+		fprintf(console, "Cannot write trace. %s\n", errmsg.c_str());
+	}
+}
+
 // Exit signal handling
 #include <signal.h>
-void signal_callback_handler(int signum) {
-	printf("\n");
+volatile sig_atomic_t traceRequested = 0, clientInterrupted = 0, terminateRequested = 0;
+void trace_signal_handler(int signum) {
+	// the main loop writes the file, nothing else is safe here
+	traceRequested = 1;
+}
+
+// save what the download got and leave; from the main loop, it joins the workers
+void terminateDownload() {
+	fprintf(console, "\n");
 	if (globalWebCtl) {
 		if (globalWebCtl->activeWorker() > 0)
 			globalWebCtl->terminate();
@@ -197,21 +357,156 @@ void signal_callback_handler(int signum) {
 			globalJobFile->close();
 		}
 	}
+	if (globalHistory) globalHistory->save();
+	if (globalMetricsWriter) {
+		globalMetricsWriter->stop();
+	}
+	dumpTrace();
 	string duration = humanTime(time(NULL) - beginTime);
-	printf("Download terminated, %s elapsed.\n", duration.c_str());
+	fprintf(console, "Download terminated, %s elapsed.\n", duration.c_str());
 	exit(20);
 }
 
+void signal_callback_handler(int signum) {
+#ifndef WIN32
+	// the daemon winds down from its own loop, a client cancels its job
+	if (globalDaemon) {
+		globalDaemon->stop();
+		return;
+	}
+	if (!arguments.clientSocket.empty()) {
+		clientInterrupted = 1;
+		return;
+	}
+#endif
+	// workers may wait for a lock the main loop holds, so it stops them
+	if (globalWebCtl) {
+		terminateRequested = 1;
+		return;
+	}
+	terminateDownload();
+}
+
 void register_signals() {
 #ifndef WIN32
 	signal(SIGHUP, signal_callback_handler);
 	signal(SIGQUIT, signal_callback_handler);
 	signal(SIGKILL, signal_callback_handler);
+	signal(SIGUSR1, trace_signal_handler);
 #endif
 	signal(SIGINT, signal_callback_handler);
-	signal(SIGILL, signal_callback_handler);
-	signal(SIGABRT, signal_callback_handler);
+	signal(SIGTERM, signal_callback_handler);
+}
+
+// keep the proxies that work, and the direct connection if asked for
+bool checkProxies() {
+	if (arguments.proxies.size() == 0) arguments.direct = true;
+	fprintf(console, "Checking proxies ... ");
+	fprintf(console, "%llu proxies found.\n", (unsigned long long)WebCtl::checkProxies(arguments.proxies));
+	if (arguments.direct) arguments.proxies.push_back(string());
+	if (arguments.proxies.size() == 0) {
+		fprintf(console, "Direct connection is disabled, while no available proxy found.\n");
+		return false;
+	}
+	return true;
+}
+
+#ifndef WIN32
+int runDaemon(ChunkCache *chunkCache, ProxyHistory *history) {
+	// a client that goes away must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+	try {
+		Daemon daemon(arguments.daemonSocket, arguments.proxies, arguments.threadPerProxy, chunkCache,
+				history);
+		daemon.start();
+		MetricsWriter metricsWriter(MetricsRegistry::global(), arguments.metricsPath,
+				arguments.metricsJsonPath);
+		if (!arguments.metricsPath.empty() || !arguments.metricsJsonPath.empty()) {
+			metricsWriter.start();
+		}
+		fprintf(console, "Listening on %s ...\n", arguments.daemonSocket.c_str());
+		fflush(console);
+		globalDaemon = &daemon;
+		daemon.run();
+		fprintf(console, "Stopping, waiting for running jobs to be saved ...\n");
+		metricsWriter.stop();
+		globalDaemon = NULL;
+	} catch (const Exception &ex) {
+		globalDaemon = NULL;
+		string errmsg = ex.message();
+		fprintf(console, "Daemon failed. %s\n", errmsg.c_str());
+		return 16;
+	}
+	string duration = humanTime(time(NULL) - beginTime);
+	fprintf(console, "Daemon stopped, %s elapsed.\n", duration.c_str());
+	return 0;
+}
+
+int runClient() {
+	JobRequest request;
+	request.url = arguments.url;
+	request.cookies = arguments.cookies;
+	request.useRedirectedUrl = arguments.useRedirectedUrl;
+	request.profile = arguments.autoProfile? "auto": arguments.speedProfile.name;
+	request.rateLimit = arguments.rateLimit;
+	request.proxyRateLimit = arguments.proxyRateLimit;
+	request.prefixFirst = arguments.prefixFirst;
+	request.recover = arguments.recover;
+	request.durability = arguments.durability;
+	if (arguments.savePath == "-") {
+		fprintf(console, "The daemon cannot write to this console, give a path or a named pipe.\n");
+		return 3;
+	}
+	request.savePath = fs::absolute(arguments.savePath).string();
+
+	size_t id;
+	JobStatus status;
+	try {
+		DaemonClient client(arguments.clientSocket);
+		id = client.submit(request);
+		fprintf(console, "Submitted as job %llu.\n", (unsigned long long)id);
+
+		const int sleepMs = 250;
+		RateWindow doneRate(30.0);
+		size_t lastOutputLength = 0;
+		bool preparing = false;
+		while (true) {
+			if (clientInterrupted) {
+				clientInterrupted = 0;
+				client.cancel(id);
+			}
+			client.status(id, status);
+			if (status.state == JobStatus::PREPARING && !preparing) {
+				preparing = true;
+				fprintf(console, "Preparing for download ...\n");
+			} else if (status.state != JobStatus::PREPARING && status.fileSize) {
+				double rate = doneRate.sample(monotonicSeconds(), status.doneBytes);
+				lastOutputLength = showProgress(status.doneBytes, status.fileSize, status.speed, rate,
+						status.cacheBytes, status.cacheCapacity, lastOutputLength);
+			}
+			if (status.finished()) break;
+			boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
+		}
+	} catch (const Exception &ex) {
+		string errmsg = ex.message();
+		fprintf(console, "\nDaemon request failed. %s\n", errmsg.c_str());
+		return 16;
+	}
+	if (status.fileSize) fprintf(console, "\n");
+	string duration = humanTime(time(NULL) - beginTime);
+	switch (status.state) {
+	case JobStatus::DONE:
+		fprintf(console, "Download complete, %s elapsed.\n", duration.c_str());
+		return 0;
+	case JobStatus::CANCELLED:
+		fprintf(console, "Download terminated, %s elapsed.\n", duration.c_str());
+		return 20;
+	default:
+		fprintf(console, "Download failed. %s\n", status.message.c_str());
+		return 11;
+	}
 }
+#endif
 
 // Main Program
 int main(int argc, char **argv) {
@@ -223,125 +518,241 @@ int main(int argc, char **argv) {
 		usage();
 		return retCode;
 	}
+	bool stream = isStreamPath(arguments.savePath);
+	if (arguments.savePath == "-") console = stderr;
+#ifndef WIN32
+	// a reader that goes away fails the write instead of killing us
+	if (stream) signal(SIGPIPE, SIG_IGN);
+#endif
+
+#ifndef WIN32
+	if (!arguments.clientSocket.empty()) return runClient();
+#endif
+
+	boost::scoped_ptr<ChunkCache> chunkCache;
+	if (!arguments.chunkCacheDir.empty()) {
+		try {
+			chunkCache.reset(new ChunkCache(arguments.chunkCacheDir, arguments.chunkCacheSize));
+		} catch (const Exception &ex) {
+			string errmsg = ex.message();
+			fprintf(console, "Cannot open chunk cache. %s\n", errmsg.c_str());
+			return 17;
+		}
+	}
+
+	boost::scoped_ptr<ProxyHistory> history;
+	if (!arguments.historyPath.empty()) history.reset(new ProxyHistory(arguments.historyPath));
+
+#ifndef WIN32
+	if (!arguments.daemonSocket.empty()) {
+		if (!checkProxies()) return 10;
+		return runDaemon(chunkCache.get(), history.get());
+	}
+#endif
 
-	// check proxies
+	// check proxies while the first route already downloads, those fast before first
+	string host = ProxyHistory::hostOf(arguments.url);
+	if (history) history->rank(arguments.proxies, host);
 	if (arguments.proxies.size() == 0) arguments.direct = true;
-	printf("Checking proxies ... ");
-	printf("%llu proxies found.\n", (unsigned long long)WebCtl::checkProxies(arguments.proxies));
-	if (arguments.direct) arguments.proxies.push_back(string());
-	if (arguments.proxies.size() == 0) {
-		printf("Direct connection is disabled, while no available proxy found.\n");
+	size_t expectedRoutes = arguments.proxies.size() + (arguments.direct? 1: 0);
+	if (!arguments.proxies.empty())
+		fprintf(console, "Checking %llu proxies ...\n", (unsigned long long)arguments.proxies.size());
+	ProxyChecker checker(arguments.proxies);
+	list<string> routes;
+	string proxy;
+	if (arguments.direct)
+		routes.push_back(string());
+	else if (checker.next(proxy))
+		routes.push_back(proxy);
+	else {
+		fprintf(console, "Direct connection is disabled, while no available proxy found.\n");
 		return 10;
 	}
 
-	// getting target status
+	// getting target status, the probe fetches the first sheet
 	long long tmpSize = -1;
 	size_t fileSize;
-	printf("Preparing for download ...\n");
-	if (!WebCtl::checkDownload(arguments.url, arguments.cookies, arguments.proxies.front(),
-			tmpSize, arguments.url2)) {
-		printf("Target url cannot be reached.\n");
+	ProbeResult probe;
+	string probeBody, validator;
+	bool resuming = !stream && fs::exists(arguments.savePath);
+	size_t probeSize = arguments.autoProfile? PROBE_SIZE: resuming? 2: arguments.speedProfile.sheetSize;
+	fprintf(console, "Preparing for download ...\n");
+	if (!WebCtl::checkDownload(arguments.url, arguments.cookies, routes.front(),
+			tmpSize, arguments.url2, &probe, probeSize, resuming? NULL: &probeBody, &validator)) {
+		fprintf(console, "Target url cannot be reached.\n");
 		return 11;
 	}
 	if (tmpSize <= 0) {
-		printf("Cannot download target partially.\n");
+		fprintf(console, "Cannot download target partially.\n");
 		return 12;
 	}
 	fileSize = size_t(tmpSize);
 	string url = arguments.useRedirectedUrl? arguments.url: arguments.url2;
+	// plan for every route, most proxies pass their check
+	size_t connections = expectedRoutes * arguments.threadPerProxy;
+	// a capped connection is only as fast as its share of the cap
+	if (arguments.rateLimit) {
+		double share = double(arguments.rateLimit) / connections;
+		probe.bandwidth = probe.bandwidth > 0? min(probe.bandwidth, share): share;
+	}
+	if (arguments.proxyRateLimit) {
+		double share = double(arguments.proxyRateLimit) / arguments.threadPerProxy;
+		probe.bandwidth = probe.bandwidth > 0? min(probe.bandwidth, share): share;
+	}
+	if (arguments.autoProfile)
+		arguments.speedProfile = autoSpeedProfile(fileSize, connections, probe);
 
 	// open / create job file
 	JobFile jobfile;
 	try {
-		if (fs::exists(arguments.savePath)) {
+		if (stream) {
+			jobfile.createStream(url, arguments.cookies, arguments.savePath,
+					arguments.useRedirectedUrl, fileSize, arguments.speedProfile.sheetSize, connections);
+		} else if (fs::exists(arguments.savePath)) {
+			bool lost = false;
 			try {
 				jobfile.open(arguments.savePath);
 			} catch (const JobNotExists& ex) {
-				printf("Output path already exists.\n");
-				return 15;
+				if (!arguments.recover) {
+					fprintf(console, "Output path already exists.\n");
+					return 15;
+				}
+				lost = true;
+			} catch (const BadJobFile &ex) {
+				if (!arguments.recover) throw;
+				lost = true;
+			}
+			if (lost) {
+				size_t sheets = jobfile.recover(url, arguments.cookies, arguments.savePath,
+						arguments.useRedirectedUrl, fileSize, arguments.speedProfile.sheetSize, true, connections);
+				fprintf(console, "Recovered %llu sheets from the output path.\n", (unsigned long long)sheets);
+			} else if (shouldRegrid(jobfile.sheetSize(), arguments.speedProfile)) {
+				string from = humanSize(jobfile.sheetSize());
+				size_t sheets = jobfile.regrid(SheetMap::tapered(fileSize, arguments.speedProfile.sheetSize,
+						connections));
+				fprintf(console, "Changed sheets from %s to %s, %llu of them done.\n", from.c_str(),
+						humanSize(arguments.speedProfile.sheetSize).c_str(), (unsigned long long)sheets);
 			}
 		} else {
 			jobfile.create(url, arguments.cookies, arguments.savePath, arguments.useRedirectedUrl,
-					fileSize, arguments.speedProfile.sheetSize);
+					fileSize, arguments.speedProfile.sheetSize, connections);
 		}
 	} catch (const Exception &ex) {
 		string errmsg = ex.message();
-		printf("Cannot open job file. %s\n", errmsg.c_str());
+		fprintf(console, "Cannot open job file. %s\n", errmsg.c_str());
 		return 13;
 	}
 	globalJobFile = &jobfile;
+	if (arguments.autoProfile && jobfile.sheetSize() != arguments.speedProfile.sheetSize) {
+		// resumed job kept its sheet size
+		arguments.speedProfile = autoSpeedProfile(fileSize, connections, probe, jobfile.sheetSize());
+	}
 
 	// creating web controller
 	WebCtl *webctl = NULL;
 	try {
 		webctl = new WebCtl(jobfile, arguments.speedProfile, arguments.threadPerProxy);
+		webctl->fileBuffer().setDurability(parseDurability(arguments.durability));
+		// the probe already brought the first sheets
+		webctl->sheetCtl().seed(probeBody.data(), probeBody.size());
+		if (chunkCache) {
+			webctl->setChunkCache(chunkCache.get(), chunkCache->object(arguments.url2, validator, fileSize));
+			size_t sheets = webctl->loadChunks();
+			if (sheets) fprintf(console, "Took %llu sheets from the chunk cache.\n", (unsigned long long)sheets);
+		}
 	} catch (const Exception &ex) {
 		string errmsg = ex.message();
-		printf("Initializing thread engine failed. %s\n", errmsg.c_str());
+		fprintf(console, "Initializing thread engine failed. %s\n", errmsg.c_str());
 		if (webctl != NULL) delete webctl;
 		return 14;
 	}
-	webctl->addProxies(arguments.proxies);
+	webctl->addProxies(routes);
+	webctl->setHistory(history.get(), host);
+	webctl->setRateLimit(arguments.rateLimit);
+	webctl->setProxyRateLimit(arguments.proxyRateLimit);
+	if (arguments.prefixFirst) webctl->sheetCtl().setPolicy(SheetCtl::PREFIX);
 	webctl->reportLevel() = 9999; // disable webctl report
 	globalWebCtl = webctl;
+	globalHistory = history.get();
 
 	// emiting download
+	if (!arguments.tracePath.empty()) {
+		Tracer::global().enable();
+		Tracer::global().setThreadName("main");
+	}
 	webctl->perform();
 	size_t sheetCount = webctl->sheetCtl().sheetCount();
-	string totalSize = humanSize(fileSize);
 
-	int sleepMs = 2000;
-	//size_t lastDoneBytes = min(webctl->sheetCtl().doneSheet() * jobfile.sheetSize(), fileSize);
+	// metrics export
+	MetricsRegistry &registry = MetricsRegistry::global();
+	Gauge &doneGauge = registry.gauge("pwxget_sheets_done", "Sheets downloaded so far."),
+			&activeGauge = registry.gauge("pwxget_active_workers", "Workers still downloading."),
+			&contiguousGauge = registry.gauge("pwxget_contiguous_bytes",
+					"Bytes from the start of the file that are written out.");
+	registry.gauge("pwxget_sheets", "Sheets in the whole file.").set(sheetCount);
+	registry.gauge("pwxget_file_size_bytes", "Size of the target file.").set(fileSize);
+	MetricsWriter metricsWriter(registry, arguments.metricsPath, arguments.metricsJsonPath);
+	if (!arguments.metricsPath.empty() || !arguments.metricsJsonPath.empty()) {
+		metricsWriter.start();
+		globalMetricsWriter = &metricsWriter;
+	}
+
+	// progress only reads atomic counters, so it can refresh often
+	const int sleepMs = 100;
+	const double etaWindow = 30.0;
 	size_t pageAbstractSize = webctl->sheetCtl().cache().pageSize() * jobfile.sheetSize();
-	boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
-	char outputBuffer[1024] = {0};
-	size_t lastOutputLength = 0, curOutputLength = 0;
+	RateWindow doneRate(etaWindow);
+	// give the workers a moment to start
+	for (int i=0; i<20 && webctl->activeWorker() == 0; i++) {
+		boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
+	}
+	size_t lastOutputLength = 0;
 
 	while (true) {
+		// proxies verified meanwhile join in
+		while (checker.next(proxy, 0)) webctl->addProxy(proxy);
 		// generate vars
 		size_t doneSheet = webctl->sheetCtl().doneSheet();
-		size_t doneBytes = min(doneSheet * jobfile.sheetSize(), fileSize);
-		string percent = boost::lexical_cast<string>(doneSheet * 100 / sheetCount),
-				doneSize = humanSize(doneBytes);
-		//string speed = humanSize((doneBytes - lastDoneBytes) * 1000.0 / sleepMs);
-		string speed = humanSize(webctl->getSpeed());
-		string workPageSize = humanSize(webctl->sheetCtl().workPageCount() * pageAbstractSize),
-				allPageSize = humanSize(webctl->sheetCtl().pageCount() * pageAbstractSize);
-		//lastDoneBytes = doneBytes;
-		// clear last line
-		// make current line
-		sprintf(outputBuffer, "Progress: %s%%, %s/%s. Speed: %s/s. Cache: %s/%s.", percent.c_str(),
-				doneSize.c_str(), totalSize.c_str(), speed.c_str(), workPageSize.c_str(),
-				allPageSize.c_str() );
-		curOutputLength = strlen(outputBuffer);
-		printf("\r%s", outputBuffer);
-		int lenOffset = lastOutputLength-curOutputLength;
-		if (lenOffset > 0) {
-			for (int i=0; i<lenOffset; i++)
-				outputBuffer[i] = ' ';
-			outputBuffer[lenOffset] = 0;
-			printf("%s", outputBuffer);
-		}
-		fflush(stdout);
-		lastOutputLength = curOutputLength;
+		size_t doneBytes = webctl->sheetCtl().doneBytes();
+		doneGauge.set(doneSheet);
+		activeGauge.set(webctl->activeWorker());
+		contiguousGauge.set(webctl->sheetCtl().contiguousBytes());
+		// ETA from the rate sheets get done at, which ignores discarded transfers
+		double rate = doneRate.sample(monotonicSeconds(), doneBytes);
+		lastOutputLength = showProgress(doneBytes, fileSize, webctl->getSpeed(), rate,
+				webctl->sheetCtl().workPageCount() * pageAbstractSize,
+				webctl->sheetCtl().pageCount() * pageAbstractSize, lastOutputLength);
 		// wait and sleep
-		if (webctl->activeWorker() == 0) break;
-		for (int i=0; i<sleepMs/200; i++) {
-			boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+		// idle workers wait for proxies still being checked
+		if (webctl->activeWorker() == 0 && (checker.done() || webctl->sheetCtl().allDone())) break;
+		boost::this_thread::sleep(boost::posix_time::milliseconds(sleepMs));
+		if (traceRequested) {
+			traceRequested = 0;
+			dumpTrace();
 		}
+		if (terminateRequested) terminateDownload();
 	}
-	printf("\n");
+	fprintf(console, "\n");
 	string duration = humanTime(time(NULL) - beginTime);
 
 	// remove progress file
 	webctl->flush();
 	webctl->fileBuffer().close();
 	jobfile.close();
+	doneGauge.set(webctl->sheetCtl().doneSheet());
+	activeGauge.set(0);
+	contiguousGauge.set(webctl->sheetCtl().contiguousBytes());
+	globalMetricsWriter = NULL;
+	metricsWriter.stop();
+	dumpTrace();
+	// every worker has recorded how its proxy did
+	globalHistory = NULL;
+	if (history) history->save();
 	if (webctl->sheetCtl().allDone()) {
-		fs::remove(jobfile.jobPath());
-		printf("Download complete, %s elapsed.\n", duration.c_str());
+		if (!jobfile.jobPath().empty()) fs::remove(jobfile.jobPath());
+		fprintf(console, "Download complete, %s elapsed.\n", duration.c_str());
 	} else {
-		printf("Download unfinished, %s elapsed.\n", duration.c_str());
+		fprintf(console, "Download unfinished, %s elapsed.\n", duration.c_str());
 	}
 
 	return 0;
@@ -7,29 +7,121 @@
 
 #include "sheetctl.h"
 #include "exceptions.h"
+#include <algorithm>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 namespace PwxGet {
+    /* PageArena */
+    PageArena::PageArena(size_t slotSize, size_t slotCount) : _region(NULL), _base(NULL),
+            _slotSize(slotSize), _slotCount(slotCount), _regionSize(0), _hugePages(false),
+            _free() {
+        size_t total = _slotSize * _slotCount;
+#ifndef WIN32
+        // Over-reserve so the base can be aligned to a hugepage boundary.
+        // Anonymous mappings are only touched on first write, so slots
+        // that are never used cost address space but no memory.
+        _regionSize = total + ARENA_HUGE_PAGE;
+        void *region = mmap(NULL, _regionSize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) throw OutOfMemoryError();
+        _region = (char*)region;
+        size_t misalign = (size_t)_region % ARENA_HUGE_PAGE;
+        _base = misalign? _region + (ARENA_HUGE_PAGE - misalign): _region;
+#ifdef MADV_HUGEPAGE
+        _hugePages = (madvise(_base, total, MADV_HUGEPAGE) == 0);
+#endif
+#else
+        _regionSize = total;
+        _region = _base = new char[total];
+        if (!_region) throw OutOfMemoryError();
+#endif
+        // hand out low addresses first
+        _free.reserve(_slotCount);
+        for (size_t i=_slotCount; i>0; i--) {
+            _free.push_back(_base + (i-1) * _slotSize);
+        }
+    }
+
+    PageArena::~PageArena() throw() {
+        if (_region) {
+#ifndef WIN32
+            munmap(_region, _regionSize);
+#else
+            delete [] _region;
+#endif
+        }
+        _region = _base = NULL;
+        _free.clear();
+    }
+
+    char *PageArena::acquire() {
+        if (_free.empty()) throw OutOfMemoryError("Page arena exhausted.");
+        char *slot = _free.back();
+        _free.pop_back();
+        return slot;
+    }
+
+    void PageArena::release(char *slot) throw() {
+        if (slot) _free.push_back(slot);
+    }
+
     /* PagedMemoryCache */
-	PagedMemoryCache::SheetPage::SheetPage(size_t startSheet, size_t sheetSize, size_t pageSize, size_t done) :
-                            startSheet(startSheet), sheetSize(sheetSize),
-                            pageSize(pageSize), done(done), usedSheets(new byte[pageSize]),
-                            buffer(pageSize * sheetSize) {
+	PagedMemoryCache::SheetPage::SheetPage(char *buffer, size_t startSheet, const SheetMap &sheets,
+							size_t pageSize, size_t done) :
+                            sheets(sheets), startSheet(startSheet),
+                            pageSize(pageSize), done(done), written(0), usedSheets(new byte[pageSize]),
+                            keptBytes(new size_t[pageSize]), buffer(buffer) {
 		memset(usedSheets, 0, pageSize);
+		memset(keptBytes, 0, pageSize * sizeof(size_t));
 	}
 	PagedMemoryCache::SheetPage::~SheetPage() {
 		delete [] usedSheets;
+		delete [] keptBytes;
 	}
 
 	void PagedMemoryCache::SheetPage::clear() {
+		// Stale bytes in the buffer are never read: write-back only
+		// touches sheets marked in usedSheets.
 		done = 0;
-		memset(buffer.data(), 0, buffer.capacity());
+		written = 0;
 		memset(usedSheets, 0, pageSize);
+		memset(keptBytes, 0, pageSize * sizeof(size_t));
 	}
 
     PagedMemoryCache::PagedMemoryCache(FileBuffer &fileBuffer, size_t pageSize, 
-            size_t pageCount) : _fb(fileBuffer), _sheetSize(fileBuffer.sheetSize()), 
-            _pageSize(pageSize), _pageCount(pageCount), _createdPage(0),
-            _empty(), _works() {
+            size_t pageCount, size_t maxPageCount) : _fb(fileBuffer), _sheetSize(fileBuffer.sheetSize()), 
+            _pageSize(pageSize), _pageCount(pageCount), _createdPage(0), _partialEvictions(0),
+            _cachedSheets(0), _cachedBytes(0), _head(0), _ordered(fileBuffer.stream()), _drainPrefix(_ordered), _arena(fileBuffer.sheetSize() * pageSize, max(pageCount, maxPageCount)),
+            _pageMap((fileBuffer.sheetCount() + pageSize - 1) / pageSize, (SheetPage*)NULL), _empty(), _spare(), _works(),
+            _flights(_pageMap.size(), 0), _flyingPages(0), _flyingOut(0),
+            _commits(MetricsRegistry::global().counter("pwxget_cache_commits_total",
+            		"Sheets committed into the page cache.")),
+            _hits(MetricsRegistry::global().counter("pwxget_cache_hits_total",
+            		"Commits that found their page already resident.")),
+            _evictionCounter(MetricsRegistry::global().counter("pwxget_cache_partial_evictions_total",
+            		"Pages written back before they were complete to make room.")),
+            _fullWrites(MetricsRegistry::global().counter("pwxget_cache_writebacks_total",
+            		"Pages written back, by completeness.", metricLabels("page", "full"))),
+            _partialWrites(MetricsRegistry::global().counter("pwxget_cache_writebacks_total",
+            		"Pages written back, by completeness.", metricLabels("page", "partial"))),
+            _fileWrites(MetricsRegistry::global().counter("pwxget_cache_writeback_writes_total",
+            		"File writes of write-backs, one per run of contiguous sheets.")),
+            _writeBackTime(MetricsRegistry::global().histogram("pwxget_cache_writeback_seconds",
+            		"Time to write one page back to the file.")) {
+        _works.reserve(_arena.slotCount());
+        _empty.reserve(_arena.slotCount());
+        _spare.reserve(_arena.slotCount());
+        // a page for every slot now, so growing the page count later allocates nothing
+        for (size_t i=0; i<_arena.slotCount(); i++)
+            _spare.push_back(new SheetPage(_arena.acquire(), 0, _fb.sheetMap(), _pageSize, 0));
+        advanceHead();
+    }
+
+    void PagedMemoryCache::setPageCount(size_t pageCount) throw() {
+        _pageCount = max((size_t)1, min(pageCount, _arena.slotCount()));
     }
     
     PagedMemoryCache::~PagedMemoryCache() throw() {
@@ -37,63 +129,94 @@ namespace PwxGet {
         flush();
         
         while (!_empty.empty()) {
-            delete _empty.top();
-            _empty.pop();
+            _arena.release(_empty.back()->buffer);
+            delete _empty.back();
+            _empty.pop_back();
+        }
+        while (!_spare.empty()) {
+            _arena.release(_spare.back()->buffer);
+            delete _spare.back();
+            _spare.pop_back();
         }
         _createdPage = 0;
     }
     
     void PagedMemoryCache::flush() {
+        if (_ordered) {
+            // out of order sheets have nowhere to go but the window
+            drain();
+            _fb.flush();
+            return;
+        }
     	// flush pages
         PageList::iterator it = _works.begin();
         while (it != _works.end()) {
-            beforeClosePage(*it);
-            _empty.push(*it);
+            unmap(beforeClosePage(*it));
+            _empty.push_back(*it);
             it++;
         }
         _works.clear();
-        _pageMap.clear();
         // flush fileBuffer
         _fb.flush();
+        advanceHead(); // sheets may reach the file around the cache
     }
     
     // TODO: add a lot of exception process!!!
     PagedMemoryCache::SheetPage *PagedMemoryCache::openPage(size_t pageIndex) {
-        PageMap::iterator it = (_pageMap.find(pageIndex));
-        SheetPage *page = NULL;
+        SheetPage *page = _pageMap[pageIndex];
         
-        if (it != _pageMap.end()) return it->second;
+        if (page) return page;
         if (!_empty.empty()) {
-            page = _empty.top();
-            _empty.pop();
+            page = _empty.back();
+            _empty.pop_back();
             _works.push_back(page);
             _pageMap[pageIndex] = page;
-            page->startSheet = pageIndex * _pageSize;
+            place(page, pageIndex);
             return page;
         }
         if (_createdPage < _pageCount) {
-            page = new SheetPage(pageIndex*_pageSize, _sheetSize, _pageSize, 0);
+            page = _spare.back();
+            _spare.pop_back();
+            place(page, pageIndex);
             _pageMap[pageIndex] = page;
             _works.push_back(page);
             ++_createdPage;
             return page;
         }
         
-        page = _works.front(); _works.remove(page);
-        _pageMap.erase(_pageMap.find(beforeClosePage(page)));
+        if (_ordered) throw OutOfMemoryError("Reorder window is full.");
+        page = _works.front(); _works.erase(_works.begin());
+        ++_partialEvictions;
+        _evictionCounter.inc();
+        unmap(beforeClosePage(page));
         _pageMap[pageIndex] = page;
         _works.push_back(page);
-        page->startSheet = pageIndex * _pageSize;
+        place(page, pageIndex);
         return page;
     }
+
+    void PagedMemoryCache::place(SheetPage *page, size_t pageIndex) throw() {
+        page->startSheet = pageIndex * _pageSize;
+        if (_flights[pageIndex]) --_flyingOut;
+        // a resumed job or an earlier write-back left these on disk
+        const byte *index = _fb.index();
+        size_t end = page->startSheet + pageSheets(page);
+        page->written = 0;
+        for (size_t s=page->startSheet; s<end; s++) if (index[s]) ++page->written;
+    }
     
     size_t PagedMemoryCache::beforeClosePage(SheetPage *page) {
+        double began = monotonicSeconds();
         do {
-            if (page->done == page->pageSize) {
-                _fb.write((byte*)page->data(), page->startSheet, page->pageSize);
-                _fb.flush();
+            if (page->done == pageSheets(page)) {
+                _fb.write((byte*)page->data(), page->startSheet, page->done);
+                _fileWrites.inc();
+                _cachedBytes -= _fb.sheetMap().bytes(page->startSheet, page->done);
+                _fullWrites.inc();
                 break;
             }
+            if (complete(page)) _fullWrites.inc();
+            else if (page->done) _partialWrites.inc();
             size_t i = 0, j;
             while (i < page->pageSize) {
                 while (i < page->pageSize && !page->usedSheets[i]) ++i;
@@ -101,46 +224,180 @@ namespace PwxGet {
                 while (j < page->pageSize && page->usedSheets[j]) ++j;
                 if (i < page->pageSize) {
                     _fb.write((byte*)page->getSheet(i), page->startSheet+i, j-i);
-                    _fb.flush();
+                    _fileWrites.inc();
+                    _cachedBytes -= _fb.sheetMap().bytes(page->startSheet+i, j-i);
                     i = j;
                 }
             }
         } while (false);
+        // the index follows as often as the durability asks
+        _fb.checkpoint();
         size_t pageIndex = page->startSheet / _pageSize;
+        double ended = monotonicSeconds();
+        Tracer::global().record("writeback", began, ended, page->startSheet, page->done);
+        _cachedSheets -= page->done;
         page->clear();
+        advanceHead();
+        _writeBackTime.observe(ended - began);
         return pageIndex;
     }
     
-    size_t PagedMemoryCache::cachedSheetCount() throw() {
-    	size_t ret = 0;
-    	for (PageList::const_iterator it=_works.begin(); it!=_works.end(); it++) {
-    		ret += (*it)->done;
-    	}
-    	return ret;
+    size_t PagedMemoryCache::windowEnd() const throw() {
+        if (!_ordered) return NOSHEET;
+        // pages below the head are closed, so this many fit from there
+        size_t pages = max(_pageCount, _createdPage);
+        return (_head / _pageSize + pages) * _pageSize;
     }
 
-    void PagedMemoryCache::commit(size_t sheet, const char *data) {
+    void PagedMemoryCache::setDrainPrefix(bool drainPrefix) {
+        _drainPrefix = drainPrefix || _ordered;
+        if (_drainPrefix) drain();
+    }
+
+    bool PagedMemoryCache::contains(size_t sheet) const throw() {
+        size_t pageIndex = sheet / _pageSize;
+        if (pageIndex >= _pageMap.size()) return false;
+        const SheetPage *page = _pageMap[pageIndex];
+        return page && page->usedSheets[sheet - page->startSheet];
+    }
+
+    bool PagedMemoryCache::resident(size_t sheet) const throw() {
+        size_t pageIndex = sheet / _pageSize;
+        return pageIndex < _pageMap.size() && _pageMap[pageIndex];
+    }
+
+    void PagedMemoryCache::unmap(size_t pageIndex) throw() {
+        _pageMap[pageIndex] = NULL;
+        if (_flights[pageIndex]) ++_flyingOut;
+    }
+
+    void PagedMemoryCache::fly(size_t sheet) throw() {
+        size_t pageIndex = sheet / _pageSize;
+        if (_flights[pageIndex]++) return;
+        ++_flyingPages;
+        if (!_pageMap[pageIndex]) ++_flyingOut;
+    }
+
+    void PagedMemoryCache::land(size_t sheet) throw() {
+        size_t pageIndex = sheet / _pageSize;
+        // never below zero, whatever a worker gives back twice
+        if (!_flights[pageIndex] || --_flights[pageIndex]) return;
+        --_flyingPages;
+        if (!_pageMap[pageIndex]) --_flyingOut;
+    }
+
+    void PagedMemoryCache::advanceHead() throw() {
+        const byte *index = _fb.index();
+        size_t sheetCount = _fb.sheetCount();
+        while (_head < sheetCount && index[_head]) ++_head;
+    }
+
+    void PagedMemoryCache::closePage(SheetPage *page) {
+        unmap(page->startSheet / _pageSize);
+        _works.erase(find(_works.begin(), _works.end(), page));
+        _empty.push_back(page);
+    }
+
+    void PagedMemoryCache::drain() {
+        size_t sheetCount = _fb.sheetCount();
+        advanceHead();
+        while (_head < sheetCount) {
+            SheetPage *page = _pageMap[_head / _pageSize];
+            if (!page) break;
+            size_t i = _head - page->startSheet, j = i;
+            size_t end = min(page->pageSize, sheetCount - page->startSheet);
+            while (j < end && page->usedSheets[j]) ++j;
+            if (j == i) break;
+            double began = monotonicSeconds();
+            _fb.write((byte*)page->getSheet(i), _head, j-i);
+            _fileWrites.inc();
+            Tracer::global().record("writeback", began, monotonicSeconds(), _head, j-i);
+            // the written sheets leave the page, later write-backs skip them
+            memset(page->usedSheets + i, 0, j-i);
+            page->done -= j-i;
+            _cachedSheets -= j-i;
+            _cachedBytes -= _fb.sheetMap().bytes(_head, j-i);
+            advanceHead();
+            if (page->done == 0 && _head >= page->startSheet + end) {
+                // every sheet of the page is out
+                _fullWrites.inc();
+                page->clear();
+                closePage(page);
+            } else if (_head < page->startSheet + end) {
+                break;
+            }
+        }
+    }
+
+    size_t PagedMemoryCache::kept(size_t sheet) const throw() {
+        size_t pageIndex = sheet / _pageSize;
+        if (sheet < _head || pageIndex >= _pageMap.size()) return 0;
+        const SheetPage *page = _pageMap[pageIndex];
+        return page? page->keptBytes[sheet - page->startSheet]: 0;
+    }
+
+    bool PagedMemoryCache::keep(size_t sheet, const char *data, size_t from, size_t to) {
+        if (sheet < _head || from >= to || to > _fb.sheetMap().length(sheet) || kept(sheet) < from ||
+                contains(sheet) || sheet >= windowEnd()) return false;
+        SheetPage *page = openPage(sheet / _pageSize);
+        size_t i = sheet - page->startSheet;
+        memcpy(page->getSheet(i) + from, data + from, to - from);
+        page->keptBytes[i] = max(page->keptBytes[i], to);
+        return true;
+    }
+
+    void PagedMemoryCache::commit(size_t sheet, const char *data, size_t skip) {
+        _commits.inc();
+        // already written out, a late duplicate
+        if (sheet < _head) return;
+        if (_pageMap[sheet / _pageSize]) _hits.inc();
         SheetPage *page = openPage(sheet / _pageSize);
         size_t i = sheet - page->startSheet;
         
-        memcpy(page->getSheet(i), data, _sheetSize);
+        size_t length = _fb.sheetMap().length(sheet);
+        memcpy(page->getSheet(i) + skip, data + skip, length - skip);
+        page->keptBytes[i] = 0;
         if (!page->usedSheets[i]){
             ++page->done;
+            ++_cachedSheets;
+            _cachedBytes += length;
             page->usedSheets[i] = 1;
         }
         
-        if (page->done == _pageSize) {
-            _pageMap.erase(_pageMap.find(beforeClosePage(page)));
-            _works.remove(page);
-            _empty.push(page);
+        if (_drainPrefix && sheet == _head) {
+            drain();
+        } else if (!_ordered && complete(page)) {
+            beforeClosePage(page);
+            closePage(page);
         }
     }
 
     /* Controller */
     SheetCtl::SheetCtl(FileBuffer &fileBuffer, size_t pageSize, size_t pageCount,
-    		size_t scanCount) : _mutex(), _fb(fileBuffer), _sheetIndex(_fb.index()),
-    		_cache(_fb, pageSize, pageCount), _sheetCount(_fb.sheetCount()),
-    		_scanCount(scanCount), _nextscan(0), _works(), _rollbacks() {
+    		size_t scanCount, size_t maxPageCount) : _mutex(), _fb(fileBuffer), _sheetIndex(_fb.index()),
+    		_cache(_fb, pageSize, pageCount, maxPageCount), _sheetCount(_fb.sheetCount()),
+    		_scanCount(scanCount), _nextscan(0), _runBegin(0), _runEnd(0), _rollbacks(),
+    		_headMoved(), _cancelled(false), _fetchWait(MetricsRegistry::global().histogram("pwxget_sheetctl_lock_wait_seconds",
+    				"Time spent waiting for the scheduler lock.", metricLabels("op", "fetch"))),
+    		_commitWait(MetricsRegistry::global().histogram("pwxget_sheetctl_lock_wait_seconds",
+    				"Time spent waiting for the scheduler lock.", metricLabels("op", "commit"))),
+    		_duplicates(MetricsRegistry::global().counter("pwxget_duplicate_sheets_total",
+    				"Sheets requested again while still in flight at the head.")),
+    		_salvaged(MetricsRegistry::global().counter("pwxget_salvaged_bytes_total",
+    				"Bytes of broken requests kept for the retry of their sheet.")),
+    		_split(MetricsRegistry::global().counter("pwxget_split_sheets_total",
+    				"Sheets taken over from a transfer in flight.")),
+    		_claims(MetricsRegistry::global().counter("pwxget_page_claims_total",
+    				"Runs of pages claimed by a worker.")),
+    		_steals(MetricsRegistry::global().counter("pwxget_claim_steals_total",
+    				"Sheets taken over from another worker's claim.")),
+    		_throttled(MetricsRegistry::global().counter("pwxget_sheetctl_throttled_fetches_total",
+    				"Fetches held back while the cache had no room for another page.")),
+    		_throttleWait(MetricsRegistry::global().histogram("pwxget_sheetctl_throttle_seconds",
+    				"Time a fetch was held back for room in the cache.")), _transfers(),
+    		_pageAffinity(true), _claimed(0), _policy(SCAN), _inflight(), _flowControl(true), _heldBack(false),
+    		_doneSheets(0), _doneBytes(0), _workPages(0), _createdPages(0), _contiguous(0) {
+    	publish();
     }
 
     SheetCtl::~SheetCtl() throw() {
@@ -149,87 +406,459 @@ namespace PwxGet {
 
     bool SheetCtl::allDone() {
     	Mutex::scoped_lock mylock(_mutex);
-    	return (_rollbacks.empty() && _works.empty() && _nextscan >= _sheetCount);
+    	return exhausted();
     }
 
-    size_t SheetCtl::doneSheet() {
-    	Mutex::scoped_lock mylock(_mutex);
-    	return _fb.doneSheet() + _cache.cachedSheetCount();
+    bool SheetCtl::exhausted() const throw() {
+    	return _rollbacks.empty() && _runBegin == _runEnd && _nextscan >= _sheetCount && !_claimed;
     }
+
+    void SheetCtl::publish() throw() {
+    	_doneSheets.store(_fb.doneSheet() + _cache.cachedSheetCount(), boost::memory_order_relaxed);
+    	_doneBytes.store(_fb.doneBytes() + _cache.cachedBytes(), boost::memory_order_relaxed);
+    	_workPages.store(_cache.workPageCount(), boost::memory_order_relaxed);
+    	_createdPages.store(_cache.createdPageCount(), boost::memory_order_relaxed);
+    	_contiguous.store(_cache.head(), boost::memory_order_relaxed);
+    }
+
 	size_t SheetCtl::sheetCount() {
 		Mutex::scoped_lock mylock(_mutex);
 		return _fb.sheetCount();
 	}
-	size_t SheetCtl::workPageCount() {
+	size_t SheetCtl::unissuedSheet() {
+		Mutex::scoped_lock mylock(_mutex);
+		size_t ret = _rollbacks.size() + (_runEnd - _runBegin) + _claimed;
+		if (_nextscan < _sheetCount) {
+			// not exact: sheets already on disk beyond _nextscan are counted
+			ret += _sheetCount - _nextscan;
+		}
+		return ret;
+	}
+	size_t SheetCtl::partialEvictions() {
 		Mutex::scoped_lock mylock(_mutex);
-		return _cache.workPageCount();
+		return _cache.partialEvictions();
 	}
-	size_t SheetCtl::pageCount() {
+	void SheetCtl::setPageCount(size_t pageCount) {
 		Mutex::scoped_lock mylock(_mutex);
-		return _cache.createdPageCount();
+		_cache.setPageCount(pageCount);
 	}
 
     bool SheetCtl::fetch(size_t &sheet, size_t &token) {
+    	size_t count;
+    	return fetch(sheet, count, token, 1);
+    }
+
+    bool SheetCtl::fetch(size_t &sheet, size_t &count, size_t &token, size_t maxSpan) {
+    	double began = monotonicSeconds();
     	Mutex::scoped_lock mylock(_mutex);
-    	bool ret = false;
+    	double locked = monotonicSeconds();
+    	_fetchWait.observe(locked - began);
+    	Tracer::global().record("fetch.lock", began, locked);
+    	token = DUMMY_TOKEN;
+    	return wait(mylock, sheet, count, maxSpan);
+    }
 
-    	do {
-    		// select from rolled back sheets
-    		if (!_rollbacks.empty()) {
-    			sheet = _rollbacks.front();
-    			token = DUMMY_TOKEN;
-    			ret = true;
-    			_rollbacks.pop();
-    			break;
+    bool SheetCtl::wait(Mutex::scoped_lock &mylock, size_t &sheet, size_t &count, size_t maxSpan,
+    		Transfer *owner) {
+    	double held = 0.0; // since when next() holds this fetch back
+    	while (true) {
+    		// past the limit the fetch opens its page, evicting or not
+    		bool throttle = held == 0.0 || monotonicSeconds() - held < MAX_THROTTLE_MS / 1000.0;
+    		_heldBack = false;
+    		if (next(sheet, count, maxSpan, owner, throttle)) {
+    			if (held != 0.0) {
+    				double now = monotonicSeconds();
+    				_throttleWait.observe(now - held);
+    				Tracer::global().record("fetch.throttle", held, now, sheet, count);
+    			}
+    			return true;
     		}
-    		// select from scanned sheets
-    		if (!_works.empty()) {
-    			sheet = _works.front();
-    			token = DUMMY_TOKEN;
-    			ret = true;
-    			_works.pop();
-    			break;
+    		// nothing new to hand out: race a second copy of the lowest missing sheets
+    		if (_policy == PREFIX && duplicateHead(sheet, count, maxSpan)) return true;
+    		if (!_heldBack && split(sheet, count, maxSpan)) return true;
+    		if (_cancelled || exhausted()) return false;
+    		if (_heldBack) {
+    			// until a page is written back or a sheet in flight comes back
+    			if (held == 0.0) {
+    				held = monotonicSeconds();
+    				_throttled.inc();
+    			}
+    			size_t left = (size_t)max(0.0, MAX_THROTTLE_MS - (monotonicSeconds() - held) * 1000.0);
+    			_headMoved.timed_wait(mylock, boost::posix_time::milliseconds(left + 1));
+    			continue;
     		}
-    		// emit next scan
+    		// the reorder window is full until the lowest missing sheet arrives
+    		double waited = monotonicSeconds();
+    		_headMoved.wait(mylock);
+    		Tracer::global().record("fetch.window", waited, monotonicSeconds());
+    	}
+    }
+
+    bool SheetCtl::fetch(Runs &runs, size_t &token, size_t maxSpan, size_t maxRuns, Transfer *transfer) {
+    	Run run;
+    	runs.clear();
+    	maxSpan = max(maxSpan, (size_t)1);
+    	double began = monotonicSeconds();
+    	Mutex::scoped_lock mylock(_mutex);
+    	double locked = monotonicSeconds();
+    	_fetchWait.observe(locked - began);
+    	Tracer::global().record("fetch.lock", began, locked);
+    	token = DUMMY_TOKEN;
+    	// one lock for all, or an idle fetch could miss the transfer to split
+    	if (!wait(mylock, run.sheet, run.count, maxSpan, transfer)) return false;
+    	run.skip = _cache.kept(run.sheet);
+    	runs.push_back(run);
+    	size_t total = run.count;
+    	while (runs.size() < maxRuns && total < maxSpan && next(run.sheet, run.count, maxSpan - total, transfer)) {
+    		run.skip = _cache.kept(run.sheet);
+    		runs.push_back(run);
+    		total += run.count;
+    	}
+    	if (runs.size() > 1) {
+    		// rolled back sheets may come before scanned ones; join what touches
+    		sort(runs.begin(), runs.end());
+    		size_t last = 0;
+    		for (size_t i=1; i<runs.size(); i++) {
+    			// a joined sheet is fetched whole, its kept bytes are overwritten
+    			if (runs[last].sheet + runs[last].count == runs[i].sheet) runs[last].count += runs[i].count;
+    			else runs[++last] = runs[i];
+    		}
+    		runs.resize(last + 1);
+    	}
+    	// the tail of a single range can be cut off
+    	if (transfer && runs.size() == 1 && runs[0].count > 1) {
+    		transfer->sheet = runs[0].sheet;
+    		transfer->end = runs[0].sheet + runs[0].count;
+    		transfer->active = true;
+    	}
+    	return true;
+    }
+
+    bool SheetCtl::next(size_t &sheet, size_t &count, size_t maxSpan, Transfer *owner,
+    		bool throttle) {
+    	// sheets at or above the window have no room in an ordered cache
+    	size_t window = _cache.windowEnd();
+    	// emit next scan
+    	if (_runBegin == _runEnd) {
     		size_t start = _nextscan;
     		while (start < _sheetCount && _sheetIndex[start]) {
     			++start;
     		}
-    		if (start == _sheetCount) break;
-    		size_t end = _nextscan, limit = start+_scanCount;
-    		while (end < _sheetCount && end < limit && !_sheetIndex[start]) {
+    		_nextscan = start;
+    		size_t end = start, limit = min(start+max(_scanCount, maxSpan), window);
+    		while (end < _sheetCount && end < limit && !_sheetIndex[end]) {
     			++end;
     		}
-    		for (size_t i=start; i<end; i++) {
-    			_works.push(i);
+    		_runBegin = start;
+    		_runEnd = end;
+    		_nextscan = max(_nextscan, end);
+    	}
+    	size_t rolledBack = _rollbacks.empty()? PagedMemoryCache::NOSHEET: *_rollbacks.begin(),
+    			scanned = _runBegin == _runEnd? PagedMemoryCache::NOSHEET: _runBegin;
+    	// scan: rolled back sheets first; prefix: whichever is lower
+    	bool fromRollbacks = rolledBack < window &&
+    			(_policy == SCAN || rolledBack < scanned);
+    	// the window of an ordered cache does its own flow control
+    	bool control = _flowControl && throttle && _policy == SCAN && !_cache.ordered();
+    	if (fromRollbacks) {
+    		// the head and whatever directly follows it; under pressure the lowest with room
+    		IndexSet::iterator it = _rollbacks.begin();
+    		while (control && it != _rollbacks.end() && crowded(*it)) ++it;
+    		if (it != _rollbacks.end()) {
+    			sheet = *it;
+    			count = 0;
+    			while (it != _rollbacks.end() && count < maxSpan && *it == sheet + count && *it < window) {
+    				_rollbacks.erase(it++);
+    				++count;
+    			}
+    			issue(sheet, count);
+    			return true;
+    		}
+    		_heldBack = true;
+    	}
+    	if (owner && _pageAffinity && _policy == SCAN && !_cache.ordered()) {
+    		// the rest of the owner's claim, else a new one; under pressure only a stolen one
+    		if (owner->claimBegin == owner->claimEnd) {
+    			bool fromScan = !control || _runBegin == _runEnd || !crowded(_runBegin);
+    			if (!fromScan) _heldBack = true;
+    			if (!claim(*owner, maxSpan, fromScan)) return false;
     		}
-    		_nextscan = end;
-    		// select available works
-    		sheet = _works.front();
-    		token = DUMMY_TOKEN;
-    		ret = true;
-    		_works.pop();
-    		break;
-    	} while (false);
+    		sheet = owner->claimBegin;
+    		count = min(max(maxSpan, (size_t)1), owner->claimEnd - sheet);
+    		owner->claimBegin += count;
+    		_claimed -= count;
+    		issue(sheet, count);
+    		return true;
+    	}
+    	if (control && scanned < window && crowded(scanned)) {
+    		_heldBack = true;
+    		return false;
+    	}
+    	if (scanned < window) {
+    		sheet = scanned;
+    		count = min(min(max(maxSpan, (size_t)1), _runEnd - _runBegin), window - sheet);
+    		_runBegin += count;
+    		issue(sheet, count);
+    		return true;
+    	}
+    	return false;
+    }
+
+    void SheetCtl::issue(size_t sheet, size_t count) {
+    	for (size_t i=0; i<count; i++) _cache.fly(sheet + i);
+    	if (_policy != PREFIX) return;
+    	for (size_t i=0; i<count; i++) ++_inflight[sheet + i];
+    }
+
+    void SheetCtl::land(size_t sheet) throw() {
+    	_cache.land(sheet);
+    }
+
+    bool SheetCtl::crowded(size_t sheet) const throw() {
+    	if (_cache.resident(sheet) || _cache.flying(sheet)) return false;
+    	// with nothing in flight no page is going to fill; evicting is all that is left
+    	return _cache.busyPageCount() >= _cache.pageCount() && _cache.flyingPageCount();
+    }
+
+    bool SheetCtl::claim(Transfer &owner, size_t maxSpan, bool fromScan) {
+    	size_t pageSize = _cache.pageSize();
+    	if (fromScan && _runBegin != _runEnd) {
+    		// whole pages up to a span, or the rest of the page
+    		size_t begin = _runBegin, end = (begin + max(maxSpan, (size_t)1)) / pageSize * pageSize;
+    		if (end <= begin) end = (begin / pageSize + 1) * pageSize;
+    		end = min(end, _runEnd);
+    		owner.claimBegin = begin;
+    		owner.claimEnd = end;
+    		_runBegin = end;
+    		_claimed += end - begin;
+    		_claims.inc();
+    		return true;
+    	}
+    	Transfer *largest = NULL;
+    	size_t most = 0;
+    	for (size_t i=0; i<_transfers.size(); i++) {
+    		Transfer *t = _transfers[i];
+    		if (t != &owner && t->claimEnd - t->claimBegin > most) {
+    			largest = t;
+    			most = t->claimEnd - t->claimBegin;
+    		}
+    	}
+    	if (!most) return false;
+    	// the owner keeps the lower half, which it reaches first
+    	size_t cut = largest->claimBegin + most / 2;
+    	owner.claimBegin = cut;
+    	owner.claimEnd = largest->claimEnd;
+    	largest->claimEnd = cut;
+    	_steals.inc(owner.claimEnd - cut);
+    	return true;
+    }
+
+    bool SheetCtl::duplicateHead(size_t &sheet, size_t &count, size_t maxSpan) {
+    	size_t head = _cache.head();
+    	while (head < _sheetCount && _cache.contains(head)) ++head;
+    	if (head >= _sheetCount || !_inflight[head] || _inflight[head] >= MAX_COPIES) return false;
+    	sheet = head;
+    	count = 0;
+    	// the in-flight run starting at the head, skipping what already arrived
+    	while (count < maxSpan && sheet + count < _sheetCount && _inflight[sheet + count]
+    			&& _inflight[sheet + count] < MAX_COPIES) {
+    		++count;
+    	}
+    	issue(sheet, count);
+    	_duplicates.inc(count);
+    	return true;
+    }
+
+    bool SheetCtl::split(size_t &sheet, size_t &count, size_t maxSpan) {
+    	Transfer *longest = NULL;
+    	size_t most = 0;
+    	for (size_t i=0; i<_transfers.size(); i++) {
+    		Transfer *t = _transfers[i];
+    		if (!t->active) continue;
+    		// the sheet arriving now stays with its transfer
+    		size_t arrived = min(t->arrived(), t->end - t->sheet), left = t->end - t->sheet - arrived;
+    		if (left > most) {
+    			longest = t;
+    			most = left;
+    		}
+    	}
+    	if (most < 2) return false;
+    	count = min(most / 2, max(maxSpan, (size_t)1));
+    	sheet = longest->end - count;
+    	longest->end = sheet;
+    	longest->cut(sheet);
+    	_split.inc(count);
+    	return true;
+    }
+
+    void SheetCtl::attach(Transfer &transfer) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	transfer.active = false;
+    	transfer.claimBegin = transfer.claimEnd = 0;
+    	_transfers.push_back(&transfer);
+    }
+
+    void SheetCtl::detach(Transfer &transfer) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	_transfers.erase(remove(_transfers.begin(), _transfers.end(), &transfer), _transfers.end());
+    	unclaim(transfer);
+    	_headMoved.notify_all();
+    }
+
+    void SheetCtl::unclaim(Transfer &owner) {
+    	for (size_t s=owner.claimBegin; s<owner.claimEnd; s++) _rollbacks.insert(s);
+    	_claimed -= owner.claimEnd - owner.claimBegin;
+    	owner.claimBegin = owner.claimEnd = 0;
+    }
+
+    void SheetCtl::setPageAffinity(bool pageAffinity) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	_pageAffinity = pageAffinity;
+    	// claims are only handed out with affinity on
+    	if (!pageAffinity) for (size_t i=0; i<_transfers.size(); i++) unclaim(*_transfers[i]);
+    	_headMoved.notify_all();
+    }
+
+    void SheetCtl::setFlowControl(bool flowControl) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	_flowControl = flowControl;
+    	_headMoved.notify_all();
+    }
 
-    	return ret;
+    bool SheetCtl::settle(Transfer &transfer) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	if (!transfer.active) return false;
+    	transfer.active = false;
+    	return true;
     }
 
     void SheetCtl::commit(size_t sheet, size_t token, const char *data) {
+    	commit(sheet, 1, token, data);
+    }
+
+    void SheetCtl::commit(size_t sheet, size_t count, size_t token, const char *data, size_t skip) {
     	// temporarily ignore token
+    	TraceSpan span("commit", sheet, count);
+    	double began = monotonicSeconds();
     	Mutex::scoped_lock mylock(_mutex);
-    	_cache.commit(sheet, data);
+    	double locked = monotonicSeconds();
+    	_commitWait.observe(locked - began);
+    	Tracer::global().record("commit.lock", began, locked);
+    	const SheetMap &sheets = _fb.sheetMap();
+    	size_t head = _cache.head(), first = 0;
+    	if (skip && _cache.kept(sheet) < skip) {
+    		// written back before the rest arrived
+    		if (!_sheetIndex[sheet] && !_cache.contains(sheet)) rollback(sheet, 1, token);
+    		first = 1;
+    	}
+    	size_t works = _cache.workPageCount();
+    	for (size_t i=first; i<count; i++) {
+    		if (_policy == PREFIX) _inflight[sheet + i] = 0;
+    		land(sheet + i);
+    		_cache.commit(sheet + i, data + sheets.bytes(sheet, i), i? 0: skip);
+    	}
+    	publish();
+    	// a page written back makes room for a fetch held back
+    	if (_cache.head() != head || _cache.workPageCount() < works || !_cache.flyingPageCount())
+    		_headMoved.notify_all();
+    }
+
+    size_t SheetCtl::salvage(size_t sheet, size_t count, size_t token, const char *data, size_t skip,
+    		size_t received) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	const SheetMap &sheets = _fb.sheetMap();
+    	size_t whole = 0;
+    	while (whole < count && received >= sheets.bytes(sheet, whole + 1)) ++whole;
+    	if (whole) commit(sheet, whole, token, data, skip);
+    	if (whole == count) return whole;
+    	size_t done = sheets.bytes(sheet, whole), from = whole? 0: skip, to = received - done;
+    	if (to > from && _cache.keep(sheet + whole, data + done, from, to))
+    		_salvaged.inc(to - from);
+    	rollback(sheet + whole, count - whole, token);
+    	return whole;
     }
 
     void SheetCtl::rollback(size_t sheet, size_t token) {
+    	rollback(sheet, 1, token);
+    }
+
+    void SheetCtl::rollback(size_t sheet, size_t count, size_t /* token */) {
     	// temporarily ignore token
     	Mutex::scoped_lock mylock(_mutex);
-    	_rollbacks.push(sheet);
+    	for (size_t i=0; i<count; i++) {
+    		size_t s = sheet + i;
+    		land(s);
+    		if (_policy == PREFIX) {
+    			if (_inflight[s] && --_inflight[s] > 0) continue; // another copy is on its way
+    			// a duplicate lost the race
+    			if (_sheetIndex[s] || _cache.contains(s)) continue;
+    		}
+    		_rollbacks.insert(s);
+    	}
+    	_headMoved.notify_all();
+    }
+
+    void SheetCtl::setPolicy(Policy policy) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	_policy = policy;
+    	if (policy != SCAN) for (size_t i=0; i<_transfers.size(); i++) unclaim(*_transfers[i]);
+    	if (policy != PREFIX) CopyCounts().swap(_inflight);
+    	else if (_inflight.size() != _sheetCount) _inflight.assign(_sheetCount, 0);
+    	_cache.setDrainPrefix(policy == PREFIX);
+    	publish();
+    }
+
+    bool SheetCtl::waitContiguous(size_t bytes, size_t timeoutMs) {
+    	bytes = min(bytes, _fb.size());
+    	boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMs);
+    	Mutex::scoped_lock mylock(_mutex);
+    	while (contiguousBytes() < bytes) {
+    		if (_cancelled) return false;
+    		if (!_headMoved.timed_wait(mylock, deadline)) return contiguousBytes() >= bytes;
+    	}
+    	return true;
+    }
+
+    void SheetCtl::cancel() {
+    	Mutex::scoped_lock mylock(_mutex);
+    	_cancelled = true;
+    	_headMoved.notify_all();
+    }
+
+    size_t SheetCtl::seed(const char *data, size_t length) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	const SheetMap &sheets = _fb.sheetMap();
+    	size_t seeded = 0, sheet = 0;
+    	for (; sheet<_sheetCount; sheet++) {
+    		if (sheets.offset(sheet + 1) > length) break;
+    		if (_sheetIndex[sheet] || _cache.contains(sheet)) continue;
+    		_cache.commit(sheet, data + sheets.offset(sheet));
+    		++seeded;
+    	}
+    	// on disk, the scan will not hand them out again
+    	if (seeded) _cache.flush();
+    	// the fetch of a sheet only partly covered starts where the data ends
+    	size_t offset = sheet < _sheetCount? sheets.offset(sheet): length;
+    	if (length > offset && !_sheetIndex[sheet])
+    		_cache.keep(sheet, data + offset, 0, length - offset);
+    	publish();
+    	_headMoved.notify_all();
+    	return seeded;
+    }
+
+    bool SheetCtl::preload(size_t sheet, const char *data) {
+    	Mutex::scoped_lock mylock(_mutex);
+    	if (sheet >= _sheetCount || sheet >= _cache.windowEnd() ||
+    			_sheetIndex[sheet] || _cache.contains(sheet)) return false;
+    	_cache.commit(sheet, data);
+    	publish();
+    	return true;
     }
 
     void SheetCtl::flush() {
     	Mutex::scoped_lock mylock(_mutex);
     	_cache.flush();
+    	publish();
+    	_headMoved.notify_all();
     }
 }
-
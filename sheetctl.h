@@ -11,11 +11,14 @@
 #include <string>
 #include <queue>
 #include <list>
-#include <stack>
 #include <map>
+#include <set>
+#include <vector>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include "filebuffer.h"
 #include "webclient.h"
+#include "metrics.h"
 
 namespace PwxGet {
     using namespace std;
@@ -23,8 +26,46 @@ namespace PwxGet {
     const size_t DEFAULT_PAGE_SIZE = 64; // DEFAULT_SHEET_SIZE * DEFAULT_PAGE_SIZE == 4M
     const size_t DEFAULT_PAGE_COUNT = 16; // DEFAULT_PAGE_COUNT * DEFAULT_PAGE_SIZE == 64M
     const size_t DEFAULT_SCAN_COUNT = 128;
+    const size_t ARENA_HUGE_PAGE = 2 * 1024 * 1024;
     
-    // Data are written into device in mostly continous sheets, which I call them pages.
+    /**
+     * Preallocated region holding the buffers of all cache pages.
+     *
+     * Slots are handed out and taken back without being zeroed, the
+     * region is reserved once and backed by transparent hugepages where
+     * the system supports them.
+     */
+    class PageArena {
+    public:
+        PageArena(size_t slotSize, size_t slotCount);
+        virtual ~PageArena() throw();
+        char *acquire();
+        void release(char *slot) throw();
+
+        inline size_t slotSize() const throw() { return _slotSize; }
+        inline size_t slotCount() const throw() { return _slotCount; }
+        inline size_t freeCount() const throw() { return _free.size(); }
+        inline bool hugePages() const throw() { return _hugePages; }
+
+    protected:
+        char *_region, *_base;
+        size_t _slotSize, _slotCount, _regionSize;
+        bool _hugePages;
+        vector<char*> _free;
+
+    private:
+        PageArena(const PageArena &);
+        PageArena &operator=(const PageArena &);
+    };
+
+    /**
+     * Data are written into device in mostly continous sheets, which I call them pages.
+     *
+     * Over a stream FileBuffer the cache is a reorder window instead: sheets
+     * leave it strictly in order as soon as they join the contiguous prefix,
+     * and pages are never evicted early, so the scheduler must keep fetches
+     * below windowEnd().
+     */
     class PagedMemoryCache {
     public:
         /**
@@ -34,81 +75,276 @@ namespace PwxGet {
             * @param pageCount: Maximum page count)
             */
         PagedMemoryCache(FileBuffer &fileBuffer, size_t pageSize=DEFAULT_PAGE_SIZE, 
-                size_t pageCount=DEFAULT_PAGE_COUNT);
+                size_t pageCount=DEFAULT_PAGE_COUNT, size_t maxPageCount=0);
         virtual ~PagedMemoryCache() throw();
-        void commit(size_t sheet, const char *data);
+        /**
+         * @param skip: Leading bytes of the sheet missing from data, held
+         * 		by the cache already (see kept()).
+         */
+        void commit(size_t sheet, const char *data, size_t skip=0);
+        // Leading bytes held of a sheet not committed yet; lost when its page is written back.
+        size_t kept(size_t sheet) const throw();
+        /**
+         * Hold bytes from..to of a sheet until the rest arrives.
+         * @param data: The sheet, from its first byte.
+         * @return false if the bytes before from are not held, or there is no room.
+         */
+        bool keep(size_t sheet, const char *data, size_t from, size_t to);
         void flush();
 
         inline size_t pageSize() const throw() { return _pageSize; }
         inline size_t pageCount() const throw() { return _pageCount; }
+        inline size_t maxPageCount() const throw() { return _arena.slotCount(); }
+        /**
+         * Change the page limit, bounded by maxPageCount. Shrinking does not
+         * release pages already created.
+         */
+        void setPageCount(size_t pageCount) throw();
+        // Pages written back before they were complete to make room.
+        inline size_t partialEvictions() const throw() { return _partialEvictions; }
 
         inline size_t createdPageCount() const throw() { return _createdPage; }
         inline size_t emptyPageCount() const throw() { return _empty.size(); }
         inline size_t workPageCount() const throw() { return _works.size(); }
 
-        size_t cachedSheetCount() throw();
+        inline size_t cachedSheetCount() const throw() { return _cachedSheets; }
+        inline size_t cachedBytes() const throw() { return _cachedBytes; }
+
+        inline bool ordered() const throw() { return _ordered; }
+        // First sheet not written to the file yet; all below it are.
+        inline size_t head() const throw() { return _head; }
+        // Write the contiguous prefix out as soon as it grows (always on when ordered).
+        void setDrainPrefix(bool drainPrefix);
+        inline bool drainPrefix() const throw() { return _drainPrefix; }
+        bool contains(size_t sheet) const throw();
+        // Whether the page of sheet is open, so committing it evicts nothing.
+        bool resident(size_t sheet) const throw();
+        // A sheet handed out, and the same sheet back, committed or not.
+        void fly(size_t sheet) throw();
+        void land(size_t sheet) throw();
+        // Whether sheets of the page of sheet are on their way.
+        inline bool flying(size_t sheet) const throw() { return _flights[sheet / _pageSize] != 0; }
+        inline size_t flyingPageCount() const throw() { return _flyingPages; }
+        // Pages open, or to be opened by the sheets in flight.
+        inline size_t busyPageCount() const throw() { return _works.size() + _flyingOut; }
+        // First sheet the cache has no room for, NOSHEET when unbounded.
+        size_t windowEnd() const throw();
+        static const size_t NOSHEET = (size_t)-1;
 
     protected:
         // One Sheet Page
         class SheetPage {
         public:
-        	SheetPage(size_t startSheet, size_t sheetSize, size_t pageSize, size_t done);
+        	SheetPage(char *buffer, size_t startSheet, const SheetMap &sheets, size_t pageSize, size_t done);
             inline virtual ~SheetPage();
             inline char *getSheet(size_t index) {
-            	return buffer.data() + sheetSize * index;
+            	return buffer + sheets.bytes(startSheet, index);
             }
             inline void clear();
-            inline char *data() { return buffer.data(); }
-            size_t startSheet, sheetSize, pageSize, done;
+            inline char *data() { return buffer; }
+            const SheetMap &sheets;
+            size_t startSheet, pageSize, done;
+            size_t written; // sheets of the page in the file already when it was opened
             byte* usedSheets;
-        protected:
-            WebClient::DataBuffer buffer;
+            size_t* keptBytes; // of sheets not used yet
+            char* buffer; // slot owned by PageArena, never zeroed
         };
-        typedef map<size_t, SheetPage*> PageMap;
-        typedef stack<SheetPage*> PageStack;
-        typedef queue<SheetPage*> PageQueue;
-        typedef list<SheetPage*> PageList;
+        // Fixed or bounded containers: the commit path allocates nothing.
+        typedef vector<SheetPage*> PageMap; // by page index, NULL if not cached
+        typedef vector<SheetPage*> PageStack; // used from the back
+        typedef vector<SheetPage*> PageList; // oldest first
         
         FileBuffer &_fb;
         size_t _sheetSize, _pageSize, _pageCount;
-        size_t _createdPage;
+        size_t _createdPage, _partialEvictions;
+        size_t _cachedSheets, _cachedBytes; // held by working pages
+        size_t _head;
+        bool _ordered, _drainPrefix;
+        PageArena _arena;
         PageMap _pageMap; // Map page indexes to SheetPage instances.
         PageStack _empty; // empty pages
+        PageStack _spare; // pages not handed out yet, one per arena slot
         PageList _works; // working pages
+        vector<size_t> _flights; // by page index, sheets in flight
+        size_t _flyingPages, _flyingOut; // pages in flight, those of them not open
+
+        // metrics
+        Counter &_commits, &_hits, &_evictionCounter, &_fullWrites, &_partialWrites, &_fileWrites;
+        Histogram &_writeBackTime;
         
         SheetPage *openPage(size_t pageIndex);
+        void place(SheetPage *page, size_t pageIndex) throw();
+        void unmap(size_t pageIndex) throw();
+        // Sheets of the file in the page, fewer than pageSize in the last one.
+        inline size_t pageSheets(const SheetPage *page) const throw() {
+            return min(_pageSize, _fb.sheetCount() - page->startSheet);
+        }
+        // Every sheet of the page is cached or in the file.
+        inline bool complete(const SheetPage *page) const throw() {
+            return page->done + page->written >= pageSheets(page);
+        }
         size_t beforeClosePage(SheetPage *page); // return pageIndex
+        void closePage(SheetPage *page);
+        void drain(); // write out the contiguous prefix
+        void advanceHead() throw();
     };
     
     class SheetCtl {
     public:
         SheetCtl(FileBuffer &fileBuffer, size_t pageSize=DEFAULT_PAGE_SIZE,
-                size_t pageCount=DEFAULT_PAGE_COUNT, size_t scanCount=DEFAULT_SCAN_COUNT);
+                size_t pageCount=DEFAULT_PAGE_COUNT, size_t scanCount=DEFAULT_SCAN_COUNT,
+                size_t maxPageCount=0);
         virtual ~SheetCtl() throw();
         bool fetch(size_t &sheet, size_t &token);
+        /**
+         * Fetch a run of up to maxSpan contiguous sheets.
+         * @param sheet: First sheet of the run.
+         * @param count: Number of sheets in the run (>= 1).
+         */
+        bool fetch(size_t &sheet, size_t &count, size_t &token, size_t maxSpan);
+        // Contiguous sheets handed out together.
+        struct Run {
+            size_t sheet, count;
+            size_t skip; // bytes of the first sheet the cache holds already
+            inline bool operator<(const Run &other) const throw() { return sheet < other.sheet; }
+        };
+        typedef vector<Run> Runs;
+        /**
+         * A run on its way. Once nothing else is left to hand out, a fetch
+         * takes over the sheets it has not received yet, past the half.
+         *
+         * It also stands for the worker fetching it: with page affinity the
+         * worker claims the scan up to a page boundary and keeps fetching
+         * from its claim, so each page fills from one connection and is
+         * written back whole.
+         */
+        class Transfer {
+        public:
+            inline Transfer() : sheet(0), end(0), active(false), claimBegin(0), claimEnd(0) {}
+            inline virtual ~Transfer() {}
+            // Sheets from sheet on that arrived whole; called by other threads.
+            virtual size_t arrived() const throw() = 0;
+            // Stop the transfer at sheet end; called by other threads.
+            virtual void cut(size_t end) throw() = 0;
+            size_t sheet, end; // guarded by the scheduler lock
+            bool active;
+            size_t claimBegin, claimEnd; // claimed, not handed out yet; the same lock
+        };
+        // Let fetch() split the transfer; detach before it is destroyed, which gives back its claim.
+        void attach(Transfer &transfer);
+        void detach(Transfer &transfer);
+        /**
+         * Fetch up to maxRuns runs, maxSpan sheets in all, for one
+         * multi-range request; waits like fetch() for the first run only.
+         * @param runs: Lowest first and never adjacent; reserve maxRuns
+         * 		to keep it from allocating.
+         * @param transfer: Made splittable when a single run of several
+         * 		sheets is handed out; settle() it once the request is over.
+         */
+        bool fetch(Runs &runs, size_t &token, size_t maxSpan, size_t maxRuns, Transfer *transfer=NULL);
+        /**
+         * End a transfer fetch() made splittable.
+         * @return false if it was not; else its run ends at transfer.end,
+         * 		cut short or not.
+         */
+        bool settle(Transfer &transfer);
         /**
          * Write data into one sheet.
-         * Note: whether the sheet is complete or not, pls commit chunks exactly the size as sheetSize.
+         * Note: data holds the sheet's length in the sheet map, the short last one included.
          * 
          * @param sheet: Sheet index.
          * @param data: Data chunk.
          */
         void commit(size_t sheet, size_t token, const char *data);
+        /**
+         * Commit count contiguous sheets, data holds their bytes back to back.
+         * @param skip: Run::skip; if the cache lost those bytes meanwhile
+         * 		the first sheet is rolled back.
+         */
+        void commit(size_t sheet, size_t count, size_t token, const char *data, size_t skip=0);
+        /**
+         * Settle a run that broke off: commit the sheets that arrived whole,
+         * keep the bytes of the next one, roll back the rest.
+         * @param received: Bytes of data from its start that arrived, skip included.
+         * @return Sheets committed.
+         */
+        size_t salvage(size_t sheet, size_t count, size_t token, const char *data, size_t skip,
+                size_t received);
         void rollback(size_t sheet, size_t token);
+        void rollback(size_t sheet, size_t count, size_t token);
         void flush();
+        /**
+         * Store the file's first bytes, fetched before the scheduler ran
+         * (the probe request), and write them out.
+         * @return Sheets seeded; the bytes of a sheet the data only partly
+         * 		covers are kept for its fetch.
+         */
+        size_t seed(const char *data, size_t length);
+        /**
+         * Store one sheet fetched from elsewhere (the chunk cache), before
+         * the scheduler runs; flush() writes it out.
+         * @return false if the sheet is done already or beyond the window.
+         */
+        bool preload(size_t sheet, const char *data);
         bool allDone();
+        // Wake up and fail fetches waiting for the reorder window.
+        void cancel();
+
+        /**
+         * SCAN hands out sheets in scan order and retries rollbacks first.
+         * PREFIX always hands out the lowest missing sheet, writes the
+         * contiguous prefix out at once and, when nothing else is left,
+         * lets a second request race the one holding up the head.
+         */
+        enum Policy { SCAN, PREFIX };
+        void setPolicy(Policy policy);
+        inline Policy policy() const throw() { return _policy; }
+        /**
+         * Claim pages for the attached transfers fetch() is given (SCAN over
+         * a cache that is not ordered only); on by default. When the scan
+         * is used up, an idle worker takes the upper half of the largest claim.
+         */
+        void setPageAffinity(bool pageAffinity);
+        inline bool pageAffinity() const throw() { return _pageAffinity; }
+        /**
+         * Hold back a SCAN fetch whose sheets would open a page while the
+         * pages resident or on their way fill the cache, until a page is
+         * written back or MAX_THROTTLE_MS pass, so no page is evicted half
+         * empty; rolled back sheets of resident pages go first. On by default.
+         */
+        void setFlowControl(bool flowControl);
+        inline bool flowControl() const throw() { return _flowControl; }
+        static const size_t MAX_THROTTLE_MS = 1000;
+        static const size_t MAX_COPIES = 2;
+
+        // Bytes from the start of the file that are all written out.
+        inline size_t contiguousBytes() const throw() {
+            return _fb.sheetMap().offset(_contiguous.load(boost::memory_order_relaxed));
+        }
+        /**
+         * Block until contiguousBytes() reaches bytes.
+         * @return false on timeout or cancel.
+         */
+        bool waitContiguous(size_t bytes, size_t timeoutMs);
         
-        size_t doneSheet();
+        // Progress, readable without taking the scheduler lock.
+        inline size_t doneSheet() const throw() { return _doneSheets.load(boost::memory_order_relaxed); }
+        inline size_t doneBytes() const throw() { return _doneBytes.load(boost::memory_order_relaxed); }
+        inline size_t workPageCount() const throw() { return _workPages.load(boost::memory_order_relaxed); }
+        inline size_t pageCount() const throw() { return _createdPages.load(boost::memory_order_relaxed); }
         size_t sheetCount();
-        size_t workPageCount();
-        size_t pageCount();
+        // Sheets neither downloaded nor handed out yet.
+        size_t unissuedSheet();
+        size_t partialEvictions();
+        void setPageCount(size_t pageCount);
 
         inline PagedMemoryCache &cache() throw() { return _cache; }
         inline FileBuffer &fileBuffer() throw() { return _fb; }
         inline size_t scanCount() const throw() { return _scanCount; }
 
     protected:
-        typedef queue<size_t> IndexQueue;
+        typedef set<size_t> IndexSet;
+        typedef vector<byte> CopyCounts; // by sheet
         typedef boost::recursive_mutex Mutex;
         static const size_t DUMMY_TOKEN = 0x0;
 
@@ -120,8 +356,45 @@ namespace PwxGet {
         size_t _scanCount, _nextscan; 	// The next sheet to be scanned.
 
         // TODO: Use "token" to control timeout.
-        IndexQueue _works;	// Sheets to be processed.
-        IndexQueue _rollbacks; // Sheets rolled back.
+        size_t _runBegin, _runEnd; // Sheets of the last scan not handed out yet.
+        IndexSet _rollbacks; // Sheets rolled back, lowest first.
+
+        // fetches wait here while the window is full, readers for the prefix
+        boost::condition_variable_any _headMoved;
+        bool _cancelled;
+
+        Histogram &_fetchWait, &_commitWait;
+        Counter &_duplicates, &_salvaged, &_split, &_claims, &_steals, &_throttled;
+        Histogram &_throttleWait;
+        vector<Transfer*> _transfers; // attached, active or not
+        bool _pageAffinity;
+        size_t _claimed; // sheets claimed by transfers, not handed out yet
+
+        Policy _policy;
+        CopyCounts _inflight; // copies requested, PREFIX only
+
+        bool _flowControl, _heldBack; // next() held a fetch back
+
+        // copies of the cache state for lock-free readers
+        boost::atomic<size_t> _doneSheets, _doneBytes, _workPages, _createdPages, _contiguous;
+        void publish() throw(); // call with _mutex held
+        // Hand out a run, waiting while the window is full; false when all is done.
+        bool wait(Mutex::scoped_lock &mylock, size_t &sheet, size_t &count, size_t maxSpan,
+                Transfer *owner=NULL);
+        // Hand out the next run without waiting; false if none fits the window now.
+        bool next(size_t &sheet, size_t &count, size_t maxSpan, Transfer *owner=NULL,
+                bool throttle=true);
+        bool exhausted() const throw(); // nothing left to hand out
+        // Claim the scan up to a page boundary, or take half of the largest claim.
+        bool claim(Transfer &owner, size_t maxSpan, bool fromScan=true);
+        void unclaim(Transfer &owner); // give the claim back as rolled back sheets
+        void issue(size_t sheet, size_t count);
+        void land(size_t sheet) throw(); // a sheet handed out came back
+        // Whether handing out sheet now would have its page evict another.
+        bool crowded(size_t sheet) const throw();
+        bool duplicateHead(size_t &sheet, size_t &count, size_t maxSpan);
+        // Take the unreceived half of the longest transfer, if it has a sheet to spare.
+        bool split(size_t &sheet, size_t &count, size_t maxSpan);
     };
 }
 
@@ -0,0 +1,166 @@
+/*
+ * trace.cpp
+ *
+ *  Opt-in timeline of the sheet lifecycle, dumped in Chrome trace format.
+ */
+
+#include "trace.h"
+#include "filebuffer.h"
+#include <stdio.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace fs = boost::filesystem;
+
+namespace PwxGet {
+	/* TraceBuffer */
+	static size_t ceilPow2(size_t n) {
+		size_t ret = 1;
+		while (ret < n) ret <<= 1;
+		return ret;
+	}
+
+	TraceBuffer::TraceBuffer(size_t tid, size_t capacity) : name(), _tid(tid),
+			_mask(ceilPow2(max(capacity, (size_t)1)) - 1), _events(_mask + 1), _head(0) {
+	}
+
+	void TraceBuffer::push(const char *name, double begin, double end,
+			size_t sheet, size_t count) throw() {
+		unsigned long long head = _head.load(boost::memory_order_relaxed);
+		TraceEvent &ev = _events[head & _mask];
+		ev.name = name; ev.begin = begin; ev.end = end;
+		ev.sheet = sheet; ev.count = count;
+		_head.store(head + 1, boost::memory_order_release);
+	}
+
+	void TraceBuffer::snapshot(vector<TraceEvent> &events) const {
+		unsigned long long capacity = _events.size();
+		unsigned long long head = _head.load(boost::memory_order_acquire);
+		unsigned long long first = head > capacity? head - capacity: 0;
+		vector<TraceEvent> copy;
+		copy.reserve(head - first);
+		for (unsigned long long i=first; i<head; i++) copy.push_back(_events[i & _mask]);
+		// slots the owner reused while we were copying are not trustworthy
+		unsigned long long after = _head.load(boost::memory_order_acquire);
+		size_t skip = after > capacity && after - capacity > first? after - capacity - first: 0;
+		if (skip < copy.size()) events.insert(events.end(), copy.begin() + skip, copy.end());
+	}
+
+	/* Tracer */
+	static void keepBuffer(TraceBuffer *) {
+		// buffers outlive their threads, the tracer owns them
+	}
+
+	Tracer::Tracer() : _enabled(false), _mutex(), _buffers(), _local(keepBuffer),
+			_eventsPerThread(TRACE_BUFFER_EVENTS), _origin(monotonicSeconds()) {
+	}
+
+	Tracer::~Tracer() {
+		_enabled.store(false);
+		for (size_t i=0; i<_buffers.size(); i++) delete _buffers[i];
+		_buffers.clear();
+	}
+
+	Tracer &Tracer::global() {
+		static Tracer tracer;
+		return tracer;
+	}
+
+	void Tracer::enable(size_t eventsPerThread) {
+		boost::mutex::scoped_lock lock(_mutex);
+		_eventsPerThread = eventsPerThread;
+		_origin = monotonicSeconds();
+		_enabled.store(true);
+	}
+
+	TraceBuffer *Tracer::local() {
+		TraceBuffer *buffer = _local.get();
+		if (!buffer) {
+			boost::mutex::scoped_lock lock(_mutex);
+			buffer = new TraceBuffer(_buffers.size() + 1, _eventsPerThread);
+			_buffers.push_back(buffer);
+			_local.reset(buffer);
+		}
+		return buffer;
+	}
+
+	void Tracer::setThreadName(const string &name) {
+#ifdef __linux__
+		// for top -H and debuggers too, which take 15 characters; the main
+		// thread's name is the process name, leave it
+		if (syscall(SYS_gettid) != getpid())
+			pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+#endif
+		if (!enabled()) return;
+		TraceBuffer *buffer = local();
+		boost::mutex::scoped_lock lock(_mutex);
+		buffer->name = name;
+	}
+
+	void Tracer::record(const char *name, double begin, double end,
+			size_t sheet, size_t count) throw() {
+		if (!enabled()) return;
+		try {
+			local()->push(name, begin, end, sheet, count);
+		} catch (...) {
+			// out of memory for a new buffer: lose the event, not the download
+		}
+	}
+
+	static const string jsonString(const string &value) {
+		string ret = "\"";
+		for (size_t i=0; i<value.size(); i++) {
+			if (value[i] == '"' || value[i] == '\\') ret += '\\';
+			ret += value[i];
+		}
+		return ret + "\"";
+	}
+
+	const string Tracer::json() {
+		boost::mutex::scoped_lock lock(_mutex);
+		string ret = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		ret += "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+				"\"args\": {\"name\": \"pwxget\"}}";
+		char buffer[256];
+		vector<TraceEvent> events;
+		for (size_t i=0; i<_buffers.size(); i++) {
+			const TraceBuffer &b = *_buffers[i];
+			string name = b.name.empty()? "thread " + boost::lexical_cast<string>(b.tid()): b.name;
+			snprintf(buffer, sizeof(buffer), ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+					"\"pid\": 1, \"tid\": %llu, \"args\": {\"name\": ", (unsigned long long)b.tid());
+			ret += buffer + jsonString(name) + "}}";
+			events.clear();
+			b.snapshot(events);
+			for (size_t j=0; j<events.size(); j++) {
+				const TraceEvent &ev = events[j];
+				snprintf(buffer, sizeof(buffer), ",\n{\"name\": \"%s\", \"cat\": \"pwxget\", "
+						"\"ph\": \"X\", \"pid\": 1, \"tid\": %llu, \"ts\": %.3f, \"dur\": %.3f",
+						ev.name, (unsigned long long)b.tid(), (ev.begin - _origin) * 1e6,
+						max(ev.end - ev.begin, 0.0) * 1e6);
+				ret += buffer;
+				if (ev.sheet != TRACE_NO_SHEET) {
+					snprintf(buffer, sizeof(buffer), ", \"args\": {\"sheet\": %llu, \"count\": %llu}",
+							(unsigned long long)ev.sheet, (unsigned long long)ev.count);
+					ret += buffer;
+				}
+				ret += "}";
+			}
+		}
+		ret += "\n]}\n";
+		return ret;
+	}
+
+	void Tracer::dump(const string &path) {
+		string tmp = path + ".tmp";
+		writefile(tmp, json());
+		try {
+			fs::rename(tmp, path);
+		} catch (const fs::filesystem_error &) {
+			throw IOException(path, "Cannot replace trace file " + path + ".");
+		}
+	}
+}
@@ -0,0 +1,101 @@
+/*
+ * trace.h
+ *
+ *  Opt-in timeline of the sheet lifecycle, dumped in Chrome trace format
+ *  (chrome://tracing, ui.perfetto.dev).
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include "metrics.h"
+
+namespace PwxGet {
+	using namespace std;
+
+	const size_t TRACE_NO_SHEET = (size_t)-1;
+	const size_t TRACE_BUFFER_EVENTS = 65536;
+
+	struct TraceEvent {
+		const char *name;		// string literal, never freed
+		double begin, end;		// monotonicSeconds()
+		size_t sheet, count;
+	};
+
+	/**
+	 * Ring of the latest events of one thread.
+	 *
+	 * Only the owning thread pushes, so pushing is a store and a release
+	 * increment; a reader copies the ring and drops whatever the owner may
+	 * have overwritten meanwhile.
+	 */
+	class TraceBuffer {
+	public:
+		TraceBuffer(size_t tid, size_t capacity);
+		void push(const char *name, double begin, double end, size_t sheet, size_t count) throw();
+		void snapshot(vector<TraceEvent> &events) const;
+		inline size_t tid() const throw() { return _tid; }
+		string name;
+	protected:
+		size_t _tid, _mask;
+		vector<TraceEvent> _events;
+		boost::atomic<unsigned long long> _head;
+	};
+
+	class Tracer {
+	public:
+		Tracer();
+		virtual ~Tracer();
+
+		// The tracer shared by all components of the process.
+		static Tracer &global();
+
+		// Recording stays off, and costs a relaxed load, until enabled.
+		void enable(size_t eventsPerThread=TRACE_BUFFER_EVENTS);
+		inline bool enabled() const throw() { return _enabled.load(boost::memory_order_relaxed); }
+
+		// Name the calling thread in the dump, and for the system.
+		void setThreadName(const string &name);
+		void record(const char *name, double begin, double end,
+				size_t sheet=TRACE_NO_SHEET, size_t count=0) throw();
+
+		const string json();
+		void dump(const string &path);
+
+	protected:
+		boost::atomic<bool> _enabled;
+		boost::mutex _mutex;
+		vector<TraceBuffer*> _buffers;
+		boost::thread_specific_ptr<TraceBuffer> _local;
+		size_t _eventsPerThread;
+		double _origin;
+
+		TraceBuffer *local();
+	};
+
+	// Records the enclosing scope as one span if tracing is on.
+	class TraceSpan {
+	public:
+		inline TraceSpan(const char *name, size_t sheet=TRACE_NO_SHEET, size_t count=0) :
+				_name(name), _sheet(sheet), _count(count),
+				_begin(Tracer::global().enabled()? monotonicSeconds(): -1.0) {}
+		inline ~TraceSpan() {
+			if (_begin >= 0) Tracer::global().record(_name, _begin, monotonicSeconds(), _sheet, _count);
+		}
+		// sheets known only after the span began
+		inline void sheets(size_t sheet, size_t count) throw() { _sheet = sheet; _count = count; }
+	protected:
+		const char *_name;
+		size_t _sheet, _count;
+		double _begin;
+	private:
+		TraceSpan(const TraceSpan &);
+		TraceSpan &operator=(const TraceSpan &);
+	};
+}
+
+#endif /* TRACE_H_ */
@@ -7,6 +7,9 @@
 
 #include "webclient.h"
 #include "exceptions.h"
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -112,8 +115,10 @@ namespace PwxGet {
     WebClient::WebClient(WebClient::DataWriter &writer, size_t sheetSize) :
     		curl(curl_easy_init()), _writer(writer), _sheetSize(sheetSize), _errmsg(CURL_ERROR_SIZE),
     		_url(), _proxy(), _proxyServer(), _baseCookies(), _range(), _proxyType(0), _headerOnly(false),
-    		_verbose(false), _supportRange(false),_contentLength(-1), _totalLength(-1), _timeout(30),
-    		_connectTimeout(120), _lowSpeedLimit(1), _lowSpeedTime(120) {
+    		_verbose(false), _supportRange(false),_contentLength(-1), _totalLength(-1), _bodyBytes(0), _timeout(30),
+    		_connectTimeout(120), _lowSpeedLimit(1), _lowSpeedTime(120), _progress(NULL), _etag(), _lastModified(), _retryAfter(-1) {
+        _limits[0] = _limits[1] = NULL;
+        _range.reserve(1024); // "first-last,..." of a multi-range request
         // create curl object
         if (!curl) {
             throw WebError("CURL object cannot be initialized.");
@@ -138,6 +143,9 @@ namespace PwxGet {
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
         curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION , &write_header);
         curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+
+        ConnectionPool *pool = ConnectionPool::installed();
+        if (pool) curl_easy_setopt(curl, CURLOPT_SHARE, pool->handle());
     }
     
     WebClient::~WebClient() {
@@ -191,7 +199,11 @@ namespace PwxGet {
     }
     
     void WebClient::setRange(const string &range) {
-        _range = range;
+        setRange(range.c_str());
+    }
+
+    void WebClient::setRange(const char *range) {
+        _range.assign(range); // keeps the capacity, so a busy client stops allocating
         if (!curl) return;
         curl_easy_setopt(curl, CURLOPT_RANGE, _range.empty()? NULL: _range.c_str());
     }
@@ -231,11 +243,21 @@ namespace PwxGet {
     bool WebClient::perform(CURLcode *curlReturnCode) {
         _contentLength = -1;
         _totalLength = -1;
+        _bodyBytes = 0;
         _supportRange = false;
+        _etag.clear();
+        _lastModified.clear();
+        _retryAfter = -1;
         _errmsg.clear();
         if (!curl) return false;
         //curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
         //curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 256L);
+        // a throttled body may outlast the timeout; the low speed limit still catches a stall
+        bool throttled = false;
+        for (int i=0; i<2; i++) {
+            if (_limits[i] && _limits[i]->rate() > 0) throttled = true;
+        }
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, throttled? 0L: _timeout);
         CURLcode ret = curl_easy_perform(curl);
         if (curlReturnCode) *curlReturnCode = ret;
         return (ret == CURLE_OK);
@@ -248,55 +270,364 @@ namespace PwxGet {
     	}
     }
 
+    /* TokenBucket */
+    TokenBucket::TokenBucket(double rate, double burst) : _mutex(), _rate(0.0), _burst(0.0),
+            _tokens(0.0), _last(monotonicSeconds()) {
+        setRate(rate, burst);
+    }
+
+    void TokenBucket::setRate(double rate, double burst) {
+        Mutex::scoped_lock lock(_mutex);
+        _rate = max(rate, 0.0);
+        _burst = burst > 0? burst: max(_rate / 4, 64.0 * 1024);
+        // a new rate starts from a full bucket, old debt is forgiven
+        _tokens = _burst;
+        _last = monotonicSeconds();
+    }
+
+    double TokenBucket::rate() {
+        Mutex::scoped_lock lock(_mutex);
+        return _rate;
+    }
+
+    double TokenBucket::take(size_t n) {
+        Mutex::scoped_lock lock(_mutex);
+        if (_rate <= 0) return 0.0;
+        double now = monotonicSeconds();
+        _tokens = min(_tokens + (now - _last) * _rate, _burst) - n;
+        _last = now;
+        return _tokens < 0? -_tokens / _rate: 0.0;
+    }
+
+    /* ConnectionPool */
+    ConnectionPool *ConnectionPool::_installed = NULL;
+
+    ConnectionPool::ConnectionPool() : _share(curl_share_init()) {
+        if (!_share) throw WebError("CURL share object cannot be initialized.");
+        curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, &lock);
+        curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, &unlock);
+        curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    ConnectionPool::~ConnectionPool() throw() {
+        if (_installed == this) _installed = NULL;
+        curl_share_cleanup(_share);
+    }
+
+    void ConnectionPool::install(ConnectionPool *pool) throw() {
+        _installed = pool;
+    }
+
+    ConnectionPool *ConnectionPool::installed() throw() {
+        return _installed;
+    }
+
+    void ConnectionPool::lock(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+        static_cast<ConnectionPool*>(userptr)->_locks[data].lock();
+    }
+
+    void ConnectionPool::unlock(CURL *, curl_lock_data data, void *userptr) {
+        static_cast<ConnectionPool*>(userptr)->_locks[data].unlock();
+    }
+
     size_t WebClient::write_body( char *ptr, size_t size, size_t nmemb, void *userdata) {
-        return static_cast<WebClient*>(userdata)->_writer.write(ptr, size, nmemb);
+        WebClient* wc = static_cast<WebClient*>(userdata);
+        wc->_bodyBytes += size*nmemb;
+        if (wc->_progress) wc->_progress->inc(size*nmemb);
+        size_t ret = wc->_writer.write(ptr, size, nmemb);
+        // throttle: holding the callback stops reading the socket
+        double wait = 0.0;
+        for (int i=0; i<2; i++) {
+            if (wc->_limits[i]) wait = max(wait, wc->_limits[i]->take(size*nmemb));
+        }
+        if (wait > 0) {
+            double began = monotonicSeconds();
+            try {
+                boost::this_thread::sleep(boost::posix_time::microseconds((long long)(wait * 1e6)));
+            } catch (const boost::thread_interrupted &) {
+                return 0; // abort the transfer
+            }
+            Tracer::global().record("throttle", began, monotonicSeconds());
+        }
+        return ret;
     }
     
     
+    namespace {
+        /**
+         * Match a header line against "Name:" ignoring case, without copying it.
+         * @param value: The value with blanks and the line break trimmed.
+         */
+        bool matchHeader(const char *line, size_t length, const char *name,
+                const char *&value, size_t &valueLength) {
+            size_t n = strlen(name);
+            if (length <= n || line[n] != ':' || strncasecmp(line, name, n) != 0) return false;
+            value = line + n + 1;
+            valueLength = length - n - 1;
+            while (valueLength && isspace((unsigned char)*value)) { ++value; --valueLength; }
+            while (valueLength && isspace((unsigned char)value[valueLength-1])) --valueLength;
+            return true;
+        }
+
+        // A decimal number making up the whole text, -1 otherwise.
+        long long parseLength(const char *text, size_t length) {
+            long long ret = 0;
+            if (!length) return -1;
+            for (size_t i=0; i<length; i++) {
+                if (text[i] < '0' || text[i] > '9') return -1;
+                ret = ret * 10 + (text[i] - '0');
+            }
+            return ret;
+        }
+
+        // "bytes first-last/total" (or "/*")
+        bool parseContentRange(const char *value, size_t length, size_t &first, size_t &last) {
+            if (length < 6 || strncasecmp(value, "bytes", 5) != 0) return false;
+            size_t dash = 5, slash;
+            while (dash < length && value[dash] != '-') ++dash;
+            for (slash = dash; slash < length && value[slash] != '/'; ++slash);
+            size_t begin = 5;
+            while (begin < dash && isspace((unsigned char)value[begin])) ++begin;
+            long long a = parseLength(value + begin, dash - begin),
+                    b = dash < length? parseLength(value + dash + 1, slash - dash - 1): -1;
+            if (a < 0 || b < a) return false;
+            first = a;
+            last = b;
+            return true;
+        }
+
+        // the code of an "HTTP/x.y code reason" line, -1 for any other
+        int parseStatus(const char *line, size_t length) {
+            if (length < 12 || strncasecmp(line, "HTTP/", 5) != 0) return -1;
+            size_t i = 5;
+            while (i < length && line[i] != ' ') ++i;
+            if (i + 4 > length) return -1;
+            long long code = parseLength(line + i + 1, 3);
+            return code < 0? -1: (int)code;
+        }
+    }
+
     size_t WebClient::write_header(char *ptr, size_t size, size_t nmemb, void *userdata) {
         const size_t MAX_CONSIDER = 1000;
         WebClient* wc = static_cast<WebClient*>(userdata);
         size_t headerSize = size*nmemb;
+        const char *value;
+        size_t valueLength;
 
-        do {
-            if (headerSize > MAX_CONSIDER) break;
-            string header = string(ptr, headerSize);
-            
-            // Content-Length
-            if (boost::istarts_with(header, "Content-Length:")) {
-                header = header.substr(15);
-                boost::trim(header);
-                try {
-                    wc->_contentLength = boost::lexical_cast<long long>(header);
-                } catch (...) {
-                    wc->_contentLength = -1;
+        wc->_writer.header(ptr, headerSize);
+        if (headerSize > MAX_CONSIDER) return headerSize;
+        if (headerSize > 5 && strncasecmp(ptr, "HTTP/", 5) == 0) {
+            // a new response starts (after a redirect, or 100 Continue)
+            wc->_contentLength = -1;
+            wc->_totalLength = -1;
+            wc->_supportRange = false;
+            wc->_etag.clear();
+            wc->_lastModified.clear();
+            wc->_retryAfter = -1;
+        } else if (matchHeader(ptr, headerSize, "Content-Length", value, valueLength)) {
+            wc->_contentLength = parseLength(value, valueLength);
+        } else if (matchHeader(ptr, headerSize, "ETag", value, valueLength)) {
+            wc->_etag.assign(value, valueLength);
+        } else if (matchHeader(ptr, headerSize, "Last-Modified", value, valueLength)) {
+            wc->_lastModified.assign(value, valueLength);
+        } else if (matchHeader(ptr, headerSize, "Retry-After", value, valueLength)) {
+            // seconds, or an HTTP date
+            long long seconds = parseLength(value, valueLength);
+            if (seconds < 0 && valueLength < 64) {
+                char date[64];
+                memcpy(date, value, valueLength);
+                date[valueLength] = '\0';
+                time_t when = curl_getdate(date, NULL);
+                if (when != -1) seconds = max((long long)(when - time(NULL)), 0LL);
+            }
+            wc->_retryAfter = seconds;
+        } else if (matchHeader(ptr, headerSize, "Accept-Ranges", value, valueLength)) {
+            // "bytes", possibly in a list
+            for (size_t i=0; i+5<=valueLength; i++) {
+                if (strncasecmp(value + i, "bytes", 5) == 0) {
+                    wc->_supportRange = true;
+                    break;
                 }
-            } else if (boost::istarts_with(header, "HTTP ") 
-                    && header.size() > 5 && (header[5] >= '0' && header[5] <= '9')) {
-                // Fast test if is HTTP \d+ .*
-                wc->_contentLength = -1;
-                wc->_totalLength = -1;
-                wc->_supportRange = false;
-            } else if (boost::istarts_with(header, "Accept-Ranges:")
-                    && boost::icontains(header, "bytes")) {
-                wc->_supportRange = true;
-            } else if (boost::istarts_with(header, "Content-Range:")) {
-            	size_t pos = header.rfind('/');
-            	if (pos != string::npos) {
-            		header = header.substr(pos+1);
-            		boost::trim(header);
-            		try {
-						wc->_totalLength = boost::lexical_cast<long long>(header);
-					} catch (...) {
-						wc->_totalLength = -1;
-					}
-            	}
             }
-        } while (false);
-        
+        } else if (matchHeader(ptr, headerSize, "Content-Range", value, valueLength)) {
+            // "bytes first-last/total"
+            size_t slash = valueLength;
+            while (slash && value[slash-1] != '/') --slash;
+            if (slash) {
+                while (slash < valueLength && isspace((unsigned char)value[slash])) ++slash;
+                wc->_totalLength = parseLength(value + slash, valueLength - slash);
+            }
+        }
+
         return headerSize;
     }
     
+    /* RangeDataWriter */
+    WebClient::RangeDataWriter::RangeDataWriter(size_t capacity, size_t maxRanges) : DataWriter(),
+            _buffer(max(capacity, (size_t)1)), _ranges(), _used(0), _end(0), _stop((size_t)-1), _reached(0), _status(-1), _mode(DROP),
+            _position(0), _ranged(false), _part(DELIMITER), _remaining(0), _lineLength(0) {
+        _ranges.reserve(max(maxRanges, (size_t)1));
+        _boundary[0] = '\0';
+    }
+
+    WebClient::RangeDataWriter::~RangeDataWriter() throw() {
+    }
+
+    void WebClient::RangeDataWriter::clear() {
+        _ranges.clear();
+        _used = _end = 0;
+        _stop.store((size_t)-1);
+        _reached.store(0);
+        _status = -1;
+        _mode = DROP;
+    }
+
+    void WebClient::RangeDataWriter::addRange(size_t first, size_t last, size_t slot, size_t lead) {
+        size_t length = max(lead + last - first + 1, slot);
+        if (last < first || _used + length > _buffer.size() || _ranges.size() == _ranges.capacity())
+            throw OutOfRange("range");
+        Range range;
+        range.first = first;
+        range.last = last;
+        range.offset = _used + lead;
+        range.received = 0;
+        _ranges.push_back(range);
+        _used += length;
+        _end = max(_end, last + 1);
+    }
+
+    void WebClient::RangeDataWriter::header(const char *line, size_t length) {
+        const char *value;
+        size_t valueLength, first, last;
+        int status = parseStatus(line, length);
+        if (status >= 0) {
+            // a new response, after a redirect or 100 Continue
+            _status = status;
+            _mode = DROP;
+            _position = 0;
+            _ranged = false;
+            _boundary[0] = '\0';
+        } else if (matchHeader(line, length, "Content-Range", value, valueLength)) {
+            if (parseContentRange(value, valueLength, first, last)) {
+                _position = first;
+                _ranged = true;
+            }
+        } else if (matchHeader(line, length, "Content-Type", value, valueLength)) {
+            if (valueLength < 20 || strncasecmp(value, "multipart/byteranges", 20) != 0) return;
+            // the boundary parameter, maybe quoted
+            for (size_t i=20; i+9<=valueLength; i++) {
+                if (strncasecmp(value + i, "boundary=", 9) != 0) continue;
+                const char *b = value + i + 9;
+                size_t n = valueLength - i - 9;
+                if (n && *b == '"') {
+                    ++b;
+                    size_t quote = 0;
+                    while (quote < n - 1 && b[quote] != '"') ++quote;
+                    n = quote;
+                } else {
+                    size_t end = 0;
+                    while (end < n && b[end] != ';' && !isspace((unsigned char)b[end])) ++end;
+                    n = end;
+                }
+                if (n && n <= MAX_BOUNDARY) {
+                    memcpy(_boundary, b, n);
+                    _boundary[n] = '\0';
+                }
+                break;
+            }
+        } else if (length <= 2 && (length == 0 || line[0] == '\r' || line[0] == '\n')) {
+            // end of the headers: how the body is laid out
+            if (_status == 206 && _boundary[0]) {
+                _mode = MULTIPART;
+                _part = DELIMITER;
+                _lineLength = 0;
+            } else if ((_status == 206 && _ranged) || _status == 200) {
+                _mode = SINGLE; // a 200 starts at byte 0
+            } else {
+                _mode = DROP;
+            }
+        }
+    }
+
+    size_t WebClient::RangeDataWriter::write(char *ptr, size_t size, size_t nmemb) {
+        size_t n = size * nmemb;
+        if (_mode == SINGLE) {
+            // the ranges were ignored, or the rest is fetched elsewhere: stop
+            size_t stop = min(_end, _stop.load());
+            if (_position >= stop) return 0;
+            deliver(_position, ptr, min(n, stop - _position));
+            _position += n;
+        } else if (_mode == MULTIPART) {
+            const char *p = ptr, *end = ptr + n;
+            while (p < end && _part != END) {
+                if (_part == BODY) {
+                    size_t k = min((size_t)(end - p), _remaining);
+                    deliver(_position, p, k);
+                    _position += k;
+                    _remaining -= k;
+                    p += k;
+                    if (!_remaining) _part = DELIMITER;
+                    continue;
+                }
+                // delimiter and part header lines
+                char c = *p++;
+                if (c == '\n') {
+                    partLine();
+                    _lineLength = 0;
+                } else if (_lineLength < sizeof(_line)) {
+                    _line[_lineLength++] = c;
+                }
+            }
+        }
+        return n;
+    }
+
+    void WebClient::RangeDataWriter::partLine() {
+        size_t length = _lineLength;
+        if (length && _line[length-1] == '\r') --length;
+        if (_part == DELIMITER) {
+            // "--boundary" opens a part, "--boundary--" closes the body
+            size_t b = strlen(_boundary);
+            if (length < b + 2 || _line[0] != '-' || _line[1] != '-' ||
+                    memcmp(_line + 2, _boundary, b) != 0) return;
+            if (length == b + 2) {
+                _part = HEADERS;
+                _ranged = false;
+            } else if (length == b + 4 && _line[b+2] == '-' && _line[b+3] == '-') {
+                _part = END;
+            }
+        } else if (_part == HEADERS) {
+            const char *value;
+            size_t valueLength, first, last;
+            if (length == 0) {
+                // a part that cannot be placed is skipped up to the next delimiter
+                _part = _ranged? BODY: DELIMITER;
+            } else if (matchHeader(_line, length, "Content-Range", value, valueLength) &&
+                    parseContentRange(value, valueLength, first, last)) {
+                _position = first;
+                _remaining = last - first + 1;
+                _ranged = true;
+            }
+        }
+    }
+
+    void WebClient::RangeDataWriter::deliver(size_t offset, const char *data, size_t n) throw() {
+        if (!n) return;
+        size_t end = offset + n; // exclusive
+        for (size_t i=0; i<_ranges.size(); i++) {
+            Range &range = _ranges[i];
+            size_t lo = max(offset, range.first), hi = min(end, range.last + 1);
+            if (lo >= hi) continue;
+            memcpy(&_buffer[0] + range.offset + (lo - range.first), data + (lo - offset), hi - lo);
+            // only what joins the bytes from the start counts
+            if (lo <= range.first + range.received) range.received = max(range.received, hi - range.first);
+            if (i == 0) _reached.store(range.first + range.received, boost::memory_order_relaxed);
+        }
+    }
+
     // get response info
     int WebClient::getHttpCode() {
         long code;
@@ -316,6 +647,12 @@ namespace PwxGet {
     	return _contentLength;
     }
 
+    const string WebClient::getValidator() const {
+        // a weak tag promises the same meaning, not the same bytes
+        if (!_etag.empty() && !boost::starts_with(_etag, "W/")) return _etag;
+        return _lastModified;
+    }
+
     const string WebClient::getResponseUrl() {
         char *url = NULL;
         if (!curl) return string();
@@ -331,5 +668,28 @@ namespace PwxGet {
     		return 0.0;
     	return spd;
     }
-}
 
+    static double getTimeInfo(CURL *curl, CURLINFO info) {
+        double t = 0;
+        if (!curl) return 0.0;
+        if (curl_easy_getinfo(curl, info, &t) != CURLE_OK)
+            return 0.0;
+        return t;
+    }
+
+    double WebClient::getFirstByteTime() {
+        return getTimeInfo(curl, CURLINFO_STARTTRANSFER_TIME);
+    }
+
+    double WebClient::getTotalTime() {
+        return getTimeInfo(curl, CURLINFO_TOTAL_TIME);
+    }
+
+    double WebClient::getPretransferTime() {
+        return getTimeInfo(curl, CURLINFO_PRETRANSFER_TIME);
+    }
+
+    double WebClient::getConnectTime() {
+        return getTimeInfo(curl, CURLINFO_CONNECT_TIME);
+    }
+}
@@ -10,7 +10,10 @@
 
 #include <curl/curl.h>
 #include <string>
+#include <vector>
+#include <boost/atomic.hpp>
 #include "filebuffer.h"
+#include "metrics.h"
 
 namespace PwxGet {
     using namespace std;
@@ -24,6 +27,58 @@ namespace PwxGet {
      */
     bool parseProxy(const string &proxy, string &optProxy, long &optType);
 
+    /**
+     * Token bucket shared by the clients it limits.
+     *
+     * Taking more than is available leaves the bucket in debt, and the
+     * taker sleeps the debt off, so a cap holds whatever the chunk size.
+     * A rate of 0 means unlimited. The rate may be changed at any time.
+     */
+    class TokenBucket {
+    public:
+        TokenBucket(double rate=0.0, double burst=0.0);
+        /**
+         * @param rate: Bytes per second, 0 for unlimited.
+         * @param burst: Bytes allowed at once after idling, 0 for rate/4 (at least 64 KB).
+         */
+        void setRate(double rate, double burst=0.0);
+        double rate();
+        // Take n bytes, returns the seconds to wait before going on.
+        double take(size_t n);
+    protected:
+        typedef boost::mutex Mutex;
+        Mutex _mutex;
+        double _rate, _burst, _tokens, _last;
+    };
+
+    /**
+     * DNS, TLS session and connection caches shared by every client
+     * created while the pool is installed, so a long-running process
+     * keeps them warm from one job to the next.
+     * Cookies are not shared. The pool must outlive those clients.
+     */
+    class ConnectionPool {
+    public:
+        ConnectionPool();
+        virtual ~ConnectionPool() throw();
+        inline CURLSH *handle() throw() { return _share; }
+
+        // Pool for new clients, NULL for none.
+        static void install(ConnectionPool *pool) throw();
+        static ConnectionPool *installed() throw();
+    protected:
+        typedef boost::mutex Mutex;
+        CURLSH *_share;
+        Mutex _locks[CURL_LOCK_DATA_LAST];
+        static ConnectionPool *_installed;
+
+        static void lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+        static void unlock(CURL *handle, curl_lock_data data, void *userptr);
+    private:
+        ConnectionPool(const ConnectionPool &);
+        ConnectionPool &operator=(const ConnectionPool &);
+    };
+
     class WebClient {
     public:
         class DataBuffer {
@@ -65,6 +120,8 @@ namespace PwxGet {
         public:
             virtual size_t write(char *ptr, size_t size, size_t nmemb) = 0;
             virtual void clear() = 0;
+            // Every response header line, status lines included, as received.
+            virtual void header(const char *line, size_t length) {}
         };
         
         class DummyDataWriter : public DataWriter {
@@ -77,18 +134,96 @@ namespace PwxGet {
 
         class BufferDataWriter : public DataWriter {
         public:
-            inline BufferDataWriter() : DataWriter() {}
-            inline BufferDataWriter(size_t capacity) : DataWriter() {
+            inline BufferDataWriter() : DataWriter(), _limit(0) {}
+            // Past limit bytes (0 for none) the transfer ends with a write error.
+            inline BufferDataWriter(size_t capacity, size_t limit=0) : DataWriter(), _limit(limit) {
             	_d.reserve(capacity);
             }
             inline virtual size_t write(char *ptr, size_t size, size_t nmemb) {
-                _d.append(ptr, size*nmemb);
-                return size*nmemb;
+                size_t n = size*nmemb;
+                if (_limit && _d.size() + n > _limit) {
+                    _d.append(ptr, _limit - _d.size());
+                    return 0;
+                }
+                _d.append(ptr, n);
+                return n;
             }
             inline virtual void clear() { _d.clear(); }
             inline string &data() throw() { return _d; }
+            // The limit ended the transfer.
+            inline bool full() const throw() { return _limit && _d.size() >= _limit; }
         protected:
             string _d;
+            size_t _limit;
+        };
+
+        /**
+         * Body of a request for one or more byte ranges, each put in its
+         * place: the ranges lie one after another in the buffer, in the
+         * order added. Parts of a multipart/byteranges answer, and the one
+         * range (or whole file) a server sends instead, are copied there
+         * by their Content-Range; bytes outside the ranges are dropped.
+         * Only 200 and 206 answers are taken. Allocates nothing once built.
+         */
+        class RangeDataWriter : public DataWriter {
+        public:
+            RangeDataWriter(size_t capacity, size_t maxRanges);
+            virtual ~RangeDataWriter() throw();
+            // Forget the ranges, what arrived and the stop.
+            virtual void clear();
+            /**
+             * Ask for bytes first..last next; throws OutOfRange past the capacity.
+             * @param slot: Buffer bytes it takes, 0 for just the range.
+             * @param lead: Of the slot, bytes left free before the range.
+             */
+            void addRange(size_t first, size_t last, size_t slot=0, size_t lead=0);
+            virtual void header(const char *line, size_t length);
+            virtual size_t write(char *ptr, size_t size, size_t nmemb);
+
+            inline size_t rangeCount() const throw() { return _ranges.size(); }
+            // Bytes of range i that arrived in one piece from its start.
+            inline size_t received(size_t i) const throw() { return _ranges[i].received; }
+            // Every byte of range i arrived, up to the stop.
+            inline bool complete(size_t i) const throw() {
+                const Range &range = _ranges[i];
+                return range.received >= min(range.last + 1, max(_stop.load(), range.first + 1)) - range.first;
+            }
+            /**
+             * End a single-range answer at file offset position; bytes from
+             * there on are not needed. Safe from other threads.
+             */
+            inline void stopAt(size_t position) throw() { _stop.store(position); }
+            // File offset the first range arrived up to in one piece; safe from other threads.
+            inline size_t reached() const throw() { return _reached.load(boost::memory_order_relaxed); }
+            inline const char *data(size_t i=0) const throw() { return &_buffer[0] + _ranges[i].offset; }
+            // The last answer was a multipart/byteranges body.
+            inline bool multipart() const throw() { return _mode == MULTIPART; }
+
+            static const size_t MAX_BOUNDARY = 70; // RFC 2046
+        protected:
+            struct Range {
+                size_t first, last, offset, received;
+            };
+            enum Mode { DROP, SINGLE, MULTIPART };
+            enum Part { DELIMITER, HEADERS, BODY, END };
+            vector<char> _buffer;
+            vector<Range> _ranges;
+            size_t _used, _end; // buffer bytes taken, end of the highest range
+            boost::atomic<size_t> _stop, _reached;
+            // the response at hand
+            int _status;
+            Mode _mode;
+            size_t _position;   // file offset of the next body byte
+            bool _ranged;       // Content-Range seen for the body or part
+            char _boundary[MAX_BOUNDARY + 1];
+            // multipart state
+            Part _part;
+            size_t _remaining;  // bytes left of the part body
+            char _line[256];    // part header line, cut at the size
+            size_t _lineLength;
+
+            void deliver(size_t offset, const char *data, size_t n) throw();
+            void partLine();
         };
         
         WebClient(DataWriter &writer, size_t sheetSize=DEFAULT_SHEET_SIZE);
@@ -104,6 +239,7 @@ namespace PwxGet {
         void setCookies(const string &cookies);
         const string &getCookies() const throw() { return _baseCookies; }
         void setRange(const string &range);
+        void setRange(const char *range);
         const string &getRange() const throw() { return _range; }
         void setHeaderOnly(bool headerOnly);
         bool getHeaderOnly() const throw() { return _headerOnly; }
@@ -118,6 +254,12 @@ namespace PwxGet {
         long getLowSpeedLimit() const throw() { return _lowSpeedLimit; }
         void setLowSpeedTime(long lowSpeedTime);
         long getLowSpeedTime() const throw() { return _lowSpeedTime; }
+        // Counter bumped by every body chunk as it arrives, NULL for none.
+        void setProgressCounter(Counter *progress) throw() { _progress = progress; }
+        // Buckets the body is throttled by, NULL for none.
+        void setRateLimits(TokenBucket *global, TokenBucket *proxy) throw() {
+            _limits[0] = global; _limits[1] = proxy;
+        }
         
         bool valid() const throw() { return curl; }
         void reset();
@@ -133,7 +275,18 @@ namespace PwxGet {
         long long getFileSize();
         const string getResponseUrl();
         bool supportRange() { return _supportRange; }
+        // Strong ETag of the last response, else its Last-Modified; empty if neither.
+        const string getValidator() const;
+        // Seconds the last response asked to wait with Retry-After, -1 if it did not.
+        long long getRetryAfter() const throw() { return _retryAfter; }
         double getDownloadSpeed();
+        // Body bytes handed to the data writer by the last perform().
+        long long getBodyBytes() const throw() { return _bodyBytes; }
+        // Seconds from the start of the last perform() to its first byte / to its end.
+        double getFirstByteTime();
+        double getTotalTime();
+        double getPretransferTime();
+        double getConnectTime();
         
     protected:
         CURL *curl;
@@ -144,8 +297,12 @@ namespace PwxGet {
         string _url, _proxy, _proxyServer, _baseCookies, _range;
         long _proxyType;
         bool _headerOnly, _verbose, _supportRange;
-        long long _contentLength, _totalLength;
+        long long _contentLength, _totalLength, _bodyBytes;
         long _timeout, _connectTimeout, _lowSpeedLimit, _lowSpeedTime;
+        Counter *_progress;
+        TokenBucket *_limits[2];
+        string _etag, _lastModified;
+        long long _retryAfter;
         
         static size_t write_body(char *ptr, size_t size, size_t nmemb, void *userdata);
         static size_t write_header(char *ptr, size_t size, size_t nmemb, void *userdata);
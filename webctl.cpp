@@ -7,17 +7,23 @@
 
 #include "webctl.h"
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
 namespace fs = boost::filesystem;
 using namespace std;
 
 namespace PwxGet {
 	const unsigned int JobFile::MAGIC_FLAG = 0x62874517;
+	const unsigned int JobFile::MAGIC_FLAG_TAPERED = 0x62874518;
 
 	/* JobFile */
 	JobFile::JobFile() : _url(), _url2(), _cookies(), _savePath(), _jobPath(),
-			_useRedirectedUrl(), _fileSize(0), _sheetSize(0), _index(), _jobFile() {
+			_useRedirectedUrl(), _stream(false), _fileSize(0), _sheetSize(0),
+			_tailZones(0), _zoneSheets(0), _index(), _open(false), _tempPath(), _header() {
 	}
 
 	JobFile::~JobFile() throw() {
@@ -29,15 +35,18 @@ namespace PwxGet {
 		if (!fs::exists(jobPath)) throw JobNotExists(jobPath);
 		//if (!fs::exists(savePath)) throw JobNotExists(savePath);
 		// open job file
-		_jobFile.open(jobPath.c_str(), (ios::binary | ios::out | ios::in) & ~ios::trunc);
-		if (!_jobFile.is_open()) throw BadJobFile(jobPath);
+		ifstream fin(jobPath.c_str(), ios::binary);
+		if (!fin) throw BadJobFile(jobPath);
 		_jobPath = jobPath;
+		_tempPath = jobPath + ".tmp";
 		// read information
-		read(savePath);
+		read(fin, savePath);
+		_open = true;
 	}
 
 	void JobFile::create(const string &url, /*const string &url2, */const string &cookies,
-			const string &savePath, bool useRedirectedUrl, size_t fileSize, size_t sheetSize) {
+			const string &savePath, bool useRedirectedUrl, size_t fileSize, size_t sheetSize,
+			size_t connections) {
 		string jobPath = savePath + ".pg!";
 		if (fs::exists(jobPath)) throw JobExists(jobPath);
 		//if (fs::exists(savePath)) throw JobExists(savePath);
@@ -46,13 +55,13 @@ namespace PwxGet {
 		if (!fs::exists(parent_dir))
 			try {
 				fs::create_directories(parent_dir);
-			} catch (fs::filesystem_error) {
+			} catch (const fs::filesystem_error &) {
 				throw IOException("Cannot create job file directory.");
 			}
 		// create job file
-		_jobFile.open(jobPath.c_str(), (ios::binary | ios::out | ios::in | ios::trunc));
-		if (!_jobFile.is_open()) throw BadJobFile(jobPath);
 		_jobPath = jobPath;
+		_tempPath = jobPath + ".tmp";
+		_open = true;
 		// set information
 		_url = url;
 		//_url2 = url2;
@@ -60,16 +69,74 @@ namespace PwxGet {
 		_savePath = savePath;
 		_jobPath = jobPath;
 		_useRedirectedUrl = useRedirectedUrl;
-		_fileSize = fileSize;
-		_sheetSize = sheetSize;
+		setSheetMap(SheetMap::tapered(fileSize, sheetSize, connections));
 		_index.resize(indexSize());
 		// flush into job file
 		flush();
 	}
 
+	void JobFile::createStream(const string &url, const string &cookies, const string &savePath,
+			bool useRedirectedUrl, size_t fileSize, size_t sheetSize, size_t connections) {
+		_url = url;
+		_cookies = cookies;
+		_savePath = savePath;
+		_jobPath.clear();
+		_useRedirectedUrl = useRedirectedUrl;
+		_stream = true;
+		setSheetMap(SheetMap::tapered(fileSize, sheetSize, connections));
+		_index.resize(indexSize());
+	}
+
+	size_t JobFile::recover(const string &url, const string &cookies, const string &savePath,
+			bool useRedirectedUrl, size_t fileSize, size_t sheetSize, bool checkZeros, size_t connections) {
+		if (!fs::is_regular_file(savePath) || fs::file_size(savePath) != fileSize)
+			throw IOException(savePath, "Output path " + savePath +
+					" differs in size from the target, cannot recover.");
+		// a half-read job must not be flushed back
+		_open = false;
+		string jobPath = savePath + ".pg!";
+		try {
+			fs::remove(jobPath);
+		} catch (const fs::filesystem_error &) {
+			throw IOException(jobPath, "Cannot remove broken job file " + jobPath + ".");
+		}
+		create(url, cookies, savePath, useRedirectedUrl, fileSize, sheetSize, connections);
+		FileBuffer fb(savePath, sheetMap(), *this);
+		size_t ret = fb.recover(checkZeros);
+		fb.close();
+		return ret;
+	}
+
+	size_t JobFile::regrid(const SheetMap &sheets) {
+		SheetMap from = sheetMap();
+		const byte *old = (const byte*)_index.data();
+		size_t count = sheets.sheetCount(), done = 0;
+		string index((count + 7) / 8, '\0');
+		for (size_t i=0; i<count; i++) {
+			// the old sheets holding the first and the last byte, and all between
+			size_t first = from.sheetAt(sheets.offset(i)), last = from.sheetAt(sheets.offset(i + 1) - 1);
+			bool covered = true;
+			for (size_t j=first; covered && j<=last; j++) covered = (old[j / 8] >> (7 - j % 8)) & 1;
+			if (!covered) continue;
+			index[i / 8] |= 1 << (7 - i % 8);
+			++done;
+		}
+		setSheetMap(sheets);
+		_index.swap(index);
+		// the new file is as long as the new index
+		flush(true);
+		return done;
+	}
+
+	void JobFile::setSheetMap(const SheetMap &sheets) {
+		_fileSize = sheets.fileSize();
+		_sheetSize = sheets.sheetSize();
+		_tailZones = sheets.tailZones();
+		_zoneSheets = sheets.zoneSheets();
+	}
+
 	size_t JobFile::indexSize() const throw() {
-		size_t sheetCount = _fileSize / _sheetSize;
-		if (sheetCount * _sheetSize != _fileSize) ++sheetCount;
+		size_t sheetCount = sheetMap().sheetCount();
 		size_t ret = sheetCount / 8;
 		if (ret * 8 != sheetCount) ++ret;
 		return ret;
@@ -83,20 +150,18 @@ namespace PwxGet {
 				+ sizeof(unsigned int) + _savePath.size() 		// savePath
 				+ sizeof(char)									// useRedirectedUrl
 				+ sizeof(unsigned long long)					// fileSize
-				+ sizeof(unsigned long long);					// sheetSize
-	}
-
-	void JobFile::writeBytes(const char *data, size_t n) {
-		if (!_jobFile.write(data, n))
-			throw IOException(_jobPath, "Write job information to file failed.");
+				+ sizeof(unsigned long long)					// sheetSize
+				+ (_tailZones? 2 * sizeof(unsigned int): 0);	// tailZones, zoneSheets
 	}
 
-	void JobFile::flush() {
-		if (!_jobFile.is_open()) return;
+	void JobFile::flush(bool sync) {
+		if (!_open) return;
 		// generate file header
-		size_t headerSize = this->headerSize();
-		WebClient::DataBuffer db(headerSize);
-		db.appendValue(MAGIC_FLAG);
+		size_t fileSize = headerSize() + indexSize();
+		WebClient::DataBuffer &db = _header;
+		if (db.capacity() != fileSize) db.resize(fileSize);
+		else db.clear();
+		db.appendValue(_tailZones? MAGIC_FLAG_TAPERED: MAGIC_FLAG);
 		db.appendValue((unsigned int)_url.size());
 		db.append(_url.data(), _url.size());
 		db.appendValue((unsigned int)_url2.size());
@@ -108,28 +173,28 @@ namespace PwxGet {
 		db.appendValue(char(_useRedirectedUrl? 1: 0));
 		db.appendValue((unsigned long long)_fileSize);
 		db.appendValue((unsigned long long)_sheetSize);
-		// write header & index to file
-		_jobFile.seekg(0, ios::beg);
-		writeBytes(db.data(), headerSize);
-		writeBytes(_index.data(), indexSize());
-		_jobFile.flush();
+		if (_tailZones) {
+			db.appendValue((unsigned int)_tailZones);
+			db.appendValue((unsigned int)_zoneSheets);
+		}
+		db.append(_index.data(), indexSize());
+		// a crash leaves the old job file or the new one
+		replacefile(_jobPath, _tempPath, db.data(), db.length(), sync);
 	}
 
-	void JobFile::read(const string &checkSavePath) {
-		if (!_jobFile.is_open()) return;
-
+	void JobFile::read(istream &in, const string &checkSavePath) {
 		// read file content
 		WebClient::DataBuffer db;
-		_jobFile.seekg(0, ios::end);
-		size_t len2read = _jobFile.tellg();
-		_jobFile.seekg(0, ios::beg);
+		in.seekg(0, ios::end);
+		size_t len2read = in.tellg();
+		in.seekg(0, ios::beg);
 		db.resize(len2read);
 
 		size_t done = 0;
 		while (done < len2read) {
-			if (!_jobFile.read(db.data()+done, len2read-done))
+			if (!in.read(db.data()+done, len2read-done))
 				throw BadJobFile(_jobPath);
-			done += _jobFile.gcount();
+			done += in.gcount();
 		}
 
 		// pick out headers & index
@@ -141,7 +206,7 @@ namespace PwxGet {
 		try {
 			// magic flag
 			db.safeGetValue(pos, magic_flag, &pos);
-			if (magic_flag != MAGIC_FLAG) throw BadJobFile(_jobPath);
+			if (magic_flag != MAGIC_FLAG && magic_flag != MAGIC_FLAG_TAPERED) throw BadJobFile(_jobPath);
 			// other headers
 			db.safeGetValue(pos, n, &pos);
 			db.safeGetString(pos, n, _url, &pos);
@@ -157,9 +222,18 @@ namespace PwxGet {
 			_fileSize = size_t(ldd);
 			db.safeGetValue(pos, ldd, &pos);
 			_sheetSize = size_t(ldd);
+			_tailZones = _zoneSheets = 0;
+			if (magic_flag == MAGIC_FLAG_TAPERED) {
+				db.safeGetValue(pos, n, &pos);
+				_tailZones = n;
+				db.safeGetValue(pos, n, &pos);
+				_zoneSheets = n;
+			}
+			if (!_sheetSize || !sheetMap().uniform() != (magic_flag == MAGIC_FLAG_TAPERED))
+				throw BadJobFile(_jobPath);
 			// read index
 			db.safeGetString(pos, indexSize(), _index, &pos);
-		} catch (OutOfRange) {
+		} catch (const OutOfRange &) {
 			throw BadJobFile(_jobPath);
 		}
 
@@ -172,77 +246,317 @@ namespace PwxGet {
 	void JobFile::close() throw() {
 		try {
 			flush();
-		} catch (IOException) {}
-		_jobFile.close();
+		} catch (const IOException &) {}
+		_open = false;
 	}
 
 	const string &JobFile::getData() const {
 		return _index;
 	}
-	void JobFile::setData(const string &data) {
-		if (_index.capacity() != data.size())
+	void JobFile::setData(const string &data, bool sync) {
+		if (_index.size() != data.size())
 			throw BadIndex("Index of " + _savePath + " does not have a valid length.");
-		memcpy((char*)_index.data(), data.data(), _index.capacity());
-		flush();
+		memcpy((char*)_index.data(), data.data(), _index.size());
+		flush(sync);
 	}
 	bool JobFile::isValid() const throw() {
-		return _jobFile.is_open();
+		return _open;
 	}
 	const string JobFile::identifier() const throw() {
 		return _jobPath;
 	}
-
 	// Speed Profile
 	size_t KB(1024), MB(1024 * 1024), GB(1024 * 1024 * 1024);
+
+	size_t parseSize(const string &text) {
+		string s = boost::trim_copy(text);
+		size_t unit = 1;
+		if (!s.empty()) {
+			switch (toupper(s[s.size()-1])) {
+			case 'K': unit = KB; break;
+			case 'M': unit = MB; break;
+			case 'G': unit = GB; break;
+			}
+			if (unit != 1) s.erase(s.size()-1);
+		}
+		try {
+			return boost::lexical_cast<size_t>(s) * unit;
+		} catch (const boost::bad_lexical_cast &) {
+			throw ArgumentError(text, text + " is not a valid size.");
+		}
+	}
+
+	Durability parseDurability(const string &text) {
+		vector<string> parts;
+		boost::split(parts, text, boost::is_any_of(":"));
+		Durability durability;
+		if (parts.size() == 1 && parts[0] == "none") durability.mode = Durability::NONE;
+		else if (parts.size() == 1 && parts[0] == "strict") durability.mode = Durability::STRICT;
+		else if (parts[0] != "interval" || parts.size() > 3)
+			throw ArgumentError(text, text + " is not a valid durability.");
+		try {
+			if (parts.size() > 1) durability.intervalMs = boost::lexical_cast<size_t>(parts[1]);
+		} catch (const boost::bad_lexical_cast &) {
+			throw ArgumentError(text, text + " is not a valid durability.");
+		}
+		if (parts.size() > 2) durability.intervalBytes = parseSize(parts[2]);
+		return durability;
+	}
+
+	bool isStreamPath(const string &path) {
+		if (path == "-") return true;
+		try {
+			return fs::status(path).type() == fs::fifo_file;
+		} catch (const fs::filesystem_error &) {
+			return false;
+		}
+	}
+
 	SpeedProfile SPD_EXTREME(8*MB, 		1, 	16, 128, "extreme"),	// 8 MB/sheet, 	1 sheet/page
 				SPD_HIGH	(4*MB, 		2, 	16, 128, "high"),		// 4 MB/sheet, 	2 sheet/page
 				SPD_MEDIUM	(1*MB, 		8, 	16, 128, "medium"),		// 1 MB/sheet, 	8 sheet/page
 				SPD_LOW		(256*KB, 	32, 16, 128, "low");		// 256 MB/sheet,32 sheet/page
 
+	bool speedProfileByName(const string &name, SpeedProfile &profile) {
+		if (name == "extreme")
+			profile = SPD_EXTREME;
+		else if (name == "high" || name == "fast")
+			profile = SPD_HIGH;
+		else if (name == "medium" || name == "normal")
+			profile = SPD_MEDIUM;
+		else if (name == "low" || name == "slow")
+			profile = SPD_LOW;
+		else
+			return false;
+		return true;
+	}
+
+	static size_t floorPow2(size_t n) {
+		size_t ret = 1;
+		while (ret <= n / 2) ret <<= 1;
+		return ret;
+	}
+
+	SpeedProfile autoSpeedProfile(size_t fileSize, size_t connections,
+			const ProbeResult &probe, size_t sheetSize) {
+		const size_t MAX_SHEET = 8*MB, MAX_SHEET_COUNT = 1 << 20;
+		const size_t PAGE_BYTES = 4*MB, MAX_CACHE = 256*MB, MAX_REQUEST = 32*MB;
+		connections = max(connections, (size_t)1);
+		double rtt = probe.rtt > 0? probe.rtt: 0.1,
+				bandwidth = probe.bandwidth > 0? probe.bandwidth: 1.0*MB;
+
+		if (!sheetSize) {
+			// big enough that the round trip costs at most ~20% of a request,
+			// small enough that every connection gets a few sheets,
+			// and never so small that the index grows past MAX_SHEET_COUNT bits
+			size_t efficient = size_t(4 * rtt * bandwidth),
+					parallel = fileSize / (connections * 4),
+					indexFloor = fileSize / MAX_SHEET_COUNT;
+			sheetSize = floorPow2(max(min(efficient, parallel), indexFloor));
+			if (sheetSize < indexFloor) sheetSize <<= 1;
+			sheetSize = max(DEFAULT_SHEET_SIZE, min(sheetSize, MAX_SHEET));
+		}
+
+		size_t sheetCount = fileSize / sheetSize + (fileSize % sheetSize? 1: 0);
+		size_t pageSize = max(PAGE_BYTES / sheetSize, (size_t)1);
+		size_t pageBytes = pageSize * sheetSize,
+				filePages = max(sheetCount / pageSize + (sheetCount % pageSize? 1: 0), (size_t)1);
+		// one page in flight per connection plus as many being completed
+		size_t pageCount = max(DEFAULT_PAGE_COUNT, connections * 2);
+		pageCount = min(pageCount, max(MAX_CACHE / pageBytes, (size_t)2));
+		pageCount = min(pageCount, filePages);
+		size_t maxPageCount = min(max(MAX_CACHE / pageBytes, pageCount), filePages);
+		size_t maxSpan = max(MAX_REQUEST / sheetSize, (size_t)1);
+
+		return SpeedProfile(sheetSize, pageSize, pageCount, DEFAULT_SCAN_COUNT, "auto",
+				maxSpan, maxPageCount, true);
+	}
+
+	bool shouldRegrid(size_t sheetSize, const SpeedProfile &profile) {
+		if (sheetSize == profile.sheetSize) return false;
+		if (!profile.autoTune) return true;
+		size_t larger = max(sheetSize, profile.sheetSize), smaller = min(sheetSize, profile.sheetSize);
+		return larger / smaller >= REGRID_FACTOR;
+	}
+
 	// WebCtl Utilities
 	size_t WebCtl::checkProxies(list<string> &proxies) {
-		WebClient::BufferDataWriter db;
-		WebClient wc(db);
+		ProxyChecker checker(proxies);
 		list<string> ret;
+		string proxy;
+		while (checker.next(proxy)) {
+			ret.push_back(proxy);
+		}
+		proxies = ret;
+		return ret.size();
+	}
 
-		wc.setConnectTimeout(10);
-		wc.setTimeout(30);
-		for(list<string>::const_iterator it=proxies.begin(); it!=proxies.end(); it++) {
-			try {
-				wc.reset(); db.clear();
-				wc.setUrl("http://www.google.com/");
-				wc.setProxy(*it);
-				if (wc.perform() && db.data().find("google") != string::npos) {
-					ret.push_back(*it);
+	// ProxyChecker
+	ProxyChecker::ProxyChecker(const list<string> &proxies, size_t parallel) : _state(new State()) {
+		_state->pending.assign(proxies.begin(), proxies.end());
+		size_t threads = min(max(parallel, (size_t)1), proxies.size());
+		_state->running = threads;
+		for (size_t i=0; i<threads; i++) {
+			// detached, a thread outlives the checker only until its request times out
+			boost::thread(boost::bind(&ProxyChecker::run, _state)).detach();
+		}
+	}
+
+	ProxyChecker::~ProxyChecker() {
+		Mutex::scoped_lock lock(_state->mutex);
+		_state->pending.clear();
+	}
+
+	bool ProxyChecker::next(string &proxy, size_t timeoutMs) {
+		Mutex::scoped_lock lock(_state->mutex);
+		boost::system_time deadline = boost::get_system_time() +
+				boost::posix_time::milliseconds(min(timeoutMs, (size_t)INT_MAX));
+		while (_state->verified.empty() && _state->running > 0) {
+			if (timeoutMs == NOSIZE) _state->changed.wait(lock);
+			else if (!_state->changed.timed_wait(lock, deadline)) break;
+		}
+		if (_state->verified.empty()) return false;
+		proxy = _state->verified.front();
+		_state->verified.pop_front();
+		return true;
+	}
+
+	bool ProxyChecker::done() {
+		Mutex::scoped_lock lock(_state->mutex);
+		return _state->running == 0 && _state->verified.empty();
+	}
+
+	void ProxyChecker::run(boost::shared_ptr<State> state) {
+		while (true) {
+			string proxy;
+			{
+				Mutex::scoped_lock lock(state->mutex);
+				if (state->pending.empty()) {
+					--state->running;
+					state->changed.notify_all();
+					return;
 				}
-			} catch (Exception) {
-				// simply give up proxy
+				proxy = state->pending.front();
+				state->pending.pop_front();
+			}
+			bool ok = check(proxy);
+			Mutex::scoped_lock lock(state->mutex);
+			if (ok) {
+				state->verified.push_back(proxy);
+				state->changed.notify_all();
 			}
 		}
+	}
 
-		proxies = ret;
-		return ret.size();
+	bool ProxyChecker::check(const string &proxy) {
+		WebClient::BufferDataWriter db;
+		try {
+			WebClient wc(db);
+			wc.setConnectTimeout(10);
+			wc.setTimeout(30);
+			wc.setUrl("http://www.google.com/");
+			wc.setProxy(proxy);
+			return wc.perform() && db.data().find("google") != string::npos;
+		} catch (const Exception &) {
+			// simply give up proxy
+			return false;
+		}
+	}
+
+	/* CircuitBreaker */
+	CircuitBreaker::CircuitBreaker(const string &label) : _mutex(), _state(CLOSED), _failures(0), _trips(0),
+			_until(0.0), _probing(false), _seed((unsigned int)(monotonicSeconds() * 1e6)),
+			_tripCounter(MetricsRegistry::global().counter("pwxget_breaker_trips_total",
+					"Times a proxy was rested after failing.", metricLabels("proxy", label))),
+			_open(MetricsRegistry::global().gauge("pwxget_breaker_open",
+					"Whether a proxy is resting or on probation.", metricLabels("proxy", label))) {
+		for (size_t i=0; i<label.size(); i++) _seed = _seed * 31 + (unsigned char)label[i];
+	}
+
+	double CircuitBreaker::admit() {
+		const double PROBE_POLL = 0.25;
+		Mutex::scoped_lock lock(_mutex);
+		if (_trips >= MAX_TRIPS) return -1.0;
+		if (_state == CLOSED) return 0.0;
+		double now = monotonicSeconds();
+		if (_state == OPEN) {
+			if (now < _until) return _until - now;
+			_state = HALF_OPEN;
+		}
+		// one probe at a time
+		if (_probing) return PROBE_POLL;
+		_probing = true;
+		return 0.0;
+	}
+
+	void CircuitBreaker::success() {
+		Mutex::scoped_lock lock(_mutex);
+		_state = CLOSED;
+		_failures = _trips = 0;
+		_probing = false;
+		_open.set(0);
+	}
+
+	void CircuitBreaker::failure(double retryAfter) {
+		Mutex::scoped_lock lock(_mutex);
+		if (_state == OPEN) return; // sent before it opened
+		if (retryAfter >= 0) {
+			// told to wait, not broken
+			trip(min(max(retryAfter, (double)BASE_BACKOFF), (double)MAX_RETRY_AFTER));
+			return;
+		}
+		if (++_failures < FAILURES && _state == CLOSED) return;
+		++_trips;
+		double backoff = min(ldexp((double)BASE_BACKOFF, min(_trips - 1, 16)), (double)MAX_BACKOFF);
+		_seed = _seed * 1103515245 + 12345;
+		trip(backoff * (0.5 + 0.5 * ((_seed >> 16) & 0x7fff) / 32768.0));
+	}
+
+	void CircuitBreaker::trip(double seconds) {
+		_state = OPEN;
+		_failures = 0;
+		_until = monotonicSeconds() + seconds;
+		_probing = false;
+		_tripCounter.inc();
+		_open.set(1);
 	}
 
 	bool WebCtl::checkDownload(const string &url, const string &cookies,
-					const string &proxy, long long &fileSize, string &redirected) {
-		WebClient::DummyDataWriter db;
-		WebClient wc(db);
+					const string &proxy, long long &fileSize, string &redirected,
+					ProbeResult *probe, size_t probeSize, string *body, string *validator) {
+		// a server ignoring the range sends the whole file; take no more than asked
+		size_t probeLength = max(probeSize, (size_t)1);
+		WebClient::BufferDataWriter bodyWriter(body? probeLength: 0, probeLength);
+		WebClient wc(bodyWriter);
 
 		wc.setConnectTimeout(10);
 		wc.setTimeout(30);
 		wc.setUrl(url);
 		wc.setProxy(proxy);
 		wc.setCookies(cookies);
-		wc.setRange("0-1");
+		wc.setRange("0-" + boost::lexical_cast<string>(probeLength - 1));
 		//wc.setHeaderOnly(true);
 
-		if (!wc.perform()) return false;
+		CURLcode code = CURLE_OK;
+		if (!wc.perform(&code) && !(code == CURLE_WRITE_ERROR && bodyWriter.full())) return false;
 		if (!wc.supportRange())
 			fileSize = -1;
 		else
 			fileSize = wc.getFileSize();
 		redirected = wc.getResponseUrl();
+		if (validator) *validator = wc.getValidator();
+		if (body) {
+			// only a partial answer starts at byte 0
+			body->clear();
+			if (fileSize > 0 && wc.getHttpCode() == 206) body->swap(bodyWriter.data());
+		}
+
+		if (probe) {
+			double firstByte = wc.getFirstByteTime(),
+					body = wc.getTotalTime() - firstByte;
+			probe->rtt = max(firstByte - wc.getPretransferTime(), 0.0);
+			probe->bandwidth = body > 0.001? wc.getBodyBytes() / body: 0.0;
+		}
 
 		return true;
 	}
@@ -251,18 +565,86 @@ namespace PwxGet {
 	WebCtl::WebCtl(JobFile &jobFile, const SpeedProfile &speedProfile, size_t threadPerProxy) :
 		_reportLevel(INFO), _speedProfile(speedProfile), _proxies(),
 		_threadPerProxy(threadPerProxy),_jobFile(jobFile),
-		_fileBuffer(jobFile.savePath(), jobFile.fileSize(), jobFile, jobFile.sheetSize()),
-		_sheetCtl(_fileBuffer, speedProfile.pageSize, speedProfile.pageCount, speedProfile.scanCount),
-		_running(false), _workers(), _activeWorker(0), _threads(), _threadMutex(), _reportMutex() {
+		_fileBuffer(jobFile.savePath(), jobFile.sheetMap(), jobFile, jobFile.stream()),
+		_sheetCtl(_fileBuffer, speedProfile.pageSize, speedProfile.pageCount, speedProfile.scanCount,
+				speedProfile.maxPageCount),
+		_running(false), _workers(), _activeWorker(0), _threads(), _threadMutex(), _reportMutex(),
+		_tuneMutex(), _span(speedProfile.autoTune? 1: speedProfile.maxSpan),
+		_tunedPageCount(speedProfile.pageCount), _lastEvictions(0), _avgFirstByte(0.0), _avgRate(0.0),
+		_connections(0),
+		_received(), _speedWindow(SPEED_WINDOW), _globalLimit(), _proxyLimits(),
+		_defaultProxyRate(0.0), _customProxyRates(), _limitMutex(), _breakers(), _chunkCache(NULL), _chunkObject(),
+		_history(NULL), _historyHost(), _multiRange(MULTI_UNKNOWN) {
+		// a stream is only useful in order
+		if (jobFile.stream()) _sheetCtl.setPolicy(SheetCtl::PREFIX);
 	}
 
 	WebCtl::~WebCtl() {
+		// workers touch themselves until their thread returns
+		for (ThreadList::iterator t=_threads.begin(); t!=_threads.end(); t++) {
+			(*t)->join();
+			delete *t;
+		}
+		_threads.clear();
 		WorkerList::iterator it = _workers.begin();
 		while (it != _workers.end()) {
 			delete *it;
 			it++;
 		}
 		_workers.clear();
+		for (BucketMap::iterator b=_proxyLimits.begin(); b!=_proxyLimits.end(); b++) {
+			delete b->second;
+		}
+		_proxyLimits.clear();
+		for (BreakerMap::iterator b=_breakers.begin(); b!=_breakers.end(); b++) {
+			delete b->second;
+		}
+		_breakers.clear();
+	}
+
+	void WebCtl::setRateLimit(double rate) {
+		_globalLimit.setRate(rate);
+	}
+
+	double WebCtl::rateLimit() {
+		return _globalLimit.rate();
+	}
+
+	void WebCtl::setProxyRateLimit(double rate) {
+		Mutex::scoped_lock lock(_limitMutex);
+		_defaultProxyRate = rate;
+		for (BucketMap::iterator b=_proxyLimits.begin(); b!=_proxyLimits.end(); b++) {
+			if (!_customProxyRates.count(b->first)) b->second->setRate(rate);
+		}
+	}
+
+	void WebCtl::setProxyRateLimit(const string &proxy, double rate) {
+		Mutex::scoped_lock lock(_limitMutex);
+		_customProxyRates.insert(proxy);
+		proxyLimit(proxy)->setRate(rate);
+	}
+
+	double WebCtl::proxyRateLimit(const string &proxy) {
+		Mutex::scoped_lock lock(_limitMutex);
+		return proxyLimit(proxy)->rate();
+	}
+
+	TokenBucket *WebCtl::proxyLimit(const string &proxy) {
+		Mutex::scoped_lock lock(_limitMutex);
+		BucketMap::iterator b = _proxyLimits.find(proxy);
+		if (b != _proxyLimits.end()) return b->second;
+		TokenBucket *bucket = new TokenBucket(_defaultProxyRate);
+		_proxyLimits[proxy] = bucket;
+		return bucket;
+	}
+
+	CircuitBreaker &WebCtl::breaker(const string &proxy) {
+		Mutex::scoped_lock lock(_limitMutex);
+		BreakerMap::iterator b = _breakers.find(proxy);
+		if (b != _breakers.end()) return *b->second;
+		CircuitBreaker *breaker = new CircuitBreaker(proxyLabel(proxy));
+		_breakers[proxy] = breaker;
+		return *breaker;
 	}
 
 	void WebCtl::clearProxies() {
@@ -275,10 +657,16 @@ namespace PwxGet {
 		}
 	}
 
+	void WebCtl::addProxy(const string &proxy) {
+		Mutex::scoped_lock lock(_threadMutex);
+		_proxies.push_back(proxy);
+		if (isRunning()) startWorkers(proxy);
+	}
+
 	const string WebCtl::levelName(int level) {
-		static string knownLevelNames[] = {"", "DEBUG", "INFO", "WARNING", "CRITICAL"};
+		static string knownLevelNames[] = {"", "DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"};
 		int id = level / 10;
-		if (id * 10 != level || id < 1 || id > 4)
+		if (id * 10 != level || id < 1 || id > 5)
 			return "Lv" + boost::lexical_cast<string>(level);
 		return knownLevelNames[id];
 	}
@@ -299,70 +687,256 @@ namespace PwxGet {
 		--_activeWorker;
 	}
 
+	// runtime tuning
+	size_t WebCtl::requestSpan() throw() {
+		Mutex::scoped_lock lock(_tuneMutex);
+		return _span;
+	}
+
+	void WebCtl::tune(size_t bytes, double firstByte, double total) {
+		const double ALPHA = 0.2;			// weight of the newest sample
+		const double OVERHEAD_RATIO = 8.0;	// body time per first-byte wait
+		if (!_speedProfile.autoTune) return;
+		Mutex::scoped_lock lock(_tuneMutex);
+
+		// request span: make the body take several times the first-byte wait
+		double body = total - firstByte;
+		if (body > 0.001) {
+			double rate = bytes / body;
+			_avgRate = _avgRate > 0? _avgRate * (1 - ALPHA) + rate * ALPHA: rate;
+		}
+		_avgFirstByte = _avgFirstByte > 0? _avgFirstByte * (1 - ALPHA) + firstByte * ALPHA: firstByte;
+		size_t sheetSize = _jobFile.sheetSize();
+		size_t span = size_t(OVERHEAD_RATIO * _avgFirstByte * _avgRate / sheetSize);
+		// shrink towards the tail so the last sheets still spread over all connections
+		size_t connections = max(_connections.load(boost::memory_order_relaxed), (size_t)1);
+		span = min(span, _sheetCtl.unissuedSheet() / (connections * 2));
+		_span = max((size_t)1, min(span, _speedProfile.maxSpan));
+
+		// cache: grow while pages get evicted before they are complete
+		size_t evictions = _sheetCtl.partialEvictions();
+		if (evictions > _lastEvictions && _tunedPageCount < _speedProfile.maxPageCount) {
+			_tunedPageCount = min(_tunedPageCount + max(_tunedPageCount / 4, (size_t)1),
+					_speedProfile.maxPageCount);
+			_sheetCtl.setPageCount(_tunedPageCount);
+			report(DEBUG, "Cache grown to " + boost::lexical_cast<string>(_tunedPageCount) + " pages.");
+		}
+		_lastEvictions = evictions;
+	}
+
+	const string WebCtl::proxyLabel(const string &proxy) {
+		return proxy.empty()? "direct": proxy;
+	}
+
 	// Thread workers
 	WebCtl::Worker::Worker(WebCtl &ctl, const string& proxy) : _ctl(ctl), _proxy(proxy),
-			_dw(ctl.speedProfile().sheetSize), _wc(_dw, ctl.speedProfile().sheetSize),
-			_isRunning(false) {
+			_dw(ctl.jobFile().sheetSize() * ctl.speedProfile().maxSpan, MAX_REQUEST_RANGES),
+			_wc(_dw, ctl.jobFile().sheetSize()),
+			_isRunning(false),
+			_bytes(MetricsRegistry::global().counter("pwxget_received_bytes_total",
+					"Body bytes received.", metricLabels("proxy", proxyLabel(proxy)))),
+			_requests(MetricsRegistry::global().counter("pwxget_requests_total",
+					"Range requests sent.", metricLabels("proxy", proxyLabel(proxy)))),
+			_firstByteTime(MetricsRegistry::global().histogram("pwxget_first_byte_seconds",
+					"Time from request start to the first response byte.",
+					metricLabels("proxy", proxyLabel(proxy)))),
+			_requestTime(MetricsRegistry::global().histogram("pwxget_request_seconds",
+					"Time of a whole range request.", metricLabels("proxy", proxyLabel(proxy)))),
+			// a range request answers 206, or 200 from a server that ignores ranges;
+			// registered now, neither answer allocates
+			_partialAnswers(MetricsRegistry::global().counter("pwxget_http_responses_total",
+					"Responses by HTTP status.", metricLabels("proxy", proxyLabel(proxy), "status", "206"))),
+			_wholeAnswers(MetricsRegistry::global().counter("pwxget_http_responses_total",
+					"Responses by HTTP status.", metricLabels("proxy", proxyLabel(proxy), "status", "200"))),
+			_runs(), _stats(),
+			_breaker(ctl.breaker(proxy)) {
+		_runs.reserve(MAX_REQUEST_RANGES);
 		_wc.setProxy(_proxy);
 		_wc.setCookies(_ctl.jobFile().cookies());
 		_wc.setUrl(_ctl.jobFile().url());
+		_wc.setProgressCounter(&_ctl._received);
+		_wc.setRateLimits(&_ctl._globalLimit, _ctl.proxyLimit(_proxy));
 	}
 
 	WebCtl::Worker::~Worker() {}
 
-	const string WebCtl::Worker::getRange(size_t sheet) const throw() {
-		size_t start = sheet * _ctl.jobFile().sheetSize(),
-				end = (sheet+1) * _ctl.jobFile().sheetSize() - 1;
-		if (end >= _ctl.jobFile().fileSize()) end = _ctl.jobFile().fileSize() - 1;
-		return boost::lexical_cast<string>(start) + "-" + boost::lexical_cast<string>(end);
+	const char *WebCtl::Worker::formatRange() {
+		const SheetMap &sheets = _ctl.fileBuffer().sheetMap();
+		size_t n = 0;
+		for (size_t i=0; i<_runs.size(); i++) {
+			// the bytes kept of the first sheet are not asked for again
+			size_t start = sheets.offset(_runs[i].sheet) + _runs[i].skip,
+					end = sheets.offset(_runs[i].sheet + _runs[i].count) - 1;
+			n += snprintf(_range + n, sizeof(_range) - n, "%s%llu-%llu", i? ",": "",
+					(unsigned long long)start, (unsigned long long)end);
+			// whole sheets in the buffer, the cache takes nothing less
+			_dw.addRange(start, end, sheets.bytes(_runs[i].sheet, _runs[i].count), _runs[i].skip);
+		}
+		return _range;
+	}
+
+	size_t WebCtl::Worker::arrived() const throw() {
+		const SheetMap &sheets = _ctl.fileBuffer().sheetMap();
+		size_t reached = _dw.reached();
+		return reached > sheets.offset(sheet)? sheets.sheetAt(reached) - sheet: 0;
+	}
+
+	void WebCtl::Worker::cut(size_t end) throw() {
+		_dw.stopAt(_ctl.fileBuffer().sheetMap().offset(end));
 	}
 
 	void WebCtl::Worker::terminate() {
 		_wc.terminate();
 	}
 
+	void WebCtl::Worker::recordRequest(bool ok, CURLcode code) {
+		MetricsRegistry &registry = MetricsRegistry::global();
+		_requests.inc();
+		_bytes.inc(_wc.getBodyBytes());
+		if (!ok) {
+			registry.counter("pwxget_request_failures_total", "Failed requests by curl code.",
+					metricLabels("proxy", proxyLabel(_proxy), "curl_code", boost::lexical_cast<string>(code))).inc();
+			return;
+		}
+		_firstByteTime.observe(_wc.getFirstByteTime());
+		_requestTime.observe(_wc.getTotalTime());
+		int status = _wc.getHttpCode();
+		if (status == 206) _partialAnswers.inc();
+		else if (status == 200) _wholeAnswers.inc();
+		else registry.counter("pwxget_http_responses_total", "Responses by HTTP status.",
+				metricLabels("proxy", proxyLabel(_proxy), "status", boost::lexical_cast<string>(status))).inc();
+	}
+
+	// split the finished request into phases using curl's own timings
+	void WebCtl::Worker::traceRequest(double began, size_t sheet, size_t count) {
+		Tracer &tracer = Tracer::global();
+		double connect = _wc.getConnectTime(), pretransfer = _wc.getPretransferTime(),
+				firstByte = _wc.getFirstByteTime(), total = _wc.getTotalTime();
+		tracer.record("request", began, began + total, sheet, count);
+		tracer.record("connect", began, began + connect);
+		if (firstByte > 0) {
+			tracer.record("ttfb", began + pretransfer, began + firstByte);
+			tracer.record("body", began + firstByte, began + total, sheet, count);
+		}
+	}
+
 	void WebCtl::Worker::operator()() {
-		size_t sheet, token;
+		size_t token;
+		const SheetMap &sheetMap = _ctl.fileBuffer().sheetMap();
 		string viaProxy;
-		string url = _ctl.jobFile().url();
 		string cookies = _ctl.jobFile().cookies();
 		if (!_proxy.empty())
 			viaProxy = " via proxy " + _proxy;
 		// loop and do job
 		_isRunning = true;
+		Tracer &tracer = Tracer::global();
+		tracer.setThreadName("worker " + proxyLabel(_proxy));
+		_ctl.sheetCtl().attach(*this);
+		// active once set up: from here on the loop allocates nothing
 		_ctl.increaseActive();
-		int errorCount = 0, continousError = 0;
 		try {
-			_ctl.report(DEBUG, "Enter download mode.");
-			while (_ctl.isRunning() && _ctl.sheetCtl().fetch(sheet, token)) {
-				string range = getRange(sheet);
-				_ctl.report(DEBUG, "Download range " + range + " ...");
-				_wc.reset(); _dw.clear();
-				_wc.setUrl(url);
+			if (_ctl.reports(DEBUG)) _ctl.report(DEBUG, "Enter download mode.");
+			while (_ctl.isRunning()) {
+				// a resting proxy takes no sheets
+				double wait = _breaker.admit();
+				if (wait < 0) {
+					_ctl.report(ERROR, "Web client" + viaProxy + " gave up, the proxy keeps failing.");
+					break;
+				}
+				if (wait > 0) {
+					if (!rest(wait)) break;
+					continue;
+				}
+				size_t sheets = 0;
+				{
+					TraceSpan span("fetch");
+					// before the fetch, which may hand the run out splittable
+					_dw.clear();
+					if (!_ctl.sheetCtl().fetch(_runs, token, _ctl.requestSpan(),
+							_ctl.multiRange()? MAX_REQUEST_RANGES: 1, this)) break;
+					for (size_t i=0; i<_runs.size(); i++) sheets += _runs[i].count;
+					span.sheets(_runs.front().sheet, sheets);
+				}
+				// url and proxy stay as the constructor set them
+				const char *range = formatRange();
+				if (_ctl.reports(DEBUG)) _ctl.report(DEBUG, "Download range " + string(range) + " ...");
 				_wc.setRange(range);
-				_wc.setCookies(cookies);
-				_wc.setProxy(_proxy);
-				if (!_wc.perform()) {
-					++errorCount; ++continousError;
-					_ctl.sheetCtl().rollback(sheet, token);
-					_ctl.report(ERROR, "Download range " + range + " failed, http code " +
-							boost::lexical_cast<string>(_wc.getHttpCode()) + ".");
-					if (continousError > MAX_WEBCLIENT_CONTINOUS_ERROR) {
-						break; // maximum retry
+				_wc.setCookies(cookies); // and forget those the server set
+				CURLcode code = CURLE_OK;
+				double began = monotonicSeconds();
+				bool ok = _wc.perform(&code);
+				if (_ctl.sheetCtl().settle(*this) && end != _runs[0].sheet + _runs[0].count) {
+					// the tail went to another worker, the writer ended the transfer there
+					_runs[0].count = end - _runs[0].sheet;
+				}
+				if (!ok && code == CURLE_WRITE_ERROR) {
+					// the writer also ends a whole-file answer once it passed every run
+					ok = true;
+					for (size_t i=0; i<_runs.size(); i++) ok = ok && _dw.complete(i);
+				}
+				recordRequest(ok, code);
+				if (tracer.enabled()) traceRequest(began, _runs.front().sheet, sheets);
+				// what arrived is kept, even from a failed transfer
+				size_t missing = 0;
+				for (size_t i=0; i<_runs.size(); i++) {
+					const SheetCtl::Run &run = _runs[i];
+					const char *data = _dw.data(i) - run.skip; // from the first sheet's start
+					size_t committed = run.count;
+					if (_dw.complete(i)) {
+						_ctl.sheetCtl().commit(run.sheet, run.count, token, data, run.skip);
+					} else {
+						committed = _ctl.sheetCtl().salvage(run.sheet, run.count, token, data, run.skip,
+								run.skip + _dw.received(i));
+						missing += run.count - committed;
 					}
+					// the chunk cache takes sheets held here in full
+					size_t partial = run.skip? 1: 0;
+					if (committed > partial)
+						_ctl.storeChunks(run.sheet + partial, committed - partial, data + sheetMap.bytes(run.sheet, partial));
+				}
+				if (_runs.size() > 1) {
+					// a single part or a 200 falls back even when it brought every run
+					if (_dw.multipart()) _ctl.multiRangeWorks();
+					else _ctl.multiRangeFailed(_wc.getHttpCode() / 100 == 2);
+				}
+				_stats.add(!missing, _wc.getBodyBytes(), _wc.getFirstByteTime(), _wc.getTotalTime());
+				if (missing) {
+					int status = _wc.getHttpCode();
+					if (_ctl.reports(ERROR)) _ctl.report(ERROR, "Download range " + string(range) +
+							" failed, http code " + boost::lexical_cast<string>(status) + ".");
+					_breaker.failure(status == 429 || status == 503? (double)_wc.getRetryAfter(): -1.0);
 				} else {
-					continousError = 0;
-					_ctl.sheetCtl().commit(sheet, token, _dw.data().data());
+					_breaker.success();
+					_ctl.tune(_wc.getBodyBytes(), _wc.getFirstByteTime(), _wc.getTotalTime());
 				}
 			}
-			_ctl.report(DEBUG, "Leave download mode.");
+			if (_ctl.reports(DEBUG)) _ctl.report(DEBUG, "Leave download mode.");
 		} catch (const Exception& ex) {
 			_ctl.report(ERROR, "Web client" + viaProxy + " terminated. " + ex.message());
 		}
+		_ctl.sheetCtl().detach(*this);
+		// before it counts as gone, so the history is complete once none is active
+		if (_ctl._history) _ctl._history->record(_proxy, _ctl._historyHost, _stats);
 		_ctl.decreaseActive();
 		_isRunning = false;
 	}
 
+	bool WebCtl::Worker::rest(double seconds) {
+		const double SLICE = 0.1;
+		TraceSpan span("rest");
+		double until = monotonicSeconds() + seconds;
+		try {
+			// the download may end while the proxy rests
+			while (_ctl.isRunning() && !_ctl.sheetCtl().allDone()) {
+				double left = until - monotonicSeconds();
+				if (left <= 0) return true;
+				boost::this_thread::sleep(boost::posix_time::microseconds((long long)(min(left, SLICE) * 1e6)));
+			}
+		} catch (const boost::thread_interrupted &) {
+		}
+		return false;
+	}
+
 	// create workers & run
 	bool WebCtl::isRunning() throw() {
 		Mutex::scoped_lock lock(_threadMutex);
@@ -375,12 +949,7 @@ namespace PwxGet {
 	}
 
 	double WebCtl::getSpeed() {
-		Mutex::scoped_lock lock(_threadMutex);
-		double ret = 0.0;
-		for (WorkerList::iterator it=_workers.begin(); it!=_workers.end(); it++) {
-			ret += (*it)->client().getDownloadSpeed();
-		}
-		return ret;
+		return _speedWindow.sample(monotonicSeconds(), _received.value());
 	}
 
 	void WebCtl::perform() {
@@ -391,16 +960,83 @@ namespace PwxGet {
 		// create workers
 		list<string>::const_iterator it = _proxies.begin();
 		while (it != _proxies.end()) {
-			for (size_t i=0; i<_threadPerProxy; i++) {
-				Worker *worker = new Worker(*this, *it);
-				boost::thread *thread = new boost::thread(boost::ref(*worker));
-				_workers.push_back(worker);
-				_threads.push_back(thread);
-			}
+			startWorkers(*it);
 			it++;
 		}
 	}
 
+	void WebCtl::setChunkCache(ChunkCache *cache, const string &object) {
+		_chunkCache = cache;
+		_chunkObject = object;
+	}
+
+	void WebCtl::setHistory(ProxyHistory *history, const string &host) {
+		_history = history;
+		_historyHost = host;
+	}
+
+	size_t WebCtl::loadChunks() {
+		if (!_chunkCache || _chunkObject.empty()) return 0;
+		const SheetMap &sheets = _fileBuffer.sheetMap();
+		size_t loaded = 0;
+		bool cloning = !_fileBuffer.stream();
+		const byte *index = _fileBuffer.index();
+		ChunkCache::ChunkMap chunks;
+		_chunkCache->list(_chunkObject, chunks);
+		if (chunks.empty()) return 0;
+		vector<FileBuffer::Source> pieces;
+		string buffer(sheets.sheetSize(), '\0');
+		for (size_t sheet=0; sheet<_fileBuffer.sheetCount(); sheet++) {
+			if (index[sheet]) continue;
+			// a stream holds no more than its window
+			if (sheet >= _sheetCtl.cache().windowEnd()) break;
+			size_t offset = sheets.offset(sheet), length = sheets.length(sheet);
+			if (!_chunkCache->find(_chunkObject, chunks, offset, length, pieces)) continue;
+			if (cloning) {
+				if (_fileBuffer.clone(sheet, pieces)) {
+					++loaded;
+					continue;
+				}
+				cloning = false; // not on this file system, copy the rest
+			}
+			if (_chunkCache->load(pieces, &buffer[0]) && _sheetCtl.preload(sheet, buffer.data()))
+				++loaded;
+		}
+		if (loaded) _sheetCtl.flush();
+		return loaded;
+	}
+
+	void WebCtl::storeChunks(size_t sheet, size_t count, const char *data) {
+		if (!_chunkCache || _chunkObject.empty()) return;
+		const SheetMap &sheets = _fileBuffer.sheetMap();
+		for (size_t i=0; i<count && sheet + i < sheets.sheetCount(); i++) {
+			_chunkCache->store(_chunkObject, sheets.offset(sheet + i), sheets.length(sheet + i),
+					data + sheets.bytes(sheet, i));
+		}
+	}
+
+	void WebCtl::multiRangeFailed(bool answered) {
+		// one part or the whole file for several ranges, or no answer before any worked
+		int state = _multiRange.load();
+		if (state == MULTI_NO || (!answered && state == MULTI_YES)) return;
+		if (_multiRange.exchange(MULTI_NO) != MULTI_NO)
+			report(INFO, "Server does not answer multi-range requests, asking for one range at a time.");
+	}
+
+	void WebCtl::startWorkers(const string &proxy) {
+		size_t threads = _history? _history->concurrency(proxy, _historyHost, _threadPerProxy): _threadPerProxy;
+		if (threads < _threadPerProxy && reports(INFO))
+			report(INFO, "Proxy " + proxyLabel(proxy) + " was slow before, opening " +
+					boost::lexical_cast<string>(threads) + " connections.");
+		for (size_t i=0; i<threads; i++) {
+			Worker *worker = new Worker(*this, proxy);
+			boost::thread *thread = new boost::thread(boost::ref(*worker));
+			_workers.push_back(worker);
+			_threads.push_back(thread);
+		}
+		_connections.fetch_add(threads, boost::memory_order_relaxed);
+	}
+
 	void WebCtl::terminate(size_t waitWebTimeout) {
 		{
 			Mutex::scoped_lock lock(_threadMutex);
@@ -408,6 +1044,7 @@ namespace PwxGet {
 			report(WARNING, "Terminate workers because of user interrupt.");
 			// set stop flag
 			setRunning(false);
+			_sheetCtl.cancel();
 		}
 		{
 			// sleep for a short time before kill web clients
@@ -436,7 +1073,11 @@ namespace PwxGet {
 		for (ThreadList::iterator it=threads.begin(); it!=threads.end(); it++) {
 			(*it)->interrupt();
 		}
-		boost::this_thread::sleep(boost::posix_time::milliseconds(50)); // Wait for file flush.
+		// a worker stays attached to the scheduler, which splits and steals
+		// through it, until its thread returns
+		for (ThreadList::iterator it=threads.begin(); it!=threads.end(); it++) {
+			(*it)->join();
+		}
 		// dispose objects
 		for (WorkerList::iterator it=workers.begin(); it!=workers.end(); it++) {
 			delete *it;
@@ -10,9 +10,18 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <deque>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
 #include "filebuffer.h"
 #include "webclient.h"
 #include "sheetctl.h"
+#include "metrics.h"
+#include "chunkcache.h"
+#include "proxyhistory.h"
 
 namespace PwxGet {
 	using namespace std;
@@ -20,11 +29,18 @@ namespace PwxGet {
 	const size_t DEFAULT_THREAD_COUNT = 5;
 	const size_t NOSIZE = (size_t)-1;
 	const size_t WAIT_SECONDS_BEFORE_TERMINATE = 10000;
-	const int MAX_WEBCLIENT_CONTINOUS_ERROR = 100;
+	const size_t MAX_REQUEST_RANGES = 16; // ranges in one multi-range request
+	const size_t MAX_PROXY_CHECKS = 8;
 
+	/**
+	 * A job file holds the job's header and its packed sheet index. A job
+	 * with a tapered sheet map is flagged MAGIC_FLAG_TAPERED and adds its
+	 * tail zones and sheets per zone after the sheet size; older versions
+	 * refuse it instead of misreading the index.
+	 */
 	class JobFile : public FileBuffer::PackedIndex {
 	public:
-		static const unsigned int MAGIC_FLAG;
+		static const unsigned int MAGIC_FLAG, MAGIC_FLAG_TAPERED;
 
 		// construct & destruct
 		JobFile();
@@ -40,30 +56,59 @@ namespace PwxGet {
 		bool useRedirectedUrl() const throw() { return _useRedirectedUrl; }
 		size_t fileSize() const throw() { return _fileSize; }
 		size_t sheetSize() const throw () { return _sheetSize; }
+		const SheetMap sheetMap() const throw() { return SheetMap(_fileSize, _sheetSize, _tailZones, _zoneSheets); }
+		bool stream() const throw() { return _stream; }
 
 		void open(const string &savePath);
+		/**
+		 * @param connections: Taper the end of the file for this many
+		 * 		connections (see SheetMap::tapered), 0 for sheets all of sheetSize.
+		 */
 		void create(const string &url, /*const string &url2, */const string &cookies,
-				const string &savePath, bool useRedirectedUrl, size_t fileSize, size_t sheetSize);
-		void flush();
+				const string &savePath, bool useRedirectedUrl, size_t fileSize, size_t sheetSize,
+				size_t connections=0);
+		// A job streamed to a pipe or stdout ("-"): kept in memory only, never resumed.
+		void createStream(const string &url, const string &cookies, const string &savePath,
+				bool useRedirectedUrl, size_t fileSize, size_t sheetSize, size_t connections=0);
+		/**
+		 * Replace a lost or broken job file: create the job anew and mark the
+		 * sheets the output file already holds (see FileBuffer::recover).
+		 * @return Sheets recovered.
+		 */
+		size_t recover(const string &url, const string &cookies, const string &savePath,
+				bool useRedirectedUrl, size_t fileSize, size_t sheetSize, bool checkZeros=true,
+				size_t connections=0);
+		/**
+		 * Lay the job out in sheets anew, keeping the data already written:
+		 * a new sheet is done if the done sheets of the old layout cover it
+		 * whole. The job file is rewritten and synced.
+		 * @return Sheets done in the new layout.
+		 */
+		size_t regrid(const SheetMap &sheets);
+		// Write the job file anew; sync as for setData.
+		void flush(bool sync=false);
 		void close() throw();
 
 		// implement packedIndex
 		virtual const string &getData() const;
-		virtual void setData(const string &data);
+		virtual void setData(const string &data, bool sync=false);
 		virtual bool isValid() const throw();
 		virtual const string identifier() const throw();
 
 	protected:
 		string _url, _url2, _cookies;
 		string _savePath, _jobPath;
-		bool _useRedirectedUrl;
+		bool _useRedirectedUrl, _stream;
 		size_t _fileSize, _sheetSize;
+		size_t _tailZones, _zoneSheets; // of the sheet map, 0 if uniform
 		string _index;
-		fstream _jobFile;
+		bool _open;			// flushes write the job file
+		string _tempPath;	// the job file is written here, then renamed over
+		WebClient::DataBuffer _header; // header and index, reused by every flush
+		void setSheetMap(const SheetMap &sheets);
 		size_t indexSize() const throw();
 		size_t headerSize() const throw();
-		void writeBytes(const char *data, size_t n);
-		void read(const string &checkSavePath);
+		void read(istream &in, const string &checkSavePath);
 	};
 
 	// control the download sheet size and page size
@@ -71,19 +116,141 @@ namespace PwxGet {
 	public:
 		inline SpeedProfile(size_t sheetSize=DEFAULT_SHEET_SIZE,
 				size_t pageSize=DEFAULT_PAGE_SIZE, size_t pageCount=DEFAULT_PAGE_COUNT,
-				size_t scanCount=DEFAULT_SCAN_COUNT, const string &name=string()) :
+				size_t scanCount=DEFAULT_SCAN_COUNT, const string &name=string(),
+				size_t maxSpan=1, size_t maxPageCount=0, bool autoTune=false) :
 				sheetSize(sheetSize), pageSize(pageSize), pageCount(pageCount),
-				scanCount(scanCount), name(name) {}
+				scanCount(scanCount), maxSpan(maxSpan), maxPageCount(max(maxPageCount, pageCount)),
+				autoTune(autoTune), name(name) {}
 		inline SpeedProfile(const SpeedProfile &other) : sheetSize(other.sheetSize),
 				pageSize(other.pageSize), pageCount(other.pageCount), scanCount(other.scanCount),
+				maxSpan(other.maxSpan), maxPageCount(other.maxPageCount), autoTune(other.autoTune),
 				name(other.name) {}
 		inline ~SpeedProfile() {}
 		size_t sheetSize, pageSize, pageCount, scanCount;
+		size_t maxSpan;			// most sheets in a single request
+		size_t maxPageCount;	// ceiling for the cache when tuning
+		bool autoTune;			// adjust span & cache while downloading
 		string name;
 	};
 
+	// What a probe request told about the route to the target.
+	struct ProbeResult {
+	public:
+		inline ProbeResult() : rtt(0.0), bandwidth(0.0) {}
+		double rtt;			// seconds from request sent to first byte
+		double bandwidth;	// bytes/s of a single connection, 0 if unknown
+	};
+
 	extern size_t KB, MB, GB;
 	extern SpeedProfile SPD_EXTREME, SPD_HIGH, SPD_MEDIUM, SPD_LOW;
+	// Fixed profile by name (extreme, high, medium, low and their aliases).
+	bool speedProfileByName(const string &name, SpeedProfile &profile);
+	const size_t PROBE_SIZE = 1024 * 1024;
+
+	/**
+	 * Parse sizes like 65536, 64K, 8M or 1G.
+	 */
+	size_t parseSize(const string &text);
+	/**
+	 * Parse a durability: none, strict, or interval[:ms[:size]] like
+	 * interval:500:16M.
+	 */
+	Durability parseDurability(const string &text);
+
+	// Output goes to stdout ("-") or a named pipe.
+	bool isStreamPath(const string &path);
+
+	/**
+	 * Derive a profile from the download at hand instead of a fixed one.
+	 * @param fileSize: Target file size.
+	 * @param connections: Number of concurrent workers.
+	 * @param probe: Measured round trip and bandwidth.
+	 * @param sheetSize: Keep this sheet size (resumed job), 0 to choose one.
+	 */
+	SpeedProfile autoSpeedProfile(size_t fileSize, size_t connections,
+			const ProbeResult &probe, size_t sheetSize=0);
+	/**
+	 * Whether a resumed job of sheetSize should be regridded to profile:
+	 * a fixed profile always gets its sheet size, an auto one only when it
+	 * is REGRID_FACTOR times larger or smaller, since regridding refetches
+	 * the new sheets the old done ones only partly cover.
+	 */
+	bool shouldRegrid(size_t sheetSize, const SpeedProfile &profile);
+	const size_t REGRID_FACTOR = 4;
+
+	/**
+	 * Qualifies proxies in the background, a few at a time, and hands
+	 * out each one as soon as it is verified.
+	 */
+	class ProxyChecker {
+	public:
+		ProxyChecker(const list<string> &proxies, size_t parallel=MAX_PROXY_CHECKS);
+		// Checks still running are abandoned, not waited for.
+		virtual ~ProxyChecker();
+		/**
+		 * Take the next verified proxy.
+		 * @param timeoutMs: How long to wait for one; 0 only polls, NOSIZE waits
+		 * 		until one is verified or all are checked.
+		 */
+		bool next(string &proxy, size_t timeoutMs=NOSIZE);
+		// Every proxy checked and taken.
+		bool done();
+	protected:
+		typedef boost::mutex Mutex;
+		// shared with the threads, which may outlive the checker
+		struct State {
+			Mutex mutex;
+			boost::condition_variable changed;
+			deque<string> pending, verified;
+			size_t running;
+		};
+		boost::shared_ptr<State> _state;
+		static void run(boost::shared_ptr<State> state);
+		static bool check(const string &proxy);
+	};
+
+	/**
+	 * Shared by the workers of one proxy, so a proxy gone bad rests instead
+	 * of taking sheets only to give them back.
+	 *
+	 * After FAILURES failed requests in a row it opens: no request goes
+	 * through the proxy for BASE_BACKOFF seconds, doubled with every trip
+	 * up to MAX_BACKOFF, of which a random part is left out so its workers
+	 * do not all come back at once; or for as long as a 429 or 503 asked
+	 * with Retry-After. Then one request probes it (half-open): a success
+	 * closes it, a failure opens it again. After MAX_TRIPS trips without a
+	 * success in between the proxy is given up.
+	 */
+	class CircuitBreaker {
+	public:
+		CircuitBreaker(const string &label);
+		/**
+		 * Ask to send a request. Each one let through must end in
+		 * success() or failure().
+		 * @return 0 to go ahead, else seconds to wait before asking again;
+		 * 		negative once given up.
+		 */
+		double admit();
+		void success();
+		// retryAfter: seconds the server asked to wait, negative if it did not
+		void failure(double retryAfter=-1.0);
+
+		static const int FAILURES = 3;
+		static const int MAX_TRIPS = 10;
+		static const int BASE_BACKOFF = 1, MAX_BACKOFF = 60, MAX_RETRY_AFTER = 300;
+	protected:
+		typedef boost::mutex Mutex;
+		enum State { CLOSED, OPEN, HALF_OPEN };
+		Mutex _mutex;
+		State _state;
+		int _failures, _trips;
+		double _until;		// monotonic time the rest ends
+		bool _probing;		// the half-open request is out
+		unsigned int _seed;
+		Counter &_tripCounter;
+		Gauge &_open;
+		void trip(double seconds); // call with _mutex held
+	};
 
 	class WebCtl {
 	public:
@@ -98,48 +265,105 @@ namespace PwxGet {
 		inline SheetCtl &sheetCtl() throw() { return _sheetCtl; }
 		inline int &reportLevel() throw() { return _reportLevel; }
 		inline size_t activeWorker() const throw() { return _activeWorker; }
+		// Sheets per request, adjusted at runtime for auto profiles.
+		size_t requestSpan() throw();
+		// Workers ask for scattered sheets in one request until the server fails to answer so.
+		inline bool multiRange() const throw() { return _multiRange.load(boost::memory_order_relaxed) != MULTI_NO; }
 
 		// set proxies
 		void clearProxies();
 		void addProxies(const list<string> &proxies);
+		// Add a proxy; once perform() ran, its workers start at once.
+		void addProxy(const string &proxy);
+
+		// bandwidth caps in bytes/s, 0 for none; may change while running
+		void setRateLimit(double rate);
+		double rateLimit();
+		// Cap for each proxy that has no cap of its own.
+		void setProxyRateLimit(double rate);
+		void setProxyRateLimit(const string &proxy, double rate);
+		double proxyRateLimit(const string &proxy);
+
+		/**
+		 * Before perform(): share sheets with a chunk cache, NULL for none.
+		 * @param object: The file's name in it (ChunkCache::object).
+		 */
+		void setChunkCache(ChunkCache *cache, const string &object);
+		// Commit the sheets the chunk cache holds; returns how many.
+		size_t loadChunks();
+		/**
+		 * Before perform(): open fewer connections through proxies the
+		 * history knows to be slow, and record how each one did; NULL for none.
+		 * @param host: The target's, ProxyHistory::hostOf.
+		 */
+		void setHistory(ProxyHistory *history, const string &host);
 
 		// console output
-		static const int DEBUG = 10, INFO = 20, WARNING = 30, CRITICAL = 40;
+#ifdef ERROR
+#undef ERROR // wingdi.h
+#endif
+		static const int DEBUG = 10, INFO = 20, WARNING = 30, ERROR = 40, CRITICAL = 50;
 		virtual const string levelName(int level);
 		virtual void report(int level, const string &message);
+		// Whether report() prints level; check before building a message.
+		inline bool reports(int level) const throw() { return level >= _reportLevel; }
 
 		// do perform
 		// bool started() const throw();
 		bool isRunning() throw();
 		void perform();
 		void terminate(size_t waitWebTimeout = WAIT_SECONDS_BEFORE_TERMINATE);
+		// Bytes/s received over the last SPEED_WINDOW seconds; no worker lock is taken.
 		double getSpeed();
+		inline unsigned long long receivedBytes() const throw() { return _received.value(); }
+		static const int SPEED_WINDOW = 5;
 
 		// flush data
 		void flush();
 
+		// label used for a proxy in metrics, "direct" for none
+		static const string proxyLabel(const string &proxy);
+
 		// before perform; utilities
 		static size_t checkProxies(list<string> &proxies);
+		// body, if given, gets the probed bytes when the server answered the range;
+		// validator the ETag or Last-Modified (WebClient::getValidator)
 		static bool checkDownload(const string &url, const string &cookies,
-				const string &proxy, long long &fileSize, string &redirected);
+				const string &proxy, long long &fileSize, string &redirected,
+				ProbeResult *probe=NULL, size_t probeSize=2, string *body=NULL,
+				string *validator=NULL);
 
 	protected:
 		// The worker to execute the requests
-		class Worker {
+		class Worker : public SheetCtl::Transfer {
 		public:
 			Worker(WebCtl &ctl, const string& proxy);
 			~Worker();
 			void operator()();
 			void terminate();
+			virtual size_t arrived() const throw();
+			virtual void cut(size_t end) throw();
 			inline bool isRunning() const throw() { return _isRunning; }
 			inline WebClient &client() { return _wc; }
 		protected:
 			WebCtl &_ctl;
 			string _proxy;
-			WebClient::BufferDataWriter _dw;
+			WebClient::RangeDataWriter _dw;
 			WebClient _wc;
 			bool _isRunning;
-			const string getRange(size_t sheet) const throw();
+			// metrics of this worker's proxy
+			Counter &_bytes, &_requests;
+			Histogram &_firstByteTime, &_requestTime;
+			Counter &_partialAnswers, &_wholeAnswers;	// 206 and 200
+			SheetCtl::Runs _runs;	// the request at hand
+			ProxyStats _stats;		// for the history
+			CircuitBreaker &_breaker;	// of this worker's proxy
+			char _range[MAX_REQUEST_RANGES * 42];	// "first-last,..." of _runs
+			const char *formatRange();
+			void recordRequest(bool ok, CURLcode code);
+			void traceRequest(double began, size_t sheet, size_t count);
+			// Sleep while the proxy rests; false if the download ended meanwhile.
+			bool rest(double seconds);
 		};
 
 		typedef boost::recursive_mutex Mutex;
@@ -160,9 +384,50 @@ namespace PwxGet {
 		ThreadList _threads;
 		Mutex _threadMutex, _reportMutex;
 
+		// runtime tuning
+		Mutex _tuneMutex;
+		size_t _span, _tunedPageCount, _lastEvictions;
+		double _avgFirstByte, _avgRate;
+		boost::atomic<size_t> _connections; // workers started; read without _threadMutex
+
+		// throughput
+		Counter _received;
+		RateWindow _speedWindow;
+
+		// shaping; buckets live as long as the controller
+		typedef map<string, TokenBucket*> BucketMap;
+		TokenBucket _globalLimit;
+		BucketMap _proxyLimits;
+		double _defaultProxyRate;
+		set<string> _customProxyRates;
+		Mutex _limitMutex;
+		TokenBucket *proxyLimit(const string &proxy);
+		typedef map<string, CircuitBreaker*> BreakerMap;
+		BreakerMap _breakers;	// guarded by _limitMutex too
+		CircuitBreaker &breaker(const string &proxy);
+
+		ChunkCache *_chunkCache;
+		string _chunkObject;
+		ProxyHistory *_history;
+		string _historyHost;
+		void storeChunks(size_t sheet, size_t count, const char *data);
+
+		// what the server makes of a multi-range request
+		enum { MULTI_UNKNOWN, MULTI_YES, MULTI_NO };
+		boost::atomic<int> _multiRange;
+		inline void multiRangeWorks() throw() {
+			int unknown = MULTI_UNKNOWN;
+			_multiRange.compare_exchange_strong(unknown, MULTI_YES);
+		}
+		// answered: a 2xx that was not multipart; other failures count until one worked
+		void multiRangeFailed(bool answered);
+
 		void setRunning(bool running) throw();
+		void startWorkers(const string &proxy); // call with _threadMutex held
 		void increaseActive() throw();
 		void decreaseActive() throw();
+		// feed one finished request into the tuner
+		void tune(size_t bytes, double firstByte, double total);
 	};
 
 